@@ -0,0 +1,105 @@
+#ifndef _ADAPT_INCLUDE_
+#define _ADAPT_INCLUDE_
+
+#include <stdint.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Adaptive choice between checking progressions directly (zrcheckone/zrcheckafew) and lifting them (zrchecklift) in procd and procdcoprime.
+
+    By default we check directly when the progression length l <= ZSHORT or the total number of z's l*c <= ZFEW (where c is the number of
+    progressions).  If ADAPTIVE is defined at compile time, each worker instead keeps a table of the measured cost (in cycles per call) of both
+    choices in buckets indexed by (log2(l), log2(c)).  Near the static crossover we occasionally make the other choice (one call in ADAPT_EXPLORE)
+    so that both costs stay measured, and once both have ADAPT_MINCNT samples we use whichever is cheaper.  Costs are exponentially weighted
+    moving averages, so the choice tracks changes in zmax/d over the course of the run.  Buckets far from the static crossover always use the
+    static rule (so we never e.g. directly check a billion z's just to measure how long it takes).
+*/
+
+#define ADAPT_LBITS     32      // buckets for ui64_len(l)
+#define ADAPT_CBITS     24      // buckets for ui64_len(c)
+#define ADAPT_WINDOW    4       // we only explore buckets within a factor of 2^ADAPT_WINDOW of the static crossover
+#define ADAPT_EXPLORE   32      // in explored buckets one call in ADAPT_EXPLORE makes the choice we currently think is worse
+#define ADAPT_MINCNT    8       // number of samples of each choice required before we trust the estimates
+#define ADAPT_DECAY     6       // weight of a new sample in the moving averages is 2^-ADAPT_DECAY
+
+// the static rule
+static inline int zdirect_static (uint64_t l, uint64_t c) { return l <= ZSHORT || l*c <= ZFEW; }
+
+#ifndef ADAPTIVE
+static inline int adaptive (void) { return 0; }
+static inline int zdirect (uint64_t l, uint64_t c) { return zdirect_static (l,c); }
+static inline uint64_t adapt_start (void) { return 0; }
+static inline void adapt_end (uint64_t l, uint64_t c, int direct, uint64_t start) {}
+static inline void adapt_report (unsigned job) {}
+#else
+static inline int adaptive (void) { return 1; }
+
+static struct adaptrec {
+    uint64_t cost[2];           // moving averages of cycles per call for lifting (0) and checking directly (1), scaled by 2^ADAPT_DECAY
+    uint32_t cnt[2];            // number of samples of each (saturates at ADAPT_MINCNT)
+    uint32_t calls;             // number of calls in this bucket
+} adapttab[ADAPT_LBITS][ADAPT_CBITS];
+static uint64_t adapt_explored; // number of exploratory calls
+
+static inline struct adaptrec *adapt_bucket (uint64_t l, uint64_t c)
+    { return &adapttab[_min(ui64_len(l),ADAPT_LBITS-1)][_min(ui64_len(c),ADAPT_CBITS-1)]; }
+
+// returns true if the bucket containing (l,c) is close enough to the static crossover to be worth exploring
+static inline int adapt_window (uint64_t l, uint64_t c)
+{
+    int lb = ui64_len(l), cb = ui64_len(c);
+    return lb <= ui64_len(ZSHORT)+ADAPT_WINDOW && lb+cb <= ui64_len(ZFEW)+ADAPT_WINDOW
+           && ( lb >= ui64_len(ZSHORT)-ADAPT_WINDOW || lb+cb >= ui64_len(ZFEW)-ADAPT_WINDOW );
+}
+
+// returns 1 if we should check (l,c) directly, 0 if we should lift
+static inline int zdirect (uint64_t l, uint64_t c)
+{
+    int s = zdirect_static (l,c);
+    if ( ! adapt_window (l,c) ) return s;
+    struct adaptrec *x = adapt_bucket (l,c);
+    int best = ( x->cnt[0] >= ADAPT_MINCNT && x->cnt[1] >= ADAPT_MINCNT ) ? x->cost[1] < x->cost[0] : s;
+    if ( ! (++x->calls % ADAPT_EXPLORE) ) { adapt_explored++; return !best; }
+    return best;
+}
+
+static inline uint64_t adapt_start (void) { return get_cycles(); }
+
+static inline void adapt_end (uint64_t l, uint64_t c, int direct, uint64_t start)
+{
+    if ( ! adapt_window (l,c) ) return;
+    struct adaptrec *x = adapt_bucket (l,c);
+    uint64_t t = get_cycles() - start;
+    if ( x->cnt[direct] < ADAPT_MINCNT ) {    // plain average until we have enough samples
+        x->cost[direct] = (int64_t)x->cost[direct] + ((int64_t)(t<<ADAPT_DECAY)-(int64_t)x->cost[direct])/(int64_t)(x->cnt[direct]+1);
+        x->cnt[direct]++;
+    }
+    else x->cost[direct] += t - (x->cost[direct]>>ADAPT_DECAY);
+}
+
+// reports the buckets in which we disagree with the static rule and the effective value of ZSHORT for a single progression
+static void adapt_report (unsigned job)
+{
+    uint32_t lift = 0, direct = 0, zshort = 0;
+    int i, j;
+
+    for ( i = 0 ; i < ADAPT_LBITS ; i++ ) for ( j = 0 ; j < ADAPT_CBITS ; j++ ) {
+        struct adaptrec *x = &adapttab[i][j];
+        if ( x->cnt[0] < ADAPT_MINCNT || x->cnt[1] < ADAPT_MINCNT ) continue;
+        uint64_t l = (uint64_t)1<<(i?i-1:0), c = (uint64_t)1<<(j?j-1:0);     // smallest (l,c) in the bucket
+        int best = x->cost[1] < x->cost[0], s = zdirect_static(l,c);
+        if ( best && !s ) direct++;
+        if ( !best && s ) lift++;
+        if ( j == 1 && best && l > zshort ) zshort = l;
+    }
+    report_printf ("ADAPT:job=%u:explored=%lu:direct=%u:lift=%u:zshort=%u\n", job, adapt_explored, direct, lift, zshort);
+}
+#endif
+
+#endif
@@ -57,6 +57,63 @@ static inline uint64_t b32_crt64 (uint64_t za, uint64_t a, uint32_t zb, uint32_t
     return z;
 }
 
+/*
+    Kernels for lifting cartesian products of residues (za mod a) x (zb mod b) with b < 2^32 and ab < 2^64.
+    Writing z = za + c*a with c = (zb-za)/a mod b, if we precompute y = zb/a mod b and w = -za/a mod b then c = w + y mod b needs only an add and a
+    compare, and the lift is a multiply-add.  The caller precomputes the y's and w's (one Barrett reduction per residue rather than one per pair).
+    These use AVX-512 or AVX2 when available (compile with -march=native) and fall back to scalar code otherwise.
+*/
+
+// sets out[j] = za + ((w + y[j]) mod b)*a for j < n, with w, y[j] < b
+static inline void b32_crt64_row (uint64_t *out, uint64_t za, uint64_t a, uint32_t w, const uint32_t *y, uint32_t n, uint32_t b)
+{
+    uint32_t j = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    __m512i vz = _mm512_set1_epi64(za), va = _mm512_set1_epi64(a), vw = _mm512_set1_epi64(w), vb = _mm512_set1_epi64(b);
+    for ( ; j+8 <= n ; j += 8 ) {
+        __m512i c = _mm512_add_epi64 (_mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i*)(y+j))), vw);
+        c = _mm512_min_epu64 (c, _mm512_sub_epi64(c,vb));   // c-b wraps around when c < b
+        _mm512_storeu_si512 (out+j, _mm512_add_epi64(vz,_mm512_mullo_epi64(c,va)));
+    }
+#elif defined(__AVX2__)
+    __m256i vz = _mm256_set1_epi64x(za), va = _mm256_set1_epi64x(a), vah = _mm256_set1_epi64x(a>>32), vw = _mm256_set1_epi64x(w), vb = _mm256_set1_epi64x(b);
+    for ( ; j+4 <= n ; j += 4 ) {
+        __m256i c = _mm256_add_epi64 (_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i*)(y+j))), vw);
+        c = _mm256_sub_epi64 (c, _mm256_andnot_si256(_mm256_cmpgt_epi64(vb,c),vb));    // c < 2^33 so the signed compare is safe
+        __m256i ca = _mm256_add_epi64 (_mm256_mul_epu32(c,va), _mm256_slli_epi64(_mm256_mul_epu32(c,vah),32));  // c < 2^32 so c*a = c*alo + (c*ahi << 32)
+        _mm256_storeu_si256 ((__m256i*)(out+j), _mm256_add_epi64(vz,ca));
+    }
+#endif
+    for ( ; j < n ; j++ ) { uint64_t c = (uint64_t)w + y[j]; if ( c >= b ) c -= b; out[j] = za + c*a; }
+}
+
+// sets out[j] = za[j] + ((w[j] + y) mod b)*a for j < n, with y, w[j] < b
+static inline void b32_crt64_col (uint64_t *out, const uint64_t *za, uint64_t a, const uint32_t *w, uint32_t y, uint32_t n, uint32_t b)
+{
+    uint32_t j = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    __m512i va = _mm512_set1_epi64(a), vy = _mm512_set1_epi64(y), vb = _mm512_set1_epi64(b);
+    for ( ; j+8 <= n ; j += 8 ) {
+        __m512i c = _mm512_add_epi64 (_mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i*)(w+j))), vy);
+        c = _mm512_min_epu64 (c, _mm512_sub_epi64(c,vb));
+        _mm512_storeu_si512 (out+j, _mm512_add_epi64(_mm512_loadu_si512(za+j),_mm512_mullo_epi64(c,va)));
+    }
+#elif defined(__AVX2__)
+    __m256i va = _mm256_set1_epi64x(a), vah = _mm256_set1_epi64x(a>>32), vy = _mm256_set1_epi64x(y), vb = _mm256_set1_epi64x(b);
+    for ( ; j+4 <= n ; j += 4 ) {
+        __m256i c = _mm256_add_epi64 (_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i*)(w+j))), vy);
+        c = _mm256_sub_epi64 (c, _mm256_andnot_si256(_mm256_cmpgt_epi64(vb,c),vb));
+        __m256i ca = _mm256_add_epi64 (_mm256_mul_epu32(c,va), _mm256_slli_epi64(_mm256_mul_epu32(c,vah),32));
+        _mm256_storeu_si256 ((__m256i*)(out+j), _mm256_add_epi64(_mm256_loadu_si256((__m256i*)(za+j)),ca));
+    }
+#endif
+    for ( ; j < n ; j++ ) { uint64_t c = (uint64_t)w[j] + y; if ( c >= b ) c -= b; out[j] = za[j] + c*a; }
+}
+
+// computes w[i] = -za[i]/a mod b for i < n (the w's used by b32_crt64_row/col)
+static inline void b32_crt64_negs (uint32_t *w, const uint64_t *za, uint32_t n, uint32_t ainvb, uint32_t b, uint64_t binv)
+    { for ( uint32_t i = 0 ; i < n ; i++ ) w[i] = b32_neg(b32_mul(b32_red(za[i],b,binv),ainvb,b,binv),b); }
+
 // lifts (za mod a, zb mod b) to (z mod ab) with a < 2^64, b < 2^32, ab < 2^96
 static inline uint128_t b32_crt96 (uint64_t za, uint64_t a, uint32_t zb, uint32_t b, uint32_t ainvb, uint64_t binv)
 {
@@ -0,0 +1,326 @@
+#define ZCUBES_NOMAIN
+#include "zcubes.c"                 // we want the same inlined kernels and precomputed tables that zcubes uses
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Microbenchmarks for the arithmetic and z-check kernels, built with "make bench" and run as
+
+        bench [k] [dmax] [reps] [readers]
+
+    (defaults k=33, dmax=1e9, reps=16, readers=number of cores).  Inputs are generated from a fixed seed, so two builds run on the same
+    machine with the same arguments time exactly the same work.  Each benchmark prints one line of the form
+
+        BENCH:<kernel>:<size>:ops=<ops>:cyc/op=<cycles per op>[:cyc/z=<cycles per candidate z>]
+
+    For the z-check kernels an op is one call on a prime d in [dmax/2,dmax] with its cuberoots of k (set up as in procdcoprime), and the
+    size is the (temporary) ratio zmax/dmax, which determines the lengths of the progressions; cyc/z is cycles per candidate z (for
+    zrchecklift this counts the z's in the progressions before they are lifted, so it can be well below 1).  For the
+    prime pipe an op is one prime delivered to one of the readers, and the cycle counts are wall-clock (get_cycles) for the whole pipe.
+*/
+
+#define BENCH_PRIMES        64          // number of moduli of each size
+#define BENCH_DS            256         // number of d's for the z-check kernels
+#define BENCH_PIPE_START    (1UL<<40)
+#define BENCH_PIPE_LEN      (1UL<<22)
+
+static uint64_t bench_state = 0x9E3779B97F4A7C15UL;
+static volatile uint64_t bench_sink;    // results are accumulated here so the compiler can't optimize the work away
+
+// hides x from the optimizer, so that work on loop-invariant inputs isn't hoisted out of the timing loops
+static inline uint64_t bench_hide (uint64_t x) { __asm__ volatile ("" : "+r" (x)); return x; }
+
+static inline uint64_t bench_rand (void)
+    { bench_state ^= bench_state << 13; bench_state ^= bench_state >> 7; bench_state ^= bench_state << 17; return bench_state; }
+
+// returns a random prime in [2^(bits-1),2^bits) congruent to r mod 3 (r=0 means any residue)
+static uint64_t bench_prime (int bits, int r)
+{
+    mpz_t x;
+    uint64_t p;
+
+    mpz_init (x);
+    do {
+        p = ((uint64_t)1<<(bits-1)) | (bench_rand() & (((uint64_t)1<<(bits-1))-1)) | 1;
+        mpz_set_ui (x, p);
+    } while ( (r && p%3 != r) || ! mpz_probab_prime_p (x, 25) );
+    mpz_clear (x);
+    return p;
+}
+
+static void bench_report (char *kernel, char *size, uint64_t ops, uint64_t zs, uint64_t cycles)
+{
+    printf ("BENCH:%s:%s:ops=%lu:cyc/op=%.1f", kernel, size, ops, (double)cycles/ops);
+    if ( zs ) printf (":cyc/z=%.2f", (double)cycles/zs);
+    printf ("\n");
+    fflush (stdout);
+}
+
+static void bench_cbrts (int k, int reps)
+{
+    static const int bits[] = { 32, 40, 48, 56, 62 };
+    uint64_t p[BENCH_PRIMES], pinv[BENCH_PRIMES], R[BENCH_PRIMES], a[BENCH_PRIMES], r[3], s, c;
+    char size[16];
+    int i, j, t;
+
+    for ( t = 0 ; t < sizeof(bits)/sizeof(bits[0]) ; t++ ) {
+        for ( i = 0 ; i < BENCH_PRIMES ; i++ ) { p[i] = bench_prime (bits[t],1); pinv[i] = m64_pinv(p[i]); R[i] = m64_R(p[i]); a[i] = m64_from_ui(k,p[i]); }
+        sprintf (size, "p%d", bits[t]);
+        s = 0;  c = get_cycles();
+        for ( j = 0 ; j < reps ; j++ ) for ( i = 0 ; i < BENCH_PRIMES ; i++ ) s += m64_cbrts (r,bench_hide(a[i]),R[i],p[i],pinv[i]) + r[0];
+        bench_report ("m64_cbrts", size, (uint64_t)reps*BENCH_PRIMES, 0, get_cycles()-c);  bench_sink += s;
+    }
+    static const struct { int bits, e; } qs[] = { { 32, 1 }, { 62, 1 }, { 20, 3 }, { 12, 5 } };
+    for ( t = 0 ; t < sizeof(qs)/sizeof(qs[0]) ; t++ ) {
+        for ( i = 0 ; i < BENCH_PRIMES ; i++ ) p[i] = bench_prime (qs[t].bits,0);
+        sprintf (size, "p%d^%d", qs[t].bits, qs[t].e);
+        s = 0;  c = get_cycles();
+        for ( j = 0 ; j < reps ; j++ ) for ( i = 0 ; i < BENCH_PRIMES ; i++ ) s += cuberoots_modq (r,k,bench_hide(p[i]),qs[t].e) + r[0];
+        bench_report ("cuberoots_modq", size, (uint64_t)reps*BENCH_PRIMES, 0, get_cycles()-c);  bench_sink += s;
+    }
+}
+
+static void bench_inv_array (int reps)
+{
+    static const int bits[] = { 32, 48, 62 }, lens[] = { 16, IBATCH };
+    uint64_t x[IBATCH], y[IBATCH], p, pinv, R, R2, R3, s, c;
+    char size[16];
+    int i, j, n, t, u;
+
+    for ( t = 0 ; t < sizeof(bits)/sizeof(bits[0]) ; t++ ) for ( u = 0 ; u < sizeof(lens)/sizeof(lens[0]) ; u++ ) {
+        n = lens[u];  s = 0;  c = 0;
+        for ( j = 0 ; j < reps*(IBATCH/n) ; j++ ) {
+            p = bench_prime (bits[t],0);  pinv = m64_pinv(p);  R = m64_R(p);  R2 = m64_R2(R,p);  R3 = m64_R3(R2,p,pinv);
+            for ( i = 0 ; i < n ; i++ ) x[i] = m64_from_ui_R2 (1+bench_rand()%(p-1),R2,p,pinv);
+            uint64_t c0 = get_cycles();
+            m64_inv_array (y,x,n,R,R2,R3,p,pinv);
+            c += get_cycles()-c0;  s += y[n-1];
+        }
+        sprintf (size, "p%d:n=%d", bits[t], n);
+        bench_report ("m64_inv_array", size, (uint64_t)reps*(IBATCH/n)*n, 0, c);  bench_sink += s;
+    }
+}
+
+static void bench_crt (int reps)
+{
+    static const struct { int abits, bbits; } sizes[] = { { 32, 31 }, { 48, 15 }, { 56, 7 } };
+    uint64_t za[BENCH_PRIMES], zb[BENCH_PRIMES], a, u, ab, binv, s, c;
+    uint32_t b, ainvb;
+    char size[16];
+    int i, j, t;
+
+    for ( t = 0 ; t < sizeof(sizes)/sizeof(sizes[0]) ; t++ ) {
+        a = bench_prime (sizes[t].abits,0);  b = bench_prime (sizes[t].bbits,0);  binv = b32_inv(b);  ainvb = ui32_inverse (a%b,b);
+        ab = a*b;  u = a*ainvb-1;
+        for ( i = 0 ; i < BENCH_PRIMES ; i++ ) { za[i] = bench_rand()%a;  zb[i] = bench_rand()%b; }
+        sprintf (size, "a%d:b%d", sizes[t].abits, sizes[t].bbits);
+        s = 0;  c = get_cycles();
+        for ( j = 0 ; j < 16*reps ; j++ ) for ( i = 0 ; i < BENCH_PRIMES ; i++ ) s += b32_crt64 (bench_hide(za[i]),a,zb[i],b,ainvb,binv);
+        bench_report ("b32_crt64", size, (uint64_t)16*reps*BENCH_PRIMES, 0, get_cycles()-c);  bench_sink += s;
+        s = 0;  c = get_cycles();
+        for ( j = 0 ; j < 16*reps ; j++ ) for ( i = 0 ; i < BENCH_PRIMES ; i++ ) s += fcrt64 (u,a-bench_hide(za[i]),zb[i],ab);
+        bench_report ("fcrt64", size, (uint64_t)16*reps*BENCH_PRIMES, 0, get_cycles()-c);  bench_sink += s;
+    }
+}
+
+static struct bench_d { uint64_t d, z[3]; uint32_t c; } bench_ds[BENCH_DS];
+
+// the bitmaps are the admissible z mod p for the first 16 of the d's used for the z-check kernels
+static void bench_crtmap (int reps)
+{
+    static const uint8_t pairs[][3] = { { 5, 7, 0 }, { 10, 11, 0 }, { 26, 27, 0 }, { 1, 3, 5 }, { 8, 9, 10 } };    // indexes into p128
+    uint128_t am[16], bm[16], cm[16];
+    uint64_t m[2048], s, c;
+    char size[32];
+    int i, j, t;
+
+    for ( t = 0 ; t < sizeof(pairs)/sizeof(pairs[0]) ; t++ ) {
+        uint32_t a = p128[pairs[t][0]], b = p128[pairs[t][1]], cc = pairs[t][2] ? p128[pairs[t][2]] : 1;
+        uint64_t binv = b32_inv(b), cinv = b32_inv(cc);
+        uint32_t ainvb = ui32_inverse (a%b,b), abinvc = cc > 1 ? ui32_inverse ((a*b)%cc,cc) : 0;
+        if ( (uint64_t)a*b*cc > 64*sizeof(m) ) continue;
+        for ( i = 0 ; i < 16 ; i++ ) {
+            uint64_t d = bench_ds[i].d;  unsigned si = sgnz_index(d);
+            am[i] = zsmodp128red(d,si,pairs[t][0]);  bm[i] = zsmodp128red(d,si,pairs[t][1]);  cm[i] = cc > 1 ? zsmodp128red(d,si,pairs[t][2]) : 1;
+        }
+        s = 0;  c = get_cycles();
+        if ( cc == 1 ) {
+            for ( j = 0 ; j < 16*reps ; j++ ) for ( i = 0 ; i < 16 ; i++ ) s += b32_crtmap128 (m,am[i],a,bm[i],b,ainvb,binv)[i&1];
+            sprintf (size, "%ux%u", a, b);
+            bench_report ("b32_crtmap128", size, (uint64_t)16*16*reps, 0, get_cycles()-c);
+        } else {
+            for ( j = 0 ; j < 16*reps ; j++ ) for ( i = 0 ; i < 16 ; i++ ) s += b32_crt3map128 (m,am[i],a,bm[i],b,cm[i],cc,ainvb,binv,abinvc,cinv)[i&1];
+            sprintf (size, "%ux%ux%u", a, b, cc);
+            bench_report ("b32_crt3map128", size, (uint64_t)16*16*reps, 0, get_cycles()-c);
+        }
+        bench_sink += s;
+    }
+}
+
+static void bench_invtab (int reps)
+{
+    uint16_t p16[] = { 3, 5, 7, 11, 13 }, q16 = 65521, *i16 = malloc (2*3*65536*sizeof(*i16));
+    uint32_t q32 = 1000003, *i32 = malloc (3*(q32+1)*sizeof(*i32));
+    uint64_t c;
+    int j;
+
+    c = get_cycles();  for ( j = 0 ; j < reps ; j++ ) invtab16 (i16, 15015, p16, 5, i16+65536);
+    bench_report ("invtab16", "15015", (uint64_t)reps*15015, 0, get_cycles()-c);
+    c = get_cycles();  for ( j = 0 ; j < reps ; j++ ) invtab16 (i16, q16, &q16, 1, i16+65536);
+    bench_report ("invtab16", "65521", (uint64_t)reps*q16, 0, get_cycles()-c);
+    c = get_cycles();  for ( j = 0 ; j < reps ; j++ ) invtab32 (i32, q32, &q32, 1, i32+q32+1);
+    bench_report ("invtab32", "1000003", (uint64_t)reps*q32, 0, get_cycles()-c);
+    bench_sink += i16[2] + i32[2];
+    free (i16);  free (i32);
+}
+
+// sets zmax (and the values derived from it) to z, the z-check kernels read these globals
+static void bench_zmax (uint128_t z)
+    { zmax128 = z;  zmaxbits = ui128_len(zmax128);  zmaxld = (long double) (zmax128 + (zmax128>>62) + 1); }
+
+static void bench_zchecks (int reps)
+{
+    static const int one[] = { 2 }, afew[] = { 8, 10 }, many[] = { 14, 18 }, lift[] = { 20, 28 };
+    uint128_t zmax = zmax128;
+    uint64_t c, zs, calls;
+    char size[32];
+    int i, j, t;
+
+    // zrcheckone and zrcheckafew (set up as in procdcoprime)
+    for ( t = 0 ; t < 3 ; t++ ) {
+        int e = t ? afew[t-1] : one[0];
+        bench_zmax ((uint128_t)dmax<<e);
+        c = zs = calls = 0;
+        for ( j = 0 ; j < reps ; j++ ) for ( i = 0 ; i < BENCH_DS ; i++ ) {
+            struct bench_d *x = bench_ds+i;
+            uint64_t d = x->d;
+            unsigned si = sgnz_index(d), mi = (km1&d&1) + 2*( onezmod7(d,si) ? 1 : 0 );
+            uint32_t b = km[mi];
+            uint64_t l = fastceilboundl(zmaxld/((long double)d*b)), binv = kminv[mi];
+            uint32_t db = b32_red(d,b,binv), *zb = kmztab[mi]+db, dinvb = kmitab[mi][db];
+            uint64_t c0 = get_cycles();
+            if ( (uint128_t)d*b > zmax128 ) zrcheckone (d, si, d, x->z, x->c, b, zb, 1, dinvb, binv);
+            else zrcheckafew (d, si, d, x->z, x->c, b, zb, 1, dinvb, binv, l);
+            c += get_cycles()-c0;  zs += x->c*l;  calls++;
+        }
+        sprintf (size, "zmax/dmax=2^%d", e);
+        bench_report (t ? "zrcheckafew" : "zrcheckone", size, calls, zs, c);
+    }
+
+    // zrcheckmany (on the unlifted progressions, with the auxiliary primes ranked as in zrchecklift)
+    for ( t = 0 ; t < 2 ; t++ ) {
+        bench_zmax ((uint128_t)dmax<<many[t]);
+        sprintf (size, "zmax/dmax=2^%d", many[t]);
+        c = zs = calls = 0;
+        for ( j = 0 ; j < reps ; j++ ) for ( i = 0 ; i < BENCH_DS ; i++ ) {
+            struct bench_d *x = bench_ds+i;
+            uint64_t d = x->d;
+            unsigned si = sgnz_index(d), mi = (km1&d&1) + 2*( onezmod7(d,si) ? 1 : 0 );
+            uint32_t b = km[mi], pbs[PI128];
+            uint64_t l = fastceilboundl(zmaxld/((long double)d*b)), binv = kminv[mi];
+            uint32_t db = b32_red(d,b,binv), *zb = kmztab[mi]+db, dinvb = kmitab[mi][db];
+            uint8_t pis[PI128];
+            unsigned npi = ranked_pi (pis,pbs,d,si);
+            uint64_t c0 = get_cycles();
+            zrcheckmany (d, si, d, x->z, x->c, b, zb, 1, dinvb, binv, pis, npi);
+            c += get_cycles()-c0;  zs += x->c*l;  calls++;
+        }
+        bench_report ("zrcheckmany", size, calls, zs, c);
+    }
+
+    // zrchecklift (which splits the progressions and then calls zrcheckmany)
+    for ( t = 0 ; t < 2 ; t++ ) {
+        bench_zmax ((uint128_t)dmax<<lift[t]);
+        sprintf (size, "zmax/dmax=2^%d", lift[t]);
+        c = zs = calls = 0;
+        for ( j = 0 ; j < reps ; j++ ) for ( i = 0 ; i < BENCH_DS ; i++ ) {
+            struct bench_d *x = bench_ds+i;
+            uint64_t d = x->d, c0 = get_cycles();
+            zrchecklift (d, sgnz_index(d), 0, d, x->z, x->c);
+            c += get_cycles()-c0;  zs += x->c*fastceilboundl(zmaxld/((long double)d*km[0]));  calls++;
+        }
+        bench_report ("zrchecklift", size, calls, zs, c);
+    }
+
+    // zcheck_mpz on random z in [dmax,zmax]
+    for ( t = 0 ; t < 2 ; t++ ) {
+        bench_zmax ((uint128_t)dmax<<lift[t]);
+        sprintf (size, "zmax/dmax=2^%d", lift[t]);
+        c = calls = 0;
+        for ( j = 0 ; j < 16*reps ; j++ ) for ( i = 0 ; i < BENCH_DS ; i++ ) {
+            uint64_t d = bench_ds[i].d;
+            uint128_t z = dmax + (((uint128_t)bench_rand()<<64 | bench_rand()) % (zmax128-dmax));
+            uint64_t c0 = get_cycles();
+            bench_sink += zcheck_mpz (d, sgnz_index(d), z);
+            c += get_cycles()-c0;  calls++;
+        }
+        bench_report ("zcheck_mpz", size, calls, 0, c);
+    }
+    bench_zmax (zmax);
+}
+
+static void bench_pipe (int readers)
+{
+    uint64_t *cnts = shared_calloc (PRIMES_PIPE_MAX_READERS*sizeof(*cnts));
+    char size[32];
+    int i, n, status;
+
+    for ( n = 1 ; n <= readers ; n++ ) {
+        primes_pipe_ctx_t *pipe = primes_create_pipe (BENCH_PIPE_START, BENCH_PIPE_START+BENCH_PIPE_LEN, n, budget.pipebuf, 0);
+        uint64_t c = get_cycles(), total = 0;
+        for ( i = 0 ; i < n ; i++ ) if ( !fork() ) {
+            uint64_t p, s = 0;
+            while ( (p = primes_read_pipe (pipe,i)) != PRIMES_DONE ) { cnts[i]++; s += p; }
+            bench_sink += s;
+            primes_close_pipe (pipe,i);
+            _exit (0);
+        }
+        if ( !fork() ) { while ( primes_feed_pipe (pipe) );  primes_destroy_pipe (pipe);  _exit (0); }
+        while ( wait(&status) > 0 ) assert (WIFEXITED(status) && ! WEXITSTATUS(status));
+        c = get_cycles()-c;
+        for ( i = 0 ; i < n ; i++ ) { total += cnts[i];  cnts[i] = 0; }
+        sprintf (size, "readers=%d", n);
+        bench_report ("primes_pipe", size, total, 0, c);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    int k = 33, reps = 16, readers = get_nprocs(), n;
+
+    if ( argc > 1 && ! strcmp (argv[1],"-h") ) { fprintf (stderr, "    bench [k] [dmax] [reps] [readers]\n    (version %s)\n", VERSION_STRING); return 0; }
+    if ( argc > 1 ) k = atoi(argv[1]);
+    if ( k < 0 || ! goodk(k) ) { fprintf (stderr, "ERROR: k=%d must be a postive integer <= 1000 congruent to 3 or 6 mod 9.\n",k); return -1; }
+    dmax = argc > 2 ? strto64(argv[2]) : 1000000000;
+    if ( dmax < 1000 || dmax > ((uint64_t)1<<40) ) { fprintf (stderr, "ERROR: dmax = %lu must be in [1000,2^40] (the precomputation is sized for dmax)\n", dmax); return -1; }
+    if ( argc > 3 ) reps = atoi(argv[3]);
+    if ( argc > 4 ) readers = atoi(argv[4]);
+    assert (reps > 0 && readers > 0 && readers <= PRIMES_PIPE_MAX_READERS);
+
+    budget_init (1, 0, 0, CDMAX, SDMAX, ZBUFBITS, IBATCH, PRIMES_PIPE_MAX_BUFSIZE);
+    bench_zmax ((uint128_t)dmax<<20);
+    precompute (k, 2, 1000);
+    allocate_private_buffers ();
+
+    // d's for the z-check kernels: primes in [dmax/2,dmax] with at least one cuberoot of k
+    for ( n = 0 ; n < BENCH_DS ; ) {
+        struct bench_d *x = bench_ds+n;
+        x->d = primes_next_prime (dmax/2 + bench_rand()%(dmax/2));
+        if ( x->d > dmax || ! (k%x->d) ) continue;
+        if ( (x->c = cuberoots_modq (x->z,k,x->d,1)) ) n++;
+    }
+
+    printf ("BENCH:k=%d:dmax=%lu:reps=%d:readers=%d:ver=%s\n", k, dmax, reps, readers, VERSION_STRING);
+    bench_cbrts (k, reps);
+    bench_inv_array (reps);
+    bench_crt (reps);
+    bench_crtmap (reps);
+    bench_invtab (reps);
+    bench_zchecks (reps);
+    bench_pipe (readers);
+    free_private_buffers ();
+    return 0;
+}
@@ -31,6 +31,8 @@ static inline void bm_set(uint64_t *bm, uint64_t i) { bm[i>>6] |= bitm(i); }
 static inline void bm_unset(uint64_t *bm, uint64_t i) { bm[i>>6] &= ~bitm(i); }
 static inline int bm_test(uint64_t *bm, uint64_t i) { return (bm[i>>6] & bitm(i))!=0; }
 static inline int bm_test_and_set(uint64_t *bm, uint64_t i) { uint64_t x = bm[i>>6];  uint64_t y = x | bitm(i);  bm[i>>6] = y;  return y==x; }
+static inline void bm_prefetch(uint64_t *bm, uint64_t n)    // issue prefetches for every cache line spanned by an n-bit bitmap
+    { char *s = (char*)bm, *e = (char*)(bm+(n>>6)); for ( ; s < e ; s += 64 ) __builtin_prefetch(s); __builtin_prefetch(e); }
 static inline int bm_subset (uint64_t *A, uint64_t *B, uint64_t n)
     { for ( uint64_t i = 0 ; i < bm_words(n) ; i++ ) { if ( A[i] & ~B[i] ) return 0; }  return 1; }
 
@@ -0,0 +1,104 @@
+#ifndef _BUDGET_INCLUDE_
+#define _BUDGET_INCLUDE_
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/sysinfo.h>
+#include "cstd.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Runtime sizing of caches and buffers from a memory budget and the detected cache sizes.
+
+    The compile-time constants CDMAX, SDMAX, SMZMASKB, ZBUFBITS, IBATCH, and PRIMES_PIPE_MAX_BUFSIZE are upper bounds (they size static arrays
+    and bound index widths), the values actually used are chosen by budget_init from
+
+        * mem:  total memory budget in bytes (shared memory plus private memory for all workers), defaults to 3/4 of physical memory
+        * wmem: private memory budget per worker in bytes, defaults to mem/(2*cores) (but at most 1GB), never more than mem/cores
+        * the L1d/L2 cache sizes (per core) as reported by sysconf (with conservative defaults if they are unavailable)
+
+    Both mem and wmem can be set on the command line (e.g. mem=16G wmem=1G), the choices are printed in the LIMITS line.
+*/
+
+#define BUDGET_DEFAULT_L1   (32<<10)    // used if sysconf can't tell us the cache sizes
+#define BUDGET_DEFAULT_L2   (1<<20)
+#define BUDGET_MAX_WMEM     (1UL<<30)   // cap on the default per-worker budget (more than this doesn't help)
+#define BUDGET_MIN_WMEM     (32UL<<20)  // we want at least this much private memory per worker (if mem allows)
+
+static struct budget {
+    uint64_t mem;           // total memory budget in bytes
+    uint64_t wmem;          // private memory budget per worker in bytes
+    uint64_t smem;          // shared memory budget in bytes (mem - cores*wmem)
+    uint32_t l1, l2;        // data cache sizes in bytes (per core)
+    int cores;
+    // values derived from the above
+    uint32_t cdmax;         // cap on cdmax (cuberoots are cached for d <= cdmax)
+    uint32_t sdmax;         // cap on sdmax (inverses are cached for d <= sdmax)
+    uint64_t smzbytes;      // space available for precomputed zmasks mod products of small primes (determines the bound smzmaskb in zcheck.h)
+    uint64_t zbmcbytes;     // space available (per worker) for the cache of custom bitmaps used by zrcheckmany
+    int zbufbits;           // log2 of the number of entries in each of the z-progression buffers zabuf[i], zbbuf[i]
+    uint32_t ibatch;        // number of inversions batched in enumd/enumcd
+    uint32_t pipebuf;       // number of 32-bit entries in the ring of each reader of the prime pipe (a power of 2)
+} budget;
+
+static inline uint32_t budget_cache_size (int name, uint32_t def)
+    { long n = sysconf (name); return n > 0 ? (uint32_t)n : def; }
+
+// parses a byte count with an optional K/M/G/T suffix (default is MB)
+static inline uint64_t budget_parse (char *s)
+{
+    char *t;
+    uint64_t n = strtoul (s,&t,10);
+    switch ( *t ) {
+    case 'k': case 'K': return n<<10;
+    case 'g': case 'G': return n<<30;
+    case 't': case 'T': return n<<40;
+    default: return n<<20;
+    }
+}
+
+// sets the budget for the specified number of cores, mem and wmem may be zero (to use defaults), upper bounds are compile-time constants
+static void budget_init (int cores, uint64_t mem, uint64_t wmem, uint32_t cdmaxmax, uint32_t sdmaxmax, int zbufbitsmax, uint32_t ibatchmax, uint32_t pipebufmax)
+{
+    struct sysinfo si;
+
+    assert (cores > 0);
+    budget.cores = cores;
+    budget.l1 = budget_cache_size (_SC_LEVEL1_DCACHE_SIZE, BUDGET_DEFAULT_L1);
+    budget.l2 = budget_cache_size (_SC_LEVEL2_CACHE_SIZE, BUDGET_DEFAULT_L2);
+    if ( ! mem ) { if ( sysinfo(&si) ) { perror ("sysinfo"); abort(); }  mem = 3*((uint64_t)si.totalram*si.mem_unit/4); }
+    if ( ! wmem ) wmem = _min(mem/(2*cores),BUDGET_MAX_WMEM);
+    if ( wmem < BUDGET_MIN_WMEM ) wmem = BUDGET_MIN_WMEM;
+    if ( wmem > mem/cores ) wmem = mem/cores;      // the workers' private memory must fit in the total budget, even if that is below BUDGET_MIN_WMEM
+    budget.mem = mem;  budget.wmem = wmem;
+    budget.smem = mem > cores*wmem ? mem - cores*wmem : 0;
+
+    // the cuberoot cache uses about 4 bytes per unit of cdmax, but building it temporarily needs about 32, which must fit in the shared budget
+    budget.cdmax = cdmaxmax;
+    while ( budget.cdmax > (1<<16) && 32*(uint64_t)budget.cdmax > budget.smem ) budget.cdmax >>= 1;
+    // the inverse tables for d <= sdmax use about sdmax^2/6 bytes and are accessed sparsely, we want them to fit in twice the size of L2
+    budget.sdmax = sdmaxmax;
+    while ( budget.sdmax > (1<<10) && (uint64_t)budget.sdmax*budget.sdmax/6 > 2*(uint64_t)budget.l2 ) budget.sdmax >>= 1;
+    // zmasks for products of small primes get up to 1/8 of the shared budget
+    budget.smzbytes = budget.smem/8;
+    // the z-progression buffers use 24 bytes per entry, give them up to 3/4 of the private budget
+    budget.zbufbits = zbufbitsmax;
+    while ( budget.zbufbits > 16 && (24UL<<budget.zbufbits) > 3*(wmem/4) ) budget.zbufbits--;
+    // the custom bitmap cache gets 1/8 of the private budget
+    budget.zbmcbytes = wmem/8;
+    // batched inversions use about 40 bytes per entry, keep them within 1/4 of L1
+    budget.ibatch = ibatchmax;
+    while ( budget.ibatch > 16 && 40*budget.ibatch > budget.l1/4 ) budget.ibatch >>= 1;
+    // each pipe reader gets a ring of l2/32 32-bit entries (but at least 4096), which takes an eighth of L2
+    budget.pipebuf = _min(pipebufmax,_max(budget.l2/32,1<<12));
+    budget.pipebuf = (uint32_t)1 << ui64_highbit(budget.pipebuf);
+}
+
+#endif
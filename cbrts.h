@@ -7,6 +7,7 @@
 #include "m64.h"
 #include "mem.h"
 #include "cstd.h"
+#include "budget.h"
 
 /*
     Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
@@ -18,8 +19,9 @@
     Lookup functions are provided for retrieving cached cuberoots.  The main interfaces are
 
         * cached_cuberoots_mod_q -- this function returns cuberoots modulo a specified prime power
-        * cdentry -- given an admissible d and a prime d returns a pointer x into a table of cofactor data such that x->d*d <= max and x->d is (p-1)-smooth
-                     caller can then work down the table from there (but approx 1/2 the entries below the returned entry need not be (p-1)-smooth)
+        * cdentry -- given an admissible d and a prime d returns an index j into a table t of cofactor data such that x->d*d <= max and x->d is (p-1)-smooth
+                     for x = cdrec_at(t,j), caller can then work down the table from there (but approx 1/2 the entries below the returned entry need not be
+                     (p-1)-smooth, so cdvs[t][j] holds a skip to the next entry down with a smaller largest prime)
                      each entry identifies the largest prime dividing x->d and a list of cuberoots mod x->d (see struct cdrec below)
         * sdentry/sdtab -- for smaller d (<= SDMAX) we also cache precomputed inverses, currenty zcubes accesses sdtab directly rather than calling sdentry
 
@@ -30,8 +32,13 @@
 // (meaning coprime to the largest prime divisor of d), which means up to min(sqrt(dmax),dmax/pmin)
 
 #define CPMIN   512     // We always cache primes up to CPMIN which needs to be at at least 127 and as big as the largest prime divisor of k
-#define SDMAX   (1<<12) // Limits d for which we will cache inverses (we need 2d bytes of space per admissible d < SDMAX, which we would like in L2)
-#define CDMAX   (1<<26) // Limits d for which we will cache cuberoots (we need 12+4n bytes for each admissible d < CDMAX with n cuberoots
+#define SDMAX   (1<<15) // Limits d for which we will cache inverses (we need 2d bytes of space per admissible d < sdmax, which we would like in L2)
+                        // this is an upper bound, the cap budget.sdmax we actually use is determined by the L2 cache size (see budget.h)
+#define SDMAXN  81      // Maximum number of cuberoots of k modulo d < 2^16 coprime to k (3^4), used to size buffers for sdtab entries
+#define CDMAXN  2187    // Maximum number of cuberoots of k modulo d < 2^32 coprime to k (3^7), used to size buffers for cdtab entries
+#define CDMAX   (1<<27) // Limits d for which we will cache cuberoots (we need 12+4n bytes (12+2n for d < 2^16) for each admissible d < cdmax with n cuberoots,
+                        // plus about 12 bytes per d for the index vectors and skips of the bisected tables)
+                        // this is an upper bound, the cap budget.cdmax we actually use is determined by the memory budget (see budget.h)
                         // The number of admissible d is rho_d*dmax/log(dmax)^(1/3), which is roughly dmax/6 or so in the range of interest
 
 
@@ -292,35 +299,58 @@ static inline uint64_t modqinv(uint64_t d, uint64_t q, uint64_t p, unsigned e)
 }
 
 // Cached precomputed data for cpmax-smooth admissible d <= cdmax <= CDMAX < 2^32 coprime to k
+// There is a single table cdtab of records sorted by d, the smoothness bisected tables are index vectors into it (rather than copies),
+// the number of roots for each d is implicit (the difference of consecutive offsets), and roots mod d < 2^16 are stored in 16 bits.
 static uint32_t cdmax;          // all cpmax-smooth admissible d <= cdmax coprime to k are listed in cdtab
 static uint64_t cdmin;          // dmax/cdmax
-static struct cdrec {           // record for each d
+static struct cdrec {           // record for each d (12 bytes)
     uint32_t d;                 // d <= cdmax coprime to k
     uint32_t p;                 // largest prime divisor of d
-    uint32_t r;                 // offset into cdroots where n cuberoots of k mod d are stored
-    uint16_t n;                 // number of cuberoots of k mod d (at most 3^7 = 2187 for 32-bit d coprime to k)
-    uint16_t sdpi;              // index into sdtab for d <= sdmask
-} *cdtab[16];                   // entry zero is reserved for null in each table
-static uint32_t cdcnt[16];      // cdcnts[i] is the number of entries in cdtab[i], starting from offset 1 (so cdcnt[i]+1 entries total)
-static uint32_t cdmaxp[16];     // cdtab[i] contains all cdmaxp[i]-smooth d <= cdmax
-static uint32_t *cdroots;       // cuberoots of k mod d for d in cdtab
+    uint32_t r;                 // offset of the cuberoots of k mod d in cdroots16 (for d < 2^16) or in cdroots (offset by cdn16, for d >= 2^16)
+} *cdtab;                       // entry zero is reserved for null, entry cdcnt[0]+1 is a sentinel whose r value is the total number of roots
+static uint32_t *cdvi[16];      // cdvi[i][j] is the index in cdtab of the jth entry of the ith bisected table (cdvi[0] is null, table 0 is cdtab itself)
+static uint16_t *cdvs[16];      // the entry j-cdvs[i][j] is the nearest entry below j in table i with a smaller largest prime (skips over d that can't be smooth
+                                // enough), skips longer than 2^16-1 are truncated, which is safe because no entry in between has a smaller largest prime
+static uint32_t cdcnt[16];      // cdcnts[i] is the number of entries in table i, starting from offset 1 (so cdcnt[i]+1 entries total)
+static uint32_t cdmaxp[16];     // table i contains all cdmaxp[i]-smooth d <= cdmax
+static uint16_t *cdroots16;     // cuberoots of k mod d for d < 2^16 in cdtab
+static uint32_t *cdroots;       // cuberoots of k mod d for d >= 2^16 in cdtab (the roots for the record x start at cdroots[x->r-cdn16])
+static uint32_t cdn16;          // number of entries in cdroots16
+static uint32_t cdcur[16];      // per-process cursors: cdcur[i] is the bisection result of the last cdentry lookup in table i (for d=cdcurd[i])
+static uint64_t cdcurd[16];     // consecutive lookups (e.g. for consecutive primes) start from the cursor rather than bisecting the whole table
+
+// returns the jth entry of table i
+static inline struct cdrec *cdrec_at (uint32_t i, uint32_t j) { return cdtab + (i ? cdvi[i][j] : j); }
+// returns the number of cuberoots of k mod x->d, x must point into cdtab
+static inline uint32_t cdrec_n (struct cdrec *x) { return x[1].r - x[0].r; }
+// copies the cuberoots of k mod x->d into z (as 32-bit integers) and returns their number
+static inline uint32_t cdrec_roots (uint32_t z[], struct cdrec *x)
+{
+    uint32_t i, n = cdrec_n(x);
+    if ( x->d < (1<<16) ) { uint16_t *r = cdroots16 + x->r;  for ( i = 0 ; i < n ; i++ ) z[i] = r[i]; }
+    else { uint32_t *r = cdroots + (x->r-cdn16);  for ( i = 0 ; i < n ; i++ ) z[i] = r[i]; }
+    return n;
+}
 
 // Cached precomputed data for cpmax-smooth admissible d <= sdmax <= SDMAX < 2^16 coprime to k
 static uint32_t sdmax;          // all cpmax-smooth admissible d <= sdmax coprime to k are listed in sdtab
 static uint64_t sdmin;          // sdmax/sdmin
-static struct sdrec {           // record fo r each d
-    uint16_t d;                 // d <= sdmax coprime to k
-    uint16_t p;                 // largest prime divisor of d
-    uint16_t r;                 // offset into sdroots (duplicates cdroots, but 16-bit values, improves memory locality)
-    uint16_t n;                 // number of cuberoots of k mod d (at mosst 3^4 = 81 for 16-bit d coprime to k)
-    uint64_t dinv;              // 2^64/d, used for Barret reduction mod d
-    uint32_t i;                 // offset into sdinvs containing list of inverses mod d
-} *sdtab;                       // entry zero is reserved for null
+static struct sdtab {           // stored as parallel arrays indexed by sdpi (structure-of-arrays) so loops over cofactors touch only the fields they use
+    uint16_t *d;                // d <= sdmax coprime to k
+    uint16_t *p;                // largest prime divisor of d
+    uint16_t *r;                // offset into sdroots
+    uint16_t *n;                // number of cuberoots of k mod d (at mosst 3^4 = 81 for 16-bit d coprime to k)
+    uint64_t *dinv;             // 2^64/d, used for Barret reduction mod d
+    uint32_t *i;                // offset into sdinvs containing list of inverses mod d
+} sdtab;                        // entry zero of each array is reserved for null, sdtab entry i corresponds to cdtab entry i (so sdpi is implicit)
 static uint16_t sdcnt;          // number of entries in sdtab starting from offset 1 (so sdcnt+1 entries total)
-static uint16_t *sdroots;       // cuberoots of k mod d for d in sdtab (duplicates cdroots but we use 16-bits here for memory locality)
+static uint16_t *sdroots;       // cuberoots of k mod d for d in sdtab (this is just cdroots16, sdtab.r[i] = cdtab[i].r)
 static uint16_t *sdinvs;        // inverses mod d  for d in sdtab (total # entries is the sum of d in sdtab)
 
-// used to sort cdtab by p below
+// record used while building cdtab, d and p must come first, in that order (see the comparison functions below)
+struct cdbrec { uint32_t d, p, r, n; };
+
+// used to sort cdbrecs by p below
 static int ui32_cmp1 (const void *a, const void *b)
     { return *((uint32_t*)a+1) < *((uint32_t*)b+1) ? -1 : ( *((int32_t*)a+1) > *((int32_t*)b+1) ? 1 : 0 ); }
 
@@ -328,10 +358,10 @@ static int ui32_cmp1 (const void *a, const void *b)
 static void precompute_cuberoots_modd (uint32_t k,uint64_t pmin, uint64_t pmax, uint64_t dmax)
 {
     uint128_t dd;
-    struct cdrec *x, *y;
+    struct cdbrec *bt, *x;
     uint64_t z[3], bytes, mem=0;
     uint32_t p[9], q[9], d[9], c[9], r[9];
-    uint32_t *rr;
+    uint32_t *rr, *broots;
     uint32_t next, w, nroots, ninvs;
     int e[9], pi[9];
     int i, j, n, zc;
@@ -339,39 +369,40 @@ static void precompute_cuberoots_modd (uint32_t k,uint64_t pmin, uint64_t pmax,
     report_timer_reset();
 
     cdmax = _min(ui64_ceil_ratio(dmax,pmin),sqrt(dmax));    // default is to cache all possible cofactors (divisors of d coprime to its largest prime factor)
-    if ( cdmax > CDMAX ) cdmax = CDMAX;                     // but we impose a cap CDMAX to keep memory manageable
+    if ( cdmax > budget.cdmax ) cdmax = budget.cdmax;       // but we impose a cap to stay within our memory budget
     if ( cdmax < CPMIN ) cdmax = CPMIN;                     // to avoid annoying special cases we make cdmax at least min(cpmax) so we are at least caching something
     cdmin = ui64_ceil_ratio(dmax,cdmax);                    // for p >= cdmin any d divisible by p will have its cofactor cached
-    sdmax = _min(cdmax,SDMAX);                              // for d up to SDMAX we also cache inverses mod d (in a table of length d indexed by a mod d)
+    sdmax = _min(cdmax,budget.sdmax);                       // for d up to sdmax we also cache inverses mod d (in a table of length d indexed by a mod d)
     assert ( sdmax > 2 );                                   // this ensures we won't call b32_inv with modulus 2
     sdmin = ui64_ceil_ratio(dmax,sdmax);                    // for p >= sdmin any d divisible by p will have inverses mod its cofactor
     assert (cdmax <= cqmax);                                // sanity check that we have already cached all the prime powers we need
-    cdtab[0] = private_malloc (cdmax*sizeof(*cdtab[0]));    // more space than needed, we will realloc later
-    cdroots = private_malloc (3*cdmax*sizeof(*cdroots));    // this should be more than enough space, but we will verify this as we go
-    memset(cdtab[0],0,sizeof(*cdtab[0]));
+    // we first build a private table of records with explicit root counts in generation order, and then compact it
+    bt = private_malloc (cdmax*sizeof(*bt));                // more space than needed
+    broots = private_malloc (3*cdmax*sizeof(*broots));      // this should be more than enough space, but we will verify this as we go
+    memset(bt,0,sizeof(*bt));
     cdcnt[0] = 0; next = 0;
     pi[n=0] = pimaxp (cdmax,1,cdmax);
     assert(pi[n]);
     d[n] = q[n] = p[n] = cptab[pi[n]]; e[n] = 1;
     for(;;) {
         zc = cached_cuberoots_modq (z,pi[n],e[n]);  assert (zc);
-        x = cdtab[0] + ++cdcnt[0];
+        x = bt + ++cdcnt[0];
         x->d = d[n]; x->p = p[0];
         x->r = r[n] = next;
-        rr = cdroots + r[n];
+        rr = broots + r[n];
         if ( n ) {
             uint64_t u = (uint64_t)d[n-1]*modqinv(d[n-1],q[n],p[n],e[n]) - 1;
             for ( i = 0 ; i < c[n-1] ; i++ ) {
-                uint64_t nza = d[n-1]-cdroots[r[n-1]+i];
+                uint64_t nza = d[n-1]-broots[r[n-1]+i];
                 for ( j = 0 ; j < zc ; j++ ) *rr++ = fcrt32(u,nza,z[j],d[n]);
             }
         } else {
             for ( j = 0 ; j < zc ; j++ ) *rr++ = (uint32_t)z[j];
         }
-        c[n] = x->n = rr - (cdroots+x->r);
+        c[n] = x->n = rr - (broots+x->r);
         next += c[n];
         assert (next <= 3*cdmax);
-        for ( i = 0 ; i < x->n ; i++ ) softassert(verify_cuberoot(cdroots[x->r+i], k, d[n]));   // this should compile to nothing if SOFTASSERTS are off
+        for ( i = 0 ; i < x->n ; i++ ) softassert(verify_cuberoot(broots[x->r+i], k, d[n]));   // this should compile to nothing if SOFTASSERTS are off
 
         // increase exponent if we can
         if ( (dd = (uint128_t)d[n]*p[n]) <= cdmax ) { e[n]++; q[n] *= p[n]; d[n] = (uint64_t)dd; continue; }
@@ -390,8 +421,8 @@ static void precompute_cuberoots_modd (uint32_t k,uint64_t pmin, uint64_t pmax,
         }
         // we reduced the current exponent and are going to add a new prime (which must fit), we need to reset r[n] before doing so
         // search backwards through the table to find the value of r[n] we need (for d = d[n]/p[n]), this is a bit of hack but faster than recomputing
-        while ( x >= cdtab[0] && p[n]*x->d != d[n] ) x--;
-        assert ( x >= cdtab[0] );
+        while ( x >= bt && p[n]*x->d != d[n] ) x--;
+        assert ( x >= bt );
         d[n] = x->d; r[n] = x->r;
         for (q[n] = p[n], i = 1 ; i < e[n] ; q[n] *= p[n], i++ );    // remultiply rather than dividing
         // add the next smaller prime (at this point it must fit)
@@ -399,47 +430,60 @@ static void precompute_cuberoots_modd (uint32_t k,uint64_t pmin, uint64_t pmax,
         pi[n] = pi[n-1]-1; q[n] = p[n] = cptab[pi[n]]; e[n] = 1; d[n] = d[n-1]*p[n];
     }
     assert (cdcnt[0] < cdmax);
-    cdroots = shared_realloc_private (cdroots, 3*cdmax*sizeof(*cdroots), bytes=next*sizeof(*cdroots));  mem += bytes;
-    cdtab[0] = shared_realloc_private (cdtab[0], cdmax*sizeof(*cdtab[0]), bytes=(cdcnt[0]+1)*sizeof(*cdtab[0]));  mem += bytes;
 
     // Sort by smoothness first, so we can bisect by smoothness
-    qsort (cdtab[0]+1,cdcnt[0],sizeof(*cdtab[0]),ui32_cmp1);
+    qsort (bt+1,cdcnt[0],sizeof(*bt),ui32_cmp1);
 
-    // Repeatedly bisect cdtab[0] according to smoothness to create cdtab[1], cdtab[2], ..., up to 15 tables
+    // Repeatedly bisect according to smoothness to determine the sizes of tables 1, 2, ..., up to 15
     cdmaxp[0] = cdmax;
     for ( i = 1 ; i < 15 ; i++ ) {
         if ( cdcnt[i-1] <= 32 ) break;  // stop when the table gets small
         j = cdcnt[i-1]/2;
-        w = cdtab[0][j].p;
-        if ( cdtab[0][j+1].p == w ) { w--; while ( cdtab[0][j].p >= w ) j--; }
+        w = bt[j].p;
+        if ( bt[j+1].p == w ) { w--; while ( bt[j].p >= w ) j--; }
         assert (j);
         cdcnt[i] = j;
         cdmaxp[i] = w;
-        assert (cdtab[0][j+1].p > w && cdtab[0][j].p <= w);
+        assert (bt[j+1].p > w && bt[j].p <= w);
     }
     cdcnt[i] = 0;   // zero terminate the list of tables
 
-    // Now resort by d in preparation for populating bisected tables
-    qsort (cdtab[0]+1,cdcnt[0],sizeof(*cdtab[0]),ui32_cmp);
+    // Now resort by d and create the compact table, storing roots in the same order (16-bit roots first, since we sorted by d)
+    qsort (bt+1,cdcnt[0],sizeof(*bt),ui32_cmp);
+    for ( cdn16 = 0, i = 1 ; i <= cdcnt[0] && bt[i].d < (1<<16) ; i++ ) cdn16 += bt[i].n;
+    cdtab = shared_malloc (bytes=(cdcnt[0]+2)*sizeof(*cdtab));  mem += bytes;
+    cdroots16 = shared_malloc (bytes=(cdn16+1)*sizeof(*cdroots16));  mem += bytes;
+    cdroots = shared_malloc (bytes=(next-cdn16+1)*sizeof(*cdroots));  mem += bytes;
+    memset(cdtab,0,sizeof(*cdtab));
+    for ( nroots = 0, i = 1 ; i <= cdcnt[0] ; i++ ) {
+        cdtab[i].d = bt[i].d; cdtab[i].p = bt[i].p; cdtab[i].r = nroots;
+        if ( bt[i].d < (1<<16) ) for ( j = 0 ; j < bt[i].n ; j++ ) cdroots16[nroots++] = broots[bt[i].r+j];
+        else for ( j = 0 ; j < bt[i].n ; j++ ) cdroots[nroots++ - cdn16] = broots[bt[i].r+j];
+        assert (cdrec_n(cdtab+i-1) == (i > 1 ? bt[i-1].n : 0));
+    }
+    assert (nroots == next);
+    cdtab[cdcnt[0]+1].r = nroots;   // sentinel
+    private_free (broots, 3*cdmax*sizeof(*broots));
 
-    // Create sdtab before populating bisected tables so sdpi values will get copied
-    // Use a binary search to find the largest d in cdtab[0] with d <= sdmax
+    // Create sdtab, use a binary search to find the largest d in cdtab with d <= sdmax
     int low = 0, hi = cdcnt[0]+1;
-    x = cdtab[0];
     while ( hi-low > 1 ) {
         int mid = low + (hi-low)/2;
-        if ( x[mid].d <= sdmax ) low = mid; else hi = mid;
+        if ( cdtab[mid].d <= sdmax ) low = mid; else hi = mid;
     }
     sdcnt = low;
 
-    sdtab = shared_malloc (bytes=(sdcnt+1)*sizeof(*sdtab));  mem += bytes;
-    memset(sdtab,0,sizeof(*sdtab));
-    for ( i = 1, j = n = 0 ; i <= sdcnt ; i++ ) {
-        sdtab[i].d = cdtab[0][i].d;  sdtab[i].p = cdtab[0][i].p; sdtab[i].n = cdtab[0][i].n;
-        n += sdtab[i].n; j += sdtab[i].d;
+    sdtab.d = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.d));  mem += bytes;
+    sdtab.p = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.p));  mem += bytes;
+    sdtab.r = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.r));  mem += bytes;
+    sdtab.n = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.n));  mem += bytes;
+    sdtab.dinv = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.dinv));  mem += bytes;
+    sdtab.i = shared_calloc (bytes=(sdcnt+1)*sizeof(*sdtab.i));  mem += bytes;
+    for ( i = 1, j = 0 ; i <= sdcnt ; i++ ) {
+        sdtab.d[i] = cdtab[i].d;  sdtab.p[i] = cdtab[i].p; sdtab.n[i] = cdrec_n(cdtab+i); sdtab.r[i] = cdtab[i].r;
+        j += sdtab.d[i];
     }
-    for ( i = 1 ; i <= sdcnt ; i++ ) cdtab[0][i].sdpi = i;
-    sdroots = shared_malloc (bytes=n*sizeof(*sdroots));  mem += bytes;
+    sdroots = cdroots16;
     sdinvs = shared_malloc (bytes=j*sizeof(*sdinvs));  mem += bytes;
 
     // make a copy of small primes (we want a table of uint16_t's to pass to invtab16)
@@ -449,51 +493,77 @@ static void precompute_cuberoots_modd (uint32_t k,uint64_t pmin, uint64_t pmax,
     for ( i = 0 ; i < spcnt ; i++ ) sptab[i] = cptab[i+1];
 
     uint16_t *tmp = malloc (2*_max(k,sdmax)*sizeof(*tmp));
-    nroots=0, ninvs=0;
+    ninvs=0;
     for ( i = 1 ; i <= sdcnt ; i++ ) {
-        sdtab[i].r = nroots; nroots += sdtab[i].n;
-        for ( j = 0 ; j < sdtab[i].n ; j++ ) sdroots[sdtab[i].r+j] = (uint16_t)cdroots[cdtab[0][i].r+j];
-        sdtab[i].dinv = sdtab[i].d > 2 ? b32_inv (sdtab[i].d) : (uint64_t)1<<63;    // don't call b32_inv for d=2, compute 2^64/2 ourselves
-        sdtab[i].i = ninvs; ninvs += sdtab[i].d;
-        invtab16 (sdinvs+sdtab[i].i, sdtab[i].d, sptab, spcnt, tmp);
+        sdtab.dinv[i] = sdtab.d[i] > 2 ? b32_inv (sdtab.d[i]) : (uint64_t)1<<63;    // don't call b32_inv for d=2, compute 2^64/2 ourselves
+        sdtab.i[i] = ninvs; ninvs += sdtab.d[i];
+        invtab16 (sdinvs+sdtab.i[i], sdtab.d[i], sptab, spcnt, tmp);
     }
     free (sptab);
-    // Now create smoothness bisected lookup tables
+    free (tmp);
+    private_free (bt, cdmax*sizeof(*bt));
+
+    // Now create smoothness bisected index vectors (each is a subsequence of the one before)
     for ( i = 1 ; cdcnt[i] ; i++ ) {
-        cdtab[i] = shared_malloc (bytes = (cdcnt[i]+1)*sizeof(*cdtab[i]));  mem += bytes;
-        memset (cdtab[i],0,sizeof(*cdtab[i]));
-        for ( x = cdtab[i-1]+cdcnt[i-1], y = cdtab[i]+cdcnt[i] ; x > cdtab[i-1] ; x-- ) if ( x->p <= cdmaxp[i] ) *y-- = *x;
-        assert (y==cdtab[i]);
+        cdvi[i] = shared_malloc (bytes = (cdcnt[i]+1)*sizeof(*cdvi[i]));  mem += bytes;
+        cdvi[i][0] = 0;
+        for ( j = 1, n = 1 ; j <= cdcnt[i-1] ; j++ ) if ( cdrec_at(i-1,j)->p <= cdmaxp[i] ) cdvi[i][n++] = i > 1 ? cdvi[i-1][j] : j;
+        assert (n == cdcnt[i]+1);
     }
-    free (tmp);
 
-    // The next two lines should compile into nothing when SOFTASSERTS is not set
-    for ( i = 1 ; i <= cdcnt[0] ; i++ ) for ( j = 0 ; j < cdtab[0][i].n ; j++ ) softassert(verify_cuberoot(cdroots[cdtab[0][i].r+j],K,cdtab[0][i].d));
-    for ( i = 1 ; i <= sdcnt ; i++ ) for ( j = 0 ; j < sdtab[i].n ; j++ ) softassert(verify_cuberoot(sdroots[sdtab[i].r+j],K,sdtab[i].d));
+    // Set skip pointers in each table using a stack of indexes of entries with increasing p (the bottom entry 0 has p=0 so the stack is never empty)
+    // and initialize cursors to the top of each table
+    uint32_t *stk = malloc ((cdcnt[0]+1)*sizeof(*stk));
+    for ( i = 0 ; cdcnt[i] ; i++ ) {
+        cdvs[i] = shared_malloc (bytes = (cdcnt[i]+1)*sizeof(*cdvs[i]));  mem += bytes;
+        cdvs[i][0] = 0;
+        for ( stk[n=0] = 0, j = 1 ; j <= cdcnt[i] ; j++ ) {
+            uint32_t pj = cdrec_at(i,j)->p;
+            while ( cdrec_at(i,stk[n])->p >= pj ) n--;
+            cdvs[i][j] = _min(j-stk[n],0xFFFF);  stk[++n] = j;
+        }
+        cdcur[i] = cdcnt[i]; cdcurd[i] = 0;
+    }
+    free (stk);
+
+#ifdef SOFTASSERTS
+    uint32_t zr[CDMAXN];
+    for ( i = 1 ; i <= cdcnt[0] ; i++ ) for ( n = cdrec_roots(zr,cdtab+i), j = 0 ; j < n ; j++ ) softassert(verify_cuberoot(zr[j],K,cdtab[i].d));
+    for ( i = 1 ; i <= sdcnt ; i++ ) for ( j = 0 ; j < sdtab.n[i] ; j++ ) softassert(verify_cuberoot(sdroots[sdtab.r[i]+j],K,sdtab.d[i]));
+#endif
 
     report_printf ("Precomputed %u zr modulo %u d <= %u and inverses modulo %u d <= %u in %.1fs, using %.1fMB shared memory\n",
-                    next, cdcnt[0], cdmax, report_timer_elapsed(), sdcnt, sdmax, (double)mem/(1<<20));
+                    next, cdcnt[0], cdmax, sdcnt, sdmax, report_timer_elapsed(), (double)mem/(1<<20));
 }
 
-// returns pointer to maximal entry with d*x->d <= dmax and (p-1)-smooth (but not all entries below this are necessarily p-smooth, caller must check)
-static inline struct cdrec *cdentry (uint64_t p, uint64_t d, uint64_t dmax)
+// returns the index j of the maximal entry in table t with d*x->d <= dmax and (p-1)-smooth, or zero if there is none
+// (not all entries below this are necessarily p-smooth, callers should follow the skips in cdvs[t] to find them)
+static inline uint32_t cdentry (uint32_t *t, uint64_t p, uint64_t d, uint64_t dmax)
 {
     uint128_t dd = d;
-    struct cdrec *x;
     unsigned i,low,mid,hi;
 
     softassert (dd*cdmax >= dmax);
-    if ( dd*cdtab[0][1].d > dmax ) return 0;
+    if ( dd*cdtab[1].d > dmax ) return 0;
     for ( i = 0 ; cdcnt[i] && cdmaxp[i] >= p ; i++ );
     if ( i ) i--;
-    x = cdtab[i];
-    low = 0; hi = cdcnt[i]+1;
+    *t = i;
+    // the answer is at most the cursor if d has not decreased and at least the cursor otherwise
+    // when it has not decreased (e.g. consecutive primes) it is typically close to the cursor, so we gallop down from there before bisecting
+    if ( d >= cdcurd[i] ) {
+        hi = cdcur[i]+1;
+        for ( mid = 1 ; mid < hi && dd*cdrec_at(i,hi-mid)->d > dmax ; mid <<= 1 ) hi -= mid;
+        low = mid < hi ? hi-mid : 0;
+    } else {
+        low = cdcur[i]; hi = cdcnt[i]+1;
+    }
     while ( hi-low > 1 ) {
         mid = low + (hi-low)/2;
-        if ( dd*x[mid].d <= dmax ) low = mid; else hi = mid;
+        if ( dd*cdrec_at(i,mid)->d <= dmax ) low = mid; else hi = mid;
     }
-    while ( x[low].p > p ) low--;   // note x[0].p == 0
-    return low ? x+low : 0;
+    cdcur[i] = low; cdcurd[i] = d;
+    while ( cdrec_at(i,low)->p > p ) low -= cdvs[i][low];     // note entry 0 has p == 0
+    return low;
 }
 
 static void precompute_cuberoots  (int k, uint64_t pmin, uint64_t pmax, uint64_t dmax)
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+#   Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+#   See LICENSE file for license details.
+#
+#   Runs the regression corpus listed in README.md: each run covers one or more phases or option modes and is checked against its expected
+#   pcnt, ccnt, dcnt, rcnt and scnt, and against a cyc/r budget, which zcubes compares at the end of the run (this requires a build with -DREPORT).
+#   Each run is made in its own directory corpus_<name>, one CORPUS line is printed per run with the cyc/r from its STATS line, and we exit with
+#   status 1 if any run failed, e.g.
+#
+#       ./corpus.sh                 # all runs
+#       ./corpus.sh bigprime30      # just the named runs
+#
+#   Set ZCUBES to use a different binary.  The cyc/r budgets were measured on a single core of the reference machine (with about 25% headroom,
+#   zcubes allows another CYCR_SLACK=10%), set CYCR_SCALE to a percentage to scale them for another machine, or to 0 to skip the cyc/r checks.
+#   A run whose counts match but whose cyc/r is over budget is reported as SLOW rather than FAILED.  Runs that enumerate no progressions
+#   (primes33, cbrts33) have no cyc/r and no budget.
+
+zcubes=${ZCUBES:-$(pwd)/zcubes}
+scale=${CYCR_SCALE:-100}
+failed=0
+
+# run name budget args..., where budget is the cyc/r budget (- for none)
+run() {
+    name=$1; budget=$2; shift 2
+    if [ -n "$only" ] && ! echo " $only " | grep -q " $name "; then return; fi
+    rm -rf corpus_$name && mkdir corpus_$name || exit 1
+    if [ "$budget" != "-" ] && [ "$scale" -gt 0 ]; then budget=$((budget*scale/100)); set -- "$@" cyc/r=$budget; else budget=none; fi
+    (cd corpus_$name && "$zcubes" "$@" > log 2>&1); sts=$?
+    cycr=$(grep -o '^STATS:.*' corpus_$name/output 2>/dev/null | grep -o ':cyc/r=[^:]*' | cut -d= -f2)
+    case "$cycr" in ''|inf|nan) cycr=n/a;; esac
+    cyc="cyc/r=$cycr:budget=$budget"
+    what=$(grep -o 'Comparison FAILED for [^ ]*' corpus_$name/log | cut -d' ' -f4)
+    if [ $sts -eq 0 ] && ! grep -q '^CSTATS:.*:OK' corpus_$name/output 2>/dev/null; then
+        echo "CORPUS:$name:ERROR:$cyc (no comparison was made, is $zcubes built with -DREPORT?)"; failed=1
+    elif [ $sts -eq 0 ]; then
+        echo "CORPUS:$name:OK:$cyc"
+    elif [ $sts -eq 2 ] && [ "$what" = "cyc/r" ]; then
+        echo "CORPUS:$name:SLOW:$cyc (counts match, cyc/r is over budget, see corpus_$name/log)"; failed=1
+    elif [ $sts -eq 2 ]; then
+        echo "CORPUS:$name:FAILED:$cyc (mismatch in $what, see corpus_$name/log)"; failed=1
+    else
+        echo "CORPUS:$name:ERROR:$cyc (exit status $sts, see corpus_$name/log)"; failed=1
+    fi
+}
+
+only="$*"
+run cached57    2000    1 57 1 1e6 1e6 1e8                  pcnt=78498 ccnt=78248 dcnt=366744 rcnt=848832 scnt=12
+run prime33     3400    1 33 1 1e7 1e7 1e10                 pcnt=664579 ccnt=664708 dcnt=2774952 rcnt=5382964 scnt=0
+run bigprime30  3200    1 30 1 2e6 2e6 1e9                  pcnt=148933 ccnt=148909 dcnt=429824 rcnt=874262 scnt=1
+run cocached42  1050    1 42 1e4 1e5 1e8 1e10               pcnt=8363 ccnt=8222 dcnt=4423513 rcnt=9848683 scnt=0
+run cocached33  270     1 33 3e4 6e4 1e9 1e10               pcnt=2812 ccnt=2755 dcnt=14053561 rcnt=34393253 scnt=0
+run uncached33  270     1 33 1e5 1.005e5 1e10 1e11 mem=4M   pcnt=40 ccnt=35 dcnt=715016 rcnt=1881954 scnt=0
+run p0q33       9500    2 33 53x1 53x53 1e7 1e9             pcnt=1 ccnt=1 dcnt=1662 rcnt=2382 scnt=0
+run primes33    -       1 33 1 1e6 1e6 1e9 2                pcnt=78498 ccnt=0 dcnt=0 rcnt=0 scnt=0
+run cbrts33     -       1 33 1 1e6 1e6 1e9 3                pcnt=78498 ccnt=78469 dcnt=0 rcnt=0 scnt=0
+run enum33      1050    1 33 1 1e6 1e6 1e9 4                pcnt=78498 ccnt=78469 dcnt=292647 rcnt=538573 scnt=0
+run full33      3800    1 33 1 1e6 1e6 1e9                  pcnt=78498 ccnt=78469 dcnt=292647 rcnt=538573 scnt=0
+exit $failed
@@ -0,0 +1,158 @@
+#ifndef _DPIPE_INCLUDE_
+#define _DPIPE_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "cstd.h"
+#include "mem.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    d pipe: in pipeline mode (zcubes option consumers=m) some workers (producers) read primes from the prime pipe, compute cuberoots and
+    enumerate d's, and hand each d with its cuberoots to the remaining workers (consumers), which run procd/procdcoprime/procdbigprime and
+    the z-check kernels on them.  Consumers never touch the enumeration tables and producers never touch the zmasks, so each keeps its own
+    working set in cache.
+
+    Each producer has a single-producer/single-consumer ring of 64-bit words in shared memory, and consumer c drains the rings of producers
+    c, c+m, c+2m, ... in turn.  A record is two header words (d, then n | kind<<32 | phase<<40) followed by the n cuberoots of k mod d,
+    and may wrap around the end of the ring.  head (words written) is only written by the producer, tail (words consumed) by the consumer.
+
+    The split of work adjusts to queue depth: a producer whose ring has no room for a record processes it itself (dpipe_put returns 0),
+    so when consumers fall behind producers take on z-checking until there is room again.  A consumer only sleeps (on a futex) when all
+    of its rings are empty, and a producer only makes a system call to wake its consumer if it is asleep.
+*/
+
+#define DPIPE_BUFSIZE       (1<<15)         // number of words in each producer's ring (a power of 2)
+#define DPIPE_PROCKD        0               // record kinds: d and its multiples by admissible divisors of k (prockd)
+#define DPIPE_BIGPRIME      1               //               large prime d (procdbigprime)
+
+typedef struct dpipe {
+    uint32_t producers;                 // number of producers
+    uint32_t consumers;                 // number of consumers
+    uint32_t bufsize;                   // number of words in each ring (a power of 2)
+    struct dpipe_ring {
+        // written by the producer (on its own cache line)
+        volatile uint64_t head __attribute__((aligned(64)));   // number of words written to ring
+        volatile uint32_t closed;       // set by the producer when it has written its last record
+        uint64_t puts;                  // number of records written to ring (private to producer)
+        uint64_t overflows;             // number of records the producer processed itself because ring was full (private to producer)
+        // written by the consumer
+        volatile uint64_t tail __attribute__((aligned(64)));   // number of words consumed from ring
+        volatile uint64_t *buf;         // ring of bufsize words
+    } *rings;
+    struct dpipe_consumer {
+        volatile uint32_t waiting __attribute__((aligned(64)));    // futex word, set by consumer before it sleeps, cleared by the producer that wakes it
+        uint32_t next;                  // ring we look at first next time (private to consumer)
+        volatile uint64_t wait_cycles;  // cycles the consumer has spent waiting on empty rings (written by consumer)
+        volatile uint64_t waits;        // number of times the consumer found all its rings empty (written by consumer)
+    } *cons;                            // everything is in shared memory
+} dpipe_ctx_t;
+
+static inline void dpipe_futex_wait (volatile uint32_t *addr, uint32_t val)
+    { syscall (SYS_futex, addr, FUTEX_WAIT, val, 0, 0, 0); }
+
+static inline void dpipe_futex_wake (volatile uint32_t *addr)
+    { syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, 0, 0, 0); }
+
+static inline size_t dpipe_bytes (uint32_t producers, uint32_t consumers, uint32_t bufsize)
+    { return sizeof(dpipe_ctx_t) + producers*(sizeof(struct dpipe_ring) + bufsize*sizeof(uint64_t)) + consumers*sizeof(struct dpipe_consumer); }
+
+// must be called before forking producers and consumers
+static inline dpipe_ctx_t *dpipe_create (uint32_t producers, uint32_t consumers, uint32_t bufsize)
+{
+    dpipe_ctx_t *q;
+    uint64_t *buf;
+
+    if ( ! bufsize ) bufsize = DPIPE_BUFSIZE;
+    assert (producers && consumers && consumers <= producers && !(bufsize&(bufsize-1)));
+    q = shared_calloc (dpipe_bytes (producers, consumers, bufsize));
+    q->producers = producers;  q->consumers = consumers;  q->bufsize = bufsize;
+    q->rings = (struct dpipe_ring *) (q+1);
+    q->cons = (struct dpipe_consumer *) (q->rings+producers);
+    buf = (uint64_t *) (q->cons+consumers);
+    for ( uint32_t i = 0 ; i < producers ; i++, buf += bufsize ) q->rings[i].buf = buf;
+    for ( uint32_t i = 0 ; i < consumers ; i++ ) q->cons[i].next = i;
+    return q;
+}
+
+static inline void dpipe_destroy (dpipe_ctx_t *q)
+    { shared_free (q, dpipe_bytes (q->producers, q->consumers, q->bufsize)); }
+
+static inline void dpipe_wake (dpipe_ctx_t *q, uint32_t i)
+{
+    struct dpipe_consumer *c = q->cons + i % q->consumers;
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to head (or closed) before the load of waiting (consumers do the opposite)
+    if ( c->waiting ) { c->waiting = 0;  dpipe_futex_wake (&c->waiting); }
+}
+
+// called by producer i, returns 1 if the record was written to its ring, 0 if there was no room (in which case the caller processes it)
+static inline int dpipe_put (dpipe_ctx_t *q, uint32_t i, uint32_t kind, uint32_t phase, uint64_t d, uint64_t z[], uint32_t n)
+{
+    struct dpipe_ring *x = q->rings+i;
+    uint64_t h = x->head, m = q->bufsize-1;
+    uint32_t j;
+
+    if ( h + n + 2 - __atomic_load_n (&x->tail, __ATOMIC_ACQUIRE) > q->bufsize ) { x->overflows++;  return 0; }
+    x->buf[h&m] = d;  x->buf[(h+1)&m] = n | (uint64_t)kind<<32 | (uint64_t)phase<<40;
+    for ( j = 0, h += 2 ; j < n ; j++, h++ ) x->buf[h&m] = z[j];
+    __atomic_store_n (&x->head, h, __ATOMIC_RELEASE);
+    x->puts++;
+    dpipe_wake (q, i);
+    return 1;
+}
+
+// called by producer i when it is done
+static inline void dpipe_close (dpipe_ctx_t *q, uint32_t i)
+    { q->rings[i].closed = 1;  dpipe_wake (q, i); }
+
+// called by consumer c, reads the next record from one of its rings into d, kind, phase and z, returns the number of cuberoots in z,
+// or -1 once all of its producers have closed their rings and every record in them has been read (z must have room for bufsize-2 words)
+static inline int dpipe_get (dpipe_ctx_t *q, uint32_t c, uint64_t *d, uint32_t *kind, uint32_t *phase, uint64_t z[])
+{
+    struct dpipe_consumer *y = q->cons+c;
+    uint64_t t, w, c0 = 0, m = q->bufsize-1;
+    uint32_t i, j, n, open;
+
+    for (;;) {
+        // look at each of our rings once, starting with the one after the last one we read from
+        for ( i = y->next, open = 0 ;; ) {
+            struct dpipe_ring *x = q->rings+i;
+            if ( (t = x->tail) != __atomic_load_n (&x->head, __ATOMIC_ACQUIRE) ) {
+                *d = x->buf[t&m];  w = x->buf[(t+1)&m];
+                n = (uint32_t)w;  *kind = (w>>32)&0xff;  *phase = w>>40;
+                for ( j = 0, t += 2 ; j < n ; j++, t++ ) z[j] = x->buf[t&m];
+                __atomic_store_n (&x->tail, t, __ATOMIC_RELEASE);
+                y->next = i + q->consumers < q->producers ? i + q->consumers : c;
+                if ( c0 ) y->wait_cycles += get_cycles() - c0;
+                return n;
+            }
+            open += ! x->closed;
+            i = i + q->consumers < q->producers ? i + q->consumers : c;
+            if ( i == y->next ) break;
+        }
+        if ( ! open ) {     // every producer had closed its ring when we found it empty, but it may have written to it before closing
+            for ( i = c ; i < q->producers && q->rings[i].tail == __atomic_load_n (&q->rings[i].head, __ATOMIC_ACQUIRE) ; i += q->consumers );
+            if ( i < q->producers ) continue;
+            if ( c0 ) y->wait_cycles += get_cycles() - c0;
+            return -1;
+        }
+        if ( ! c0 ) { c0 = get_cycles();  y->waits++; }
+        y->waiting = 1;
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to waiting before the loads of head and closed (producers do the opposite)
+        // sleep unless one of our rings has data or the last of them has just closed (closed rings that are empty count as empty)
+        for ( i = c, open = 0 ; i < q->producers && q->rings[i].tail == __atomic_load_n (&q->rings[i].head, __ATOMIC_ACQUIRE) ; i += q->consumers ) open += ! q->rings[i].closed;
+        if ( i >= q->producers && open ) dpipe_futex_wait (&y->waiting, 1);
+        y->waiting = 0;
+    }
+}
+
+#endif
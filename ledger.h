@@ -0,0 +1,153 @@
+#ifndef _LEDGER_INCLUDE_
+#define _LEDGER_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Coverage ledger (zcubes option ledger=file): a text file with one line for each completed run of the form
+
+        LEDGER:k=<k>:dmax=<dmax>:zmax=<zmax>:p=<lo>..<hi>[,<lo>..<hi>...]:ver=<version>:sum=<checksum>
+
+    recording that every d <= dmax whose largest prime divisor lies in one of the (disjoint, increasing) prime intervals [lo,hi] has been
+    searched for solutions with |z| <= zmax.  At startup we subtract from the requested prime intervals everything covered by a line with
+    the same k and at least the requested dmax and zmax, so a run only searches the primes that are left.  Lines are only ever appended,
+    each with a single write followed by fsync, and the checksum (FNV-1a of everything before ":sum=") lets us ignore a line that a crash
+    left half written (we start a new line if the file does not end with one).
+
+    Prime intervals use the same syntax on the command line (option primes=lo..hi,lo..hi,...), where lo and hi may be written in any form
+    strto64 accepts (e.g. 1e9).  We cannot subtract a z slab, since the z-check kernels always cover [-zmax,zmax], so lines with a smaller
+    zmax do not reduce the run (ledger_reduce just reports how many there were).
+*/
+
+#define LEDGER_MAX_INTERVALS    (1<<16)
+
+static inline uint32_t ledger_checksum (char *s, size_t n)
+    { uint32_t h = 2166136261U; for ( size_t i = 0 ; i < n ; i++ ) { h ^= (uint8_t)s[i];  h *= 16777619U; } return h; }
+
+// parses a list of prime intervals lo..hi,lo..hi,... (ending at the end of s or at ':') into ivs (pairs lo,hi), returns the number of
+// intervals or -1 if s is not a valid list of disjoint increasing intervals (or there are more than max)
+static inline int ledger_parse_intervals (char *s, uint64_t ivs[], int max)
+{
+    char buf[64], *t;
+    int n;
+
+    for ( n = 0 ; *s && *s != ':' && *s != '\n' ; n++ ) {
+        if ( n == max ) return -1;
+        for ( t = buf ; *s && (s[0] != '.' || s[1] != '.') && t < buf+sizeof(buf)-1 ; ) *t++ = *s++;
+        *t = '\0';  ivs[2*n] = strto64(buf);
+        if ( s[0] != '.' || s[1] != '.' ) return -1;
+        for ( s += 2, t = buf ; *s && *s != ',' && *s != ':' && *s != '\n' && t < buf+sizeof(buf)-1 ; ) *t++ = *s++;
+        *t = '\0';  ivs[2*n+1] = strto64(buf);
+        if ( ! ivs[2*n+1] || ivs[2*n] > ivs[2*n+1] || (n && ivs[2*n] <= ivs[2*n-1]) ) return -1;
+        if ( *s == ',' ) s++;
+    }
+    return n;
+}
+
+// writes the list of intervals to buf (which must have room for 42 bytes per interval), returns buf
+static inline char *ledger_format_intervals (char *buf, uint64_t ivs[], int n)
+{
+    char *s = buf;
+    *s = '\0';
+    for ( int i = 0 ; i < n ; i++ ) s += sprintf (s, "%s%lu..%lu", i ? "," : "", ivs[2*i], ivs[2*i+1]);
+    return buf;
+}
+
+// removes [lo,hi] from the n intervals in ivs (which must have room for one more), returns the new number of intervals
+static inline int ledger_subtract (uint64_t ivs[], int n, uint64_t lo, uint64_t hi)
+{
+    for ( int i = 0 ; i < n ; i++ ) {
+        uint64_t a = ivs[2*i], b = ivs[2*i+1];
+        if ( hi < a || lo > b ) continue;
+        if ( lo > a && hi < b ) {       // split [a,b] in two
+            memmove (ivs+2*i+2, ivs+2*i, 2*(n-i)*sizeof(*ivs));
+            ivs[2*i+1] = lo-1;  ivs[2*i+2] = hi+1;
+            return n+1;
+        }
+        if ( lo > a ) ivs[2*i+1] = lo-1;
+        else if ( hi < b ) ivs[2*i] = hi+1;
+        else { memmove (ivs+2*i, ivs+2*i+2, 2*(n-i-1)*sizeof(*ivs));  n--;  i--; }
+    }
+    return n;
+}
+
+// parses a ledger line, returns the number of intervals (stored in ivs) or -1 if the line is not a valid ledger line
+static inline int ledger_parse_line (char *line, uint32_t *k, uint64_t *dmax, uint128_t *zmax, uint64_t ivs[], int max)
+{
+    char buf[64], *s, *t;
+
+    if ( strncmp (line, "LEDGER:k=", 9) || ! (s = strstr (line, ":sum=")) || strtoul (s+5, 0, 16) != ledger_checksum (line, s-line) ) return -1;
+    *k = atoi (line+9);
+    if ( ! (s = strstr (line, ":dmax=")) ) return -1;
+    *dmax = strtoul (s+6, 0, 10);
+    if ( ! (s = strstr (line, ":zmax=")) ) return -1;
+    for ( s += 6, t = buf ; isdigit(*s) && t < buf+sizeof(buf)-1 ; ) *t++ = *s++;
+    *t = '\0';  *zmax = strto128 (buf);
+    if ( ! (s = strstr (line, ":p=")) ) return -1;
+    return ledger_parse_intervals (s+3, ivs, max);
+}
+
+// removes from the n intervals in ivs every prime covered by the ledger for k, dmax, zmax, returns the new number of intervals
+// (so 0 means there is nothing left to do) or -1 if the ledger exists but cannot be read
+static inline int ledger_reduce (char *ledger, uint32_t k, uint64_t dmax, uint128_t zmax, uint64_t ivs[], int n)
+{
+    uint64_t *cvs = malloc (2*LEDGER_MAX_INTERVALS*sizeof(*cvs)), ldmax;
+    uint128_t lzmax;
+    uint32_t lk;
+    int i, m, lines = 0, used = 0, lower = 0, bad = 0;
+    size_t len = 0;
+    char *line = 0;
+    FILE *fp;
+
+    assert (cvs);
+    if ( ! (fp = fopen (ledger, "r")) ) { free (cvs);  return n; }     // a ledger that does not exist yet covers nothing
+    while ( getline (&line, &len, fp) > 0 ) {
+        lines++;
+        if ( (m = ledger_parse_line (line, &lk, &ldmax, &lzmax, cvs, LEDGER_MAX_INTERVALS)) < 0 ) { bad++;  continue; }
+        if ( lk != k || ldmax < dmax ) continue;
+        if ( lzmax < zmax ) { lower++;  continue; }
+        used++;
+        for ( i = 0 ; i < m && n ; i++ ) { n = ledger_subtract (ivs, n, cvs[2*i], cvs[2*i+1]);  assert (n < LEDGER_MAX_INTERVALS); }
+    }
+    if ( ferror (fp) ) n = -1;
+    fclose (fp);  free (line);  free (cvs);
+    report_printf ("Ledger %s: %d lines, %d cover part of this run, %d for a smaller zmax, %d invalid (ignored)\n", ledger, lines, used, lower, bad);
+    return n;
+}
+
+// appends a line to the ledger recording that the n intervals in ivs have been covered for k, dmax, zmax, returns 0 on success
+static inline int ledger_record (char *ledger, uint32_t k, uint64_t dmax, uint128_t zmax, uint64_t ivs[], int n)
+{
+    char *buf = malloc (128 + 42*n), zbuf[64], c;
+    int fd, len, sts = -1;
+    off_t end;
+
+    assert (buf);
+    if ( (fd = open (ledger, O_RDWR|O_APPEND|O_CREAT, 0644)) < 0 ) { free (buf);  return -1; }
+    // if a previous write was cut short start a new line (a partial line will fail its checksum)
+    end = lseek (fd, 0, SEEK_END);
+    len = ( end > 0 && pread (fd, &c, 1, end-1) == 1 && c != '\n' ) ? sprintf (buf, "\n") : 0;
+    len += sprintf (buf+len, "LEDGER:k=%u:dmax=%lu:zmax=%s:p=", k, dmax, itoa128(zbuf,zmax));
+    ledger_format_intervals (buf+len, ivs, n);  len += strlen (buf+len);
+    len += sprintf (buf+len, ":ver=%s", VERSION_STRING);
+    char *s = buf + (buf[0] == '\n');
+    len += sprintf (buf+len, ":sum=%08x\n", ledger_checksum (s, buf+len-s));
+    if ( write (fd, buf, len) == len && fsync (fd) == 0 ) sts = 0;
+    close (fd);  free (buf);
+    return sts;
+}
+
+#endif
@@ -17,6 +17,7 @@
 #define SWAP(a,b)           do { typeof(a) _SWAP_TMP_ = a; a = b; b = _SWAP_TMP_; } while (0)
 
 #define M64_STACK    4096    // number of uint64_t's we are happy to allocate on the stack
+#define M64_LANES    4       // number of independent product chains interleaved by m64_inv_array
 
 #define M64_BITS 64
 
@@ -267,23 +268,39 @@ static inline uint64_t m64_invprime (uint64_t r, uint64_t R, uint64_t p, uint64_
     { return m64_exp_ui (r, p-2, R, p, pinv); }
 
 // computes y[i] = m64_inv(x[i]) for i from 0 to n-1, y and x may coincide
+// This uses Montgomery's trick with M64_LANES interleaved product chains (lane j handles x[i] with i = j mod M64_LANES), so that the latency of each
+// multiplication in one chain is hidden behind the others, the M64_LANES chain products are then inverted with a single call to m64_inv
 static inline void m64_inv_array (uint64_t y[], uint64_t x[], int n, uint64_t R, uint64_t R2, uint64_t R3, uint64_t p, uint64_t pinv)
 {
     uint64_t c[M64_STACK];
-    uint64_t u, v;
-    int i;
+    uint64_t f[M64_LANES], u[M64_LANES], v;
+    int i, j;
 
     if ( n > M64_STACK ) {
         for ( i = 0 ; i+M64_STACK < n ; i += M64_STACK ) m64_inv_array(y+i,x+i,M64_STACK,R,R2,R3,p,pinv);
         y += i;  x += i;  n-= i;
     }
     if ( n <= 0 ) return;
-    
-    c[0] = x[0];
-    for ( i = 1 ; i < n ; i++ ) c[i] = m64_mul (c[i-1],x[i],p,pinv);
-    u = m64_inv (c[n-1],R2,R3,p,pinv);
-    for ( i = n-1 ; i > 0 ; i-- ) { v = m64_mul (c[i-1],u,p,pinv); u = m64_mul (u,x[i],p,pinv); y[i] = v; } // set y[i] after reading x[i] in case x=y
-    y[0] = u;
+
+    if ( n < 2*M64_LANES ) {
+        c[0] = x[0];
+        for ( i = 1 ; i < n ; i++ ) c[i] = m64_mul (c[i-1],x[i],p,pinv);
+        v = m64_inv (c[n-1],R2,R3,p,pinv);
+        for ( i = n-1 ; i > 0 ; i-- ) { u[0] = m64_mul (c[i-1],v,p,pinv); v = m64_mul (v,x[i],p,pinv); y[i] = u[0]; } // set y[i] after reading x[i] in case x=y
+        y[0] = v;
+        return;
+    }
+
+    for ( i = 0 ; i < M64_LANES ; i++ ) c[i] = x[i];
+    for ( ; i < n ; i++ ) c[i] = m64_mul (c[i-M64_LANES],x[i],p,pinv);
+    // the last M64_LANES entries of c hold the chain products, invert them all using (a short instance of) Montgomery's trick
+    for ( f[0] = c[n-M64_LANES], j = 1 ; j < M64_LANES ; j++ ) f[j] = m64_mul (f[j-1],c[n-M64_LANES+j],p,pinv);
+    v = m64_inv (f[M64_LANES-1],R2,R3,p,pinv);
+    for ( j = M64_LANES-1 ; j > 0 ; j-- ) { u[(n-M64_LANES+j)%M64_LANES] = m64_mul (f[j-1],v,p,pinv); v = m64_mul (v,c[n-M64_LANES+j],p,pinv); }
+    u[(n-M64_LANES)%M64_LANES] = v;
+    // now u[j] is the inverse of the product of the x[i] in lane j that we have not yet processed
+    for ( i = n-1 ; i >= M64_LANES ; i-- ) { j = i%M64_LANES; v = m64_mul (c[i-M64_LANES],u[j],p,pinv); u[j] = m64_mul (u[j],x[i],p,pinv); y[i] = v; }
+    for ( i = 0 ; i < M64_LANES ; i++ ) y[i] = u[i];
 }
 
 // computes y[i] = m64_inv(x[i]) for i from 0 to n-1, y and x may coincide
@@ -0,0 +1,111 @@
+#ifndef _PERFCTR_INCLUDE_
+#define _PERFCTR_INCLUDE_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Hardware performance counters (cycles, instructions, L1d read misses, LLC read misses, dTLB read misses, branch misses) for the calling
+    process, read via perf_event_open.  This is only compiled in if PERFCTR is defined at compile time (and only works on Linux), report.h uses
+    it to attribute counts to phases.  Counters that cannot be opened (e.g. because the hardware or the kernel doesn't support them, we are in a
+    container or VM that doesn't expose them, or /proc/sys/kernel/perf_event_paranoid is too high) are simply marked unavailable.
+
+    Each counter is opened separately (rather than as a group) so that we get whatever subset is available.  If the kernel multiplexes them the
+    count for each interval between samples is scaled by the time enabled/time running over that interval.
+*/
+
+#if defined(PERFCTR) && ! defined(REPORT)
+#error PERFCTR requires REPORT
+#endif
+
+#define PERFCTRS        6
+
+static inline char *perfctr_name (int i)
+    { static char *names[PERFCTRS] = { "cyc", "ins", "l1dm", "llcm", "dtlbm", "brm" };  return names[i]; }
+
+#if defined(PERFCTR) && defined(__linux__)
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+static inline int perfctrs (void) { return 1; }
+
+#define PERFCTR_CACHE(c)    (PERF_COUNT_HW_CACHE_##c | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct { uint32_t type; uint64_t config; } perfctr_events[PERFCTRS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, PERFCTR_CACHE(L1D) },
+    { PERF_TYPE_HW_CACHE, PERFCTR_CACHE(LL) },
+    { PERF_TYPE_HW_CACHE, PERFCTR_CACHE(DTLB) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int perfctr_fd[PERFCTRS] = { -1, -1, -1, -1, -1, -1 };
+static uint64_t perfctr_last[PERFCTRS][3];  // raw value, time enabled and time running at the last call to perfctr_sample
+
+// reads the raw value, time enabled and time running of counter i into v, returns 0 if the read failed
+static inline int perfctr_read (int i, uint64_t v[3])
+    { return read (perfctr_fd[i], v, 3*sizeof(*v)) == 3*sizeof(*v); }
+
+// opens the counters for the calling process (call this after forking), returns a bitmap of the counters that are available
+// if errbuf is not null, it is set to a description of the first failure (if any)
+static int perfctr_open (char errbuf[256])
+{
+    struct perf_event_attr pe;
+    int i, avail = 0;
+
+    if ( errbuf ) errbuf[0] = '\0';
+    for ( i = 0 ; i < PERFCTRS ; i++ ) {
+        memset (&pe, 0, sizeof(pe));
+        pe.size = sizeof(pe);
+        pe.type = perfctr_events[i].type;  pe.config = perfctr_events[i].config;
+        pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pe.exclude_kernel = 1;  pe.exclude_hv = 1;
+        perfctr_fd[i] = syscall (SYS_perf_event_open, &pe, 0, -1, -1, 0);
+        if ( perfctr_fd[i] < 0 ) {
+            if ( errbuf && ! errbuf[0] ) snprintf (errbuf, 256, "perf_event_open failed for %s (%s)", perfctr_name(i), strerror(errno));
+            continue;
+        }
+        avail |= 1<<i;
+        if ( ! perfctr_read (i, perfctr_last[i]) ) memset (perfctr_last[i], 0, sizeof(perfctr_last[i]));
+    }
+    return avail;
+}
+
+// adds the counts since the last call (or since perfctr_open) to c, each scaled by the time enabled/time running over that interval rather
+// than overall, so that the counts added are never negative (as they could be if the overall ratio changed) and add up to the total
+static inline void perfctr_sample (uint64_t c[PERFCTRS])
+{
+    uint64_t v[3];
+
+    for ( int i = 0 ; i < PERFCTRS ; i++ ) {
+        if ( perfctr_fd[i] < 0 || ! perfctr_read (i, v) ) continue;
+        uint64_t dv = v[0]-perfctr_last[i][0], de = v[1]-perfctr_last[i][1], dr = v[2]-perfctr_last[i][2];
+        c[i] += dr && dr < de ? (uint64_t)((long double)dv*de/dr) : dv;
+        memcpy (perfctr_last[i], v, sizeof(v));
+    }
+}
+
+static void perfctr_close (void)
+    { for ( int i = 0 ; i < PERFCTRS ; i++ ) if ( perfctr_fd[i] >= 0 ) { close (perfctr_fd[i]); perfctr_fd[i] = -1; } }
+
+#else
+
+static inline int perfctrs (void) { return 0; }
+static inline int perfctr_open (char errbuf[256])
+    { if ( errbuf ) strcpy (errbuf, "hardware performance counters require PERFCTR and Linux"); return 0; }
+static inline void perfctr_sample (uint64_t c[PERFCTRS]) {}
+static inline void perfctr_close (void) {}
+
+#endif
+
+#endif
@@ -1,7 +1,12 @@
 #include <assert.h>
+#include <string.h>
 #include <stdint.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "mem.h"
 #include "cstd.h"
 
@@ -18,6 +23,13 @@ uint16_t _primes_small_indexes[8192+1] =
 #define PRIMES_PRIVATE
 #include "primes.h"
 
+// returns immediately if *addr != val, may also return early (e.g. on a signal), so callers need to recheck their condition
+static inline void primes_futex_wait (volatile uint32_t *addr, uint32_t val)
+    { syscall (SYS_futex, addr, FUTEX_WAIT, val, 0, 0, 0); }
+
+static inline void primes_futex_wake (volatile uint32_t *addr)
+    { syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, 0, 0, 0); }
+
 primes_pipe_ctx_t *_primes_create_pipe (uint64_t start, uint64_t end, uint32_t readers, uint32_t bufsize, uint64_t latency)
 {
     primes_pipe_ctx_t *pipe;
@@ -26,23 +38,21 @@ primes_pipe_ctx_t *_primes_create_pipe (uint64_t start, uint64_t end, uint32_t r
     if ( ! bufsize ) bufsize = PRIMES_PIPE_DEFAULT_BUFSIZE;
     if ( ! latency ) latency = PRIMES_PIPE_DEFAULT_LATENCY;
     assert (readers && readers <= PRIMES_PIPE_MAX_READERS && bufsize <= PRIMES_PIPE_MAX_BUFSIZE);
-    pipe = shared_calloc (sizeof(*pipe) + readers * (sizeof(struct primes_pipe_reader) + bufsize*sizeof(uint64_t)));
+    assert (!(bufsize&(bufsize-1)) && bufsize >= 4*PRIMES_PIPE_MIN_WANT);   // ring indexes are reduced with a mask
+    pipe = shared_calloc (sizeof(*pipe) + readers * (sizeof(struct primes_pipe_reader) + bufsize*sizeof(uint32_t)));
     pipe->start = start;
     pipe->end = end;
     pipe->high = 0;
-    // if there is only one reader, don't bother buffering primes just impldmdng a straight passthru to primesieve
     pipe->bufsize = bufsize;
     pipe->num_readers = readers;
     pipe->latency = latency;
-    sts = sem_init (&pipe->hungry_readers,1,0); assert (!sts);
     sts = sem_init (&pipe->finished_readers,1,0); assert (!sts);
     pipe->ctx = 0;
-    uint64_t *primes = (uint64_t *) ((char*)pipe + sizeof(*pipe) + readers*sizeof(struct primes_pipe_reader));
-    for ( uint32_t i = 0 ; i < readers ; i++, primes += bufsize ) {
+    uint32_t *ring = (uint32_t *) ((char*)pipe + sizeof(*pipe) + readers*sizeof(struct primes_pipe_reader));
+    for ( uint32_t i = 0 ; i < readers ; i++, ring += bufsize ) {
         struct primes_pipe_reader *x = pipe->readers+i;
-        sts = sem_init (&x->good_to_go,1,0); assert (!sts);
-        x->want_primes = x->num_primes = x->read_primes = 0;  x->last = 0;
-        x->primes = primes;
+        x->want = PRIMES_PIPE_MIN_WANT;
+        x->ring = ring;
     }
     return pipe;
 }
@@ -52,5 +62,178 @@ void _primes_destroy_pipe (primes_pipe_ctx_t *pipe)
     uint32_t i;
     for ( i = 0 ; i < pipe->num_readers ; i++ ) sem_wait(&pipe->finished_readers);
     for ( i = 0 ; i < pipe->num_readers ; i++ ) assert (pipe->readers[i].finished);
-    shared_free (pipe, sizeof(*pipe) + pipe->num_readers * (sizeof(struct primes_pipe_reader) + pipe->bufsize*sizeof(uint64_t)));
+    if ( pipe->order ) { for ( i = 0 ; i < pipe->num_readers ; i++ ) free (pipe->readers[i].cum);  free (pipe->order); }
+    shared_free (pipe, sizeof(*pipe) + pipe->num_readers * (sizeof(struct primes_pipe_reader) + pipe->bufsize*sizeof(uint32_t)));
+}
+
+void _primes_wake_feeder (primes_pipe_ctx_t *pipe)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our stores to stop and finished before the load of feeder_waiting
+    if ( pipe->feeder_waiting ) { pipe->feeder_waiting = 0;  primes_futex_wake (&pipe->feeder_waiting); }
+}
+
+// called by reader x when tail reaches wake_at (and when its ring is empty)
+void _primes_read_pipe_ask (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x)
+{
+    uint64_t c = get_cycles(), t = c - x->last;
+
+    // we have consumed about want/2 units of work since we last asked, adjust want so that this takes about pipe->latency cycles
+    // (there is no point increasing want if the feeder could not fill our ring to it last time)
+    if ( x->last && !(t>>63) ) {    // ignore the cycle count if it went backwards (this is possible on older or multi-cpu systems)
+        if ( t < pipe->latency/2 && x->want < PRIMES_PIPE_MAX_WANT && ! x->capped ) x->want = 2*x->want;
+        else if ( t/2 > pipe->latency && x->want > PRIMES_PIPE_MIN_WANT ) x->want = x->want/2;
+    }
+    x->last = c;
+    x->wake_at = ~(uint64_t)0;
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to tail before the load of feeder_waiting (the feeder does the opposite)
+    if ( pipe->feeder_waiting ) { pipe->feeder_waiting = 0;  primes_futex_wake (&pipe->feeder_waiting); }
+}
+
+// called by reader x when it has consumed every entry up to lhead, returns 0 if the ring is empty and there are no more primes
+int _primes_read_pipe_wait (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x)
+{
+    uint64_t h, c = 0;
+
+    while ( (h = __atomic_load_n (&x->head, __ATOMIC_ACQUIRE)) == x->tail ) {
+        if ( ! c ) { c = get_cycles();  x->waits++;  _primes_read_pipe_ask (pipe, x); }
+        if ( __atomic_load_n (&pipe->done, __ATOMIC_ACQUIRE) ) {
+            if ( __atomic_load_n (&x->head, __ATOMIC_ACQUIRE) != x->tail ) continue;
+            x->wait_cycles += get_cycles() - c;
+            return 0;
+        }
+        x->waiting = 1;
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to waiting before the loads of head and done (the feeder does the opposite)
+        if ( __atomic_load_n (&x->head, __ATOMIC_ACQUIRE) == x->tail && ! pipe->done ) primes_futex_wait (&x->waiting, 1);
+        x->waiting = 0;
+    }
+    if ( c ) x->wait_cycles += get_cycles() - c;
+    x->lhead = h;
+    x->wake_at = x->ask_at > x->tail ? x->ask_at : x->tail+1;   // ask_at is written before head, so it is at least as new as h
+    return 1;
+}
+
+// cost of the entries in x's ring from t up to fhead (t must be between tail and fhead)
+static inline uint32_t primes_pipe_pending (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x, uint64_t t)
+    { return t == x->fhead ? 0 : x->chead - x->cum[t&(pipe->bufsize-1)]; }
+
+// true if x's ring is at or below half its target fill and has room for another prime (and x is still reading), sets x->ftail
+static inline int primes_pipe_hungry (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x)
+{
+    x->ftail = __atomic_load_n (&x->tail, __ATOMIC_ACQUIRE);
+    return ! x->finished && x->fhead - x->ftail + 3 < pipe->bufsize && primes_pipe_pending (pipe, x, x->ftail) <= x->want/2;
+}
+
+// returns the first entry at which x will be hungry again if nothing more is written to its ring
+static inline uint64_t primes_pipe_ask_at (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x)
+{
+    uint64_t lo = x->ftail, hi = x->fhead, mid;
+    uint32_t w = x->want/2;
+
+    while ( lo < hi ) { mid = lo + (hi-lo)/2;  if ( primes_pipe_pending (pipe, x, mid) <= w ) hi = mid; else lo = mid+1; }
+    if ( x->fhead + 4 > pipe->bufsize && lo < x->fhead + 4 - pipe->bufsize ) lo = x->fhead + 4 - pipe->bufsize;    // not before there is room
+    return lo;
+}
+
+// starts the feeder's enumeration at the first prime >= start in one of the pipe's intervals (if it has any)
+static primes_ctx_t *primes_pipe_enum_start (primes_pipe_ctx_t *pipe)
+{
+    uint64_t start = pipe->start;
+    for ( pipe->iv = 0 ; pipe->iv < pipe->nivs && pipe->ivs[2*pipe->iv+1] < start ; pipe->iv++ );
+    if ( pipe->iv < pipe->nivs && pipe->ivs[2*pipe->iv] > start ) start = pipe->ivs[2*pipe->iv];
+    return primes_enum_start (start, pipe->end);
+}
+
+// returns the next prime in the pipe's intervals, skipping to the start of the next interval when we run off the end of one
+static uint64_t primes_pipe_enum_next (primes_pipe_ctx_t *pipe)
+{
+    uint64_t p = primes_enum_next (pipe->ctx);
+    if ( ! pipe->nivs ) return p;
+    while ( pipe->iv < pipe->nivs && p > pipe->ivs[2*pipe->iv+1] ) {
+        if ( ++pipe->iv < pipe->nivs && p < pipe->ivs[2*pipe->iv] ) {
+            primes_enum_end (pipe->ctx);
+            pipe->ctx = primes_enum_start (pipe->ivs[2*pipe->iv], pipe->end);
+            p = primes_enum_next (pipe->ctx);
+        }
+    }
+    return pipe->iv < pipe->nivs ? p : PRIMES_DONE;
+}
+
+int primes_feed_pipe (primes_pipe_ctx_t *pipe)
+{
+    uint64_t c0, c1, h, p, m = pipe->bufsize-1;
+    uint32_t i, j, k, n, c, *order;
+    int last = 0;
+
+    assert (pipe->num_readers);
+    if ( pipe->done ) return 0;
+    if ( ! pipe->ctx ) {
+        pipe->ctx = primes_pipe_enum_start (pipe);
+        pipe->order = malloc (pipe->num_readers*sizeof(*pipe->order));  assert (pipe->order);
+        for ( i = 0 ; i < pipe->num_readers ; i++ ) { pipe->readers[i].cum = malloc (pipe->bufsize*sizeof(uint32_t));  assert (pipe->readers[i].cum); }
+    }
+    order = pipe->order;
+
+    // wait until some reader needs more primes
+    c0 = get_cycles();
+    for (;;) {
+        if ( pipe->stop ) { last = 1;  break; }
+        for ( i = 0 ; i < pipe->num_readers && ! primes_pipe_hungry (pipe, pipe->readers+i) ; i++ );
+        if ( i < pipe->num_readers ) break;
+        pipe->feeder_waiting = 1;
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to feeder_waiting before the loads of tail (readers do the opposite)
+        for ( i = 0 ; i < pipe->num_readers && ! primes_pipe_hungry (pipe, pipe->readers+i) ; i++ );
+        if ( i == pipe->num_readers && ! pipe->stop ) primes_futex_wait (&pipe->feeder_waiting, 1);
+        pipe->feeder_waiting = 0;
+    }
+    c1 = get_cycles();
+    pipe->feed_idle += c1 - c0;
+
+    // list the rings that need topping up, furthest below target first (insertion sort, there are rarely more than a few)
+    for ( i = n = 0 ; i < pipe->num_readers ; i++ ) {
+        struct primes_pipe_reader *x = pipe->readers+i;
+        if ( ! primes_pipe_hungry (pipe, x) ) continue;
+        x->fneed = x->want - primes_pipe_pending (pipe, x, x->ftail);
+        for ( j = n++ ; j && pipe->readers[order[j-1]].fneed < x->fneed ; j-- ) order[j] = order[j-1];
+        order[j] = i;
+    }
+
+    // deal primes to them one at a time in that order until each reaches its target fill (or its ring is nearly full)
+    for ( k = n ; k && ! last ; ) {
+        for ( j = 0 ; j < k ; ) {
+            struct primes_pipe_reader *x = pipe->readers+order[j];
+            h = x->fhead;
+            if ( primes_pipe_pending (pipe, x, x->ftail) >= x->want || h - x->ftail + 3 >= pipe->bufsize ) {
+                x->capped = primes_pipe_pending (pipe, x, x->ftail) < x->want;
+                memmove (order+j, order+j+1, (--k-j)*sizeof(*order));      // keep the rest in order
+                continue;
+            }
+            if ( pipe->high >= pipe->end || (p = primes_pipe_enum_next (pipe)) > pipe->end ) { last = 1; break; }
+            pipe->high = p;
+            c = pipe->cost ? pipe->cost(p) : 1;
+            if ( p - x->fprev < ((uint64_t)1<<32) ) { x->cum[h&m] = x->chead;  x->ring[h&m] = p - x->fprev;  h++; }
+            else {
+                x->cum[h&m] = x->cum[(h+1)&m] = x->cum[(h+2)&m] = x->chead;
+                x->ring[h&m] = 0;  x->ring[(h+1)&m] = p>>32;  x->ring[(h+2)&m] = (uint32_t)p;  h += 3;
+            }
+            x->fhead = h;  x->chead += c;  x->fprev = p;
+            j++;
+        }
+    }
+
+    // publish the new heads (and where to ask for more) and wake readers waiting on an empty ring
+    for ( i = 0 ; i < pipe->num_readers ; i++ ) {
+        struct primes_pipe_reader *x = pipe->readers+i;
+        if ( x->fhead == x->head ) continue;
+        x->ask_at = primes_pipe_ask_at (pipe, x);
+        __atomic_store_n (&x->head, x->fhead, __ATOMIC_RELEASE);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);   // order our store to head before the load of waiting (readers do the opposite)
+        if ( x->waiting ) { x->waiting = 0;  primes_futex_wake (&x->waiting); }
+    }
+    if ( last ) {
+        __atomic_store_n (&pipe->done, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        for ( i = 0 ; i < pipe->num_readers ; i++ ) { struct primes_pipe_reader *x = pipe->readers+i; if ( x->waiting ) { x->waiting = 0;  primes_futex_wake (&x->waiting); } }
+    }
+    pipe->feed_busy += get_cycles() - c1;
+    return ! last;
 }
@@ -44,30 +44,75 @@ static inline uint64_t primes_enum_next (primes_ctx_t *ctx) { return primesieve_
 static inline uint64_t primes_enum_prev (primes_ctx_t *ctx) { return primesieve_prev_prime(ctx); }
 static inline void primes_enum_end (primes_ctx_t *ctx) { primesieve_free_iterator(ctx); free(ctx); }
 
+/*
+    Prime pipe: a single feeder process enumerates primes with primesieve and hands them out to readers (forked children) in increasing
+    order.  Each reader has a single-producer/single-consumer ring of 32-bit entries in shared memory that the feeder keeps topped up ahead
+    of consumption, so readers normally never block.  Entries are gaps between successive primes given to the same reader; a zero entry is
+    an escape followed by two entries holding the high and low halves of the prime (used for the first prime and whenever the gap does not
+    fit in 32 bits).  head (entries written) is only written by the feeder, tail (entries consumed) is only written by the reader.
+
+    Fill is measured in units of estimated work: pipe->cost(p) if a cost function has been set with primes_pipe_cost, 1 per prime otherwise.
+    The feeder keeps the cumulative cost of each ring (privately) and tells the reader the entry (ask_at) at which the work left in its ring
+    drops to half of its target fill (want).  A reader asks for more primes when it reaches that entry, by waking the feeder if it is asleep,
+    and the feeder tops up every ring at or below half of its target, dealing primes one at a time to each ring that needs them, starting
+    with the one furthest below its target (so when cost decreases with p, as it usually does, the most expensive primes go out first and to
+    the readers with the least work in hand).  Readers adjust want so that half a ring takes about pipe->latency cycles to process.  The
+    feeder only sleeps (on a futex) when no ring needs topping up, and a reader only sleeps (on a futex) when its ring is empty.
+
+    Setting pipe->stop stops the pipe early: readers get PRIMES_DONE from their next read (and may close the pipe with primes still in
+    their rings), and the feeder stops once it notices (the first reader to close the pipe wakes it if it is asleep).
+*/
+
 #define PRIMES_PIPE_MAX_READERS     (1<<10)
 #define PRIMES_PIPE_MAX_BUFSIZE     (1<<30)
 #define PRIMES_PIPE_DEFAULT_BUFSIZE (1<<16)
 #define PRIMES_PIPE_DEFAULT_LATENCY (1UL<<30)       // in cycles, this should be about 1/3 of a second
+#define PRIMES_PIPE_MIN_WANT        4               // readers start with (and never go below) this target fill
+#define PRIMES_PIPE_MAX_WANT        (1U<<30)        // and never go above this one
 #define PRIMES_DONE                 (~(uint64_t)0)
 
 typedef struct primes_pipe {
     uint64_t start;                     // primes in [start,end]
     uint64_t end;                       // will be enumerated
-    volatile uint64_t high;             // largest prime enumerated (if >= end we are done), set by writer read by readers
-    uint32_t bufsize;                   // number of elements in the arrary pointed to each readers[i]->primes
+    volatile uint64_t high;             // largest prime enumerated (if >= end we are done), set by writer
+    uint32_t bufsize;                   // number of entries in each reader's ring (a power of 2)
     uint32_t num_readers;               // number of readers (forked children)
-    uint64_t latency;                   // target latency (number of cycles between calls to primes_read_pipe)
-    sem_t hungry_readers;               // feeder waits on this, readers post when ready for more primes
+    uint64_t latency;                   // target latency (number of cycles for a reader to process half its target fill)
+    volatile uint32_t done;             // set by feeder once every prime in [start,end] has been written to a ring
+    volatile uint32_t feeder_waiting;   // futex word, set by feeder before it sleeps, cleared by the reader that wakes it
     sem_t finished_readers;             // readers post to this when they close the pipe, feeder waits on this when destroying the pipe
+    volatile uint64_t feed_busy;        // cycles the feeder has spent filling reader rings (written by feeder)
+    volatile uint64_t feed_idle;        // cycles the feeder has spent waiting for readers to ask for primes (written by feeder)
     primes_ctx_t *ctx;                  // prime enumerator used by writer, created on first call to feed_pipe (readers should fork before this)
+    uint32_t (*cost)(uint64_t p);       // estimated work for p (only called by the feeder), null for 1 per prime
+    uint32_t *order;                    // readers to top up, in the order we deal primes to them (private to feeder)
+    uint64_t *ivs;                      // if nivs is nonzero only primes in the intervals [ivs[2i],ivs[2i+1]] are enumerated
+    uint32_t nivs;                      // number of intervals (disjoint and increasing)
+    uint32_t iv;                        // interval we are enumerating (private to feeder)
+    volatile uint32_t stop __attribute__((aligned(64)));    // set (by anyone) to stop early, readers then get PRIMES_DONE and the feeder stops
     struct primes_pipe_reader {
-        sem_t good_to_go;               // feeder posts to this when primes for this reader are ready, reader waits on it
-        volatile uint32_t want_primes;  // set by reader to request more primes, read/reset by feeder
-        volatile uint32_t num_primes;   // set by feeder when primes are ready, read by reader
-        volatile uint32_t read_primes;  // updated by reader as primes are ready, reset by feeeder
+        // written by the feeder (on its own cache line)
+        volatile uint64_t head __attribute__((aligned(64)));   // number of entries written to ring
+        volatile uint64_t ask_at;       // the reader should ask for more primes when tail reaches this (valid up to head)
+        volatile uint32_t capped;       // set if the last top-up was limited by the size of the ring rather than by want
+        uint64_t fhead;                 // number of entries written to ring, copied to head when a top-up is done (private to feeder)
+        uint64_t ftail;                 // value of tail at the start of the current top-up (private to feeder)
+        uint32_t chead;                 // total cost of the primes written to ring, mod 2^32 (private to feeder)
+        uint32_t fneed;                 // how far below its target the ring was at the start of the current top-up (private to feeder)
+        uint32_t *cum;                  // cum[i&(bufsize-1)] is the value of chead before entry i was written (private to feeder)
+        uint64_t fprev;                 // last prime written to ring (private to feeder)
+        // written by the reader
+        volatile uint64_t tail __attribute__((aligned(64)));   // number of entries consumed from ring
+        volatile uint32_t want;         // target fill (in units of cost), adjusted by reader
+        volatile uint32_t waiting;      // futex word, set by reader before it sleeps on an empty ring, cleared by the feeder when it wakes it
         volatile uint32_t finished;     // set by reader when pipe is closed, sanity checked by feeder when pipe is destroyed
-        clock_t last;                   // cycle count when reader began the most recent batch, used to manage latency (private to reader)
-        volatile uint64_t *primes;      // pointer to array of primes for this reader to process (written by writer, read by reader)
+        uint64_t prev;                  // last prime returned (private to reader)
+        uint64_t lhead;                 // value of head the last time we looked (private to reader)
+        uint64_t wake_at;               // we ask for more primes when tail reaches this (private to reader)
+        uint64_t last;                  // cycle count when reader last asked for more primes, used to manage latency (private to reader)
+        volatile uint64_t wait_cycles;  // cycles the reader has spent waiting on an empty ring (written by reader)
+        volatile uint64_t waits;        // number of times the reader found its ring empty (written by reader)
+        volatile uint32_t *ring;        // ring of bufsize entries (written by feeder, read by reader)
     } readers[];                        // reader array starts immediately after prime_pipe_struct (all of this is in shared memory)
 } primes_pipe_ctx_t;
 
@@ -80,65 +125,49 @@ static inline primes_pipe_ctx_t *primes_create_pipe (uint64_t start, uint64_t en
         { struct primes_pipe *pipe = private_calloc(sizeof(*pipe)); pipe->start = start; pipe->end = end; pipe->ctx = primes_enum_start(start,end); return pipe; }
     return _primes_create_pipe (start,end,readers,bufsize,latency);
 }
+// restricts the primes to the n disjoint increasing intervals [ivs[2i],ivs[2i+1]] (within [start,end]), this must be done before the feeder
+// makes its first call to primes_feed_pipe (and ivs must not change after that)
+static inline void primes_pipe_intervals (primes_pipe_ctx_t *pipe, uint64_t *ivs, uint32_t n) { pipe->ivs = ivs;  pipe->nivs = n; }
+// sets the function used to estimate the work for each prime, this must be done before the feeder makes its first call to primes_feed_pipe
+static inline void primes_pipe_cost (primes_pipe_ctx_t *pipe, uint32_t (*cost)(uint64_t p)) { pipe->cost = cost; }
 void _primes_destroy_pipe (primes_pipe_ctx_t *pipe);
 static inline void primes_destroy_pipe (primes_pipe_ctx_t *pipe)
     { if ( !pipe->num_readers ) private_free (pipe,sizeof(*pipe)); else _primes_destroy_pipe (pipe); }
 
+int _primes_read_pipe_wait (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x);   // slow path of primes_read_pipe
+void _primes_read_pipe_ask (primes_pipe_ctx_t *pipe, struct primes_pipe_reader *x);   // asks the feeder for more primes
+
 // returns a prime in [pipe->start,pipe->end] or PRIMES_DONE > pipe->end, primes will be in increasing order (but no guarantees otherwise)
 static inline uint64_t primes_read_pipe (primes_pipe_ctx_t *pipe, uint32_t i)
 {
     if ( !pipe->num_readers ) return ( pipe->high < pipe->end && (pipe->high = primes_enum_next(pipe->ctx)) <= pipe->end ? pipe->high : PRIMES_DONE );
     softassert (i < pipe->num_readers);
     struct primes_pipe_reader *x = pipe->readers+i;
-    if ( x->read_primes < x->num_primes ) return x->primes[x->read_primes++];
-    if ( pipe->high >= pipe->end ) return PRIMES_DONE;
-    uint64_t t = get_cycles() - x->last;
-    if ( !(t>>63) ) {           // ignore the cycle count if it went backwards (this is possible on older or multi-cpu systems)
-        if ( t < pipe->latency/2 && x->num_primes && x->num_primes < pipe->bufsize/2 ) x->want_primes = 2*x->num_primes;
-        else if ( t/2 > pipe->latency && x->num_primes > 1 ) x->want_primes = x->num_primes/2;
-        else x->want_primes = x->num_primes;
-    } else {
-        x->want_primes = x->num_primes;
-    }
-    if ( ! x->want_primes ) x->want_primes = 1; // ask for 1 prime to start
-    sem_post (&pipe->hungry_readers);
-    sem_wait (&x->good_to_go);
-    if ( x->read_primes >= x->num_primes ) return PRIMES_DONE;
-    x->last = get_cycles();
-    return x->primes[x->read_primes++];
+    if ( pipe->stop ) return PRIMES_DONE;
+    if ( x->tail == x->lhead && ! _primes_read_pipe_wait (pipe, x) ) return PRIMES_DONE;
+    uint64_t t = x->tail, m = pipe->bufsize-1;
+    uint32_t g = x->ring[t&m];
+    if ( g ) { x->prev += g;  t++; } else { x->prev = (uint64_t)x->ring[(t+1)&m]<<32 | x->ring[(t+2)&m];  t += 3; }
+    __atomic_store_n (&x->tail, t, __ATOMIC_RELEASE);
+    if ( t >= x->wake_at ) _primes_read_pipe_ask (pipe, x);
+    return x->prev;
 }
 
+void _primes_wake_feeder (primes_pipe_ctx_t *pipe);
+
 static inline void primes_close_pipe (primes_pipe_ctx_t *pipe, int i)   // readers need to call this when they are done
 {
     if ( !pipe->num_readers ) return;
     softassert (i < pipe->num_readers);
-    assert (pipe->readers[i].read_primes >= pipe->readers[i].num_primes);   // TODO: allow readers to close pipe early if they wish to?
+    assert (pipe->readers[i].tail == pipe->readers[i].head || pipe->stop);  // only a stopped pipe can be closed with primes left in it
     assert (!pipe->readers[i].finished);                                    // protect against double close
     pipe->readers[i].finished = 1;
     sem_post(&pipe->finished_readers);
+    if ( pipe->stop ) _primes_wake_feeder (pipe);                           // it may be asleep waiting for us to ask for more primes
 }
 
-static inline int primes_feed_pipe (primes_pipe_ctx_t *pipe)
-{
-    uint64_t p = 0;
-    uint32_t i,j;
-
-    assert (pipe->readers);
-    sem_wait (&pipe->hungry_readers);
-    if ( ! pipe->ctx ) pipe->ctx = primes_enum_start (pipe->start, pipe->end);
-    for ( i = 0 ; i < pipe->num_readers ; i++ ) {
-        struct primes_pipe_reader *x = pipe->readers+i;
-        if ( x->want_primes > 0 ) {
-            for ( j = 0 ; j < x->want_primes && pipe->high < pipe->end && (p = primes_enum_next (pipe->ctx)) <= pipe->end ; j++ ) x->primes[j] = p;
-            pipe->high = p;
-            x->num_primes = j;  x->read_primes = x->want_primes = 0;
-            sem_post(&x->good_to_go);
-        }
-    }
-    if ( pipe->high >= pipe->end ) for ( i = 0 ; i < pipe->num_readers ; i++ ) sem_post(&pipe->readers[i].good_to_go);
-
-    return ( pipe->high < pipe->end );
-}
+// tops up the rings of readers that need more primes (sleeping until one does), returns 0 once all the primes have been written
+int primes_feed_pipe (primes_pipe_ctx_t *pipe);
 
 // these are much slower than prime_enum_next/prev
 static inline uint64_t primes_next_prime (uint64_t x) { return primesieve_nth_prime(1,x); }
@@ -0,0 +1,160 @@
+#ifndef _PROGS_INCLUDE_
+#define _PROGS_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Export and import of arithmetic progressions.  With the zcubes option export=<prefix> each job writes every d coprime to k it would
+    have processed, with the cuberoots of k mod d, to the file <prefix>_<job> instead of checking z's for it (the multiples of d by
+    admissible divisors of k are implied, as in prockd).  With import=<prefix> zcubes reads these files back and feeds them straight to
+    procd/procdcoprime/procdbigprime, so the same progressions can be checked for a different zmax, or on another machine, without
+    recomputing cuberoots or CRT lifts.
+
+    A progression file consists of a struct progs_hdr followed by records, each of which is
+
+        varint  zigzag(d - previous d in the file)
+        varint  n = number of cuberoots of k mod d
+        byte    flags: bit 0 set for large primes from the bigprime phase, bit 1 = sgnz_index(d), bits 2-4 = phase
+        bytes   the n cuberoots (each < d) packed into ui64_len(d) bits apiece, least significant bits first, padded to a byte boundary
+
+    where a varint is 7 bits per byte, least significant first, with the high bit set on all but the last byte.  The header is written in
+    native byte order.
+*/
+
+#define PROGS_MAGIC         0x00315347524f505aUL // "ZPROGS1" (little endian)
+#define PROGS_BUFSIZE       (1<<21)             // large enough for several records with the maximum number of cuberoots (3^10 < 2^16)
+#define PROGS_MAXREC        (24+8*(1<<16))      // bound on the size of a record (at most 3^10 cuberoots of at most 63 bits each)
+
+struct progs_hdr { uint64_t magic, dmax, pmin, pmax; uint128_t zmax; uint32_t k, job, jobs, pad; char ver[8]; };
+
+typedef struct progs_file {
+    FILE *fp;
+    uint8_t *buf;                       // PROGS_BUFSIZE bytes
+    size_t len, pos;                    // bytes in buf, bytes of buf consumed (readers) or written (writers)
+    uint64_t prevd;                     // d in the last record
+    uint64_t recs, roots, bytes;        // counts for reporting
+    int writing;                        // set for files opened by progs_create
+    struct progs_hdr hdr;
+} progs_file_t;
+
+static inline char *progs_file_name (char *buf, char *prefix, uint32_t job)
+    { sprintf (buf, "%s_%u", prefix, job); return buf; }
+
+static inline void progs_flush (progs_file_t *f)
+{
+    if ( f->pos && fwrite (f->buf, 1, f->pos, f->fp) != f->pos ) { fprintf (stderr, "Error writing progression file!\n"); abort(); }
+    f->bytes += f->pos;  f->pos = 0;
+}
+
+static inline uint8_t *progs_put_varint (uint8_t *s, uint64_t x)
+    { for ( ; x >= 0x80 ; x >>= 7 ) *s++ = (uint8_t)x | 0x80;  *s++ = (uint8_t)x;  return s; }
+
+static inline uint8_t *progs_get_varint (uint8_t *s, uint64_t *x)
+{
+    uint64_t v = 0;
+    int i;
+    for ( i = 0 ; *s & 0x80 ; i += 7 ) v |= (uint64_t)(*s++ & 0x7f) << i;
+    *x = v | (uint64_t)*s++ << i;
+    return s;
+}
+
+// opens <prefix>_<job> for writing, returns null on error
+static inline progs_file_t *progs_create (char *prefix, uint32_t job, uint32_t jobs, uint32_t k, uint64_t dmax, uint64_t pmin, uint64_t pmax, uint128_t zmax)
+{
+    progs_file_t *f = calloc (1, sizeof(*f));
+    char buf[1024];
+
+    assert (f);
+    f->fp = fopen (progs_file_name(buf,prefix,job), "wb");
+    if ( ! f->fp ) { free (f);  return 0; }
+    f->buf = malloc (PROGS_BUFSIZE);  assert (f->buf);
+    f->writing = 1;
+    f->hdr.magic = PROGS_MAGIC;  f->hdr.dmax = dmax;  f->hdr.pmin = pmin;  f->hdr.pmax = pmax;  f->hdr.zmax = zmax;
+    f->hdr.k = k;  f->hdr.job = job;  f->hdr.jobs = jobs;  strcpy (f->hdr.ver, VERSION_STRING);
+    memcpy (f->buf, &f->hdr, sizeof(f->hdr));  f->pos = sizeof(f->hdr);
+    return f;
+}
+
+// appends the progressions (d, z[i]) to f
+static inline void progs_write (progs_file_t *f, uint64_t d, uint64_t z[], uint32_t n, unsigned si, int big, int phase)
+{
+    uint128_t acc = 0;
+    uint8_t *s;
+    int b = ui64_len(d), m = 0;
+
+    softassert (n < (1<<16) && si < 2 && phase < 8);
+    if ( f->pos + PROGS_MAXREC > PROGS_BUFSIZE ) progs_flush (f);
+    s = f->buf + f->pos;
+    s = progs_put_varint (s, (d-f->prevd) << 1 ^ -((d-f->prevd) >> 63));     // zigzag, so small negative deltas are small too
+    s = progs_put_varint (s, n);
+    *s++ = (big ? 1 : 0) | si<<1 | phase<<2;
+    for ( uint32_t i = 0 ; i < n ; i++ ) {
+        softassert (z[i] < d);
+        acc |= (uint128_t)z[i] << m;  m += b;
+        for ( ; m >= 8 ; m -= 8, acc >>= 8 ) *s++ = (uint8_t)acc;
+    }
+    if ( m ) *s++ = (uint8_t)acc;
+    f->pos = s - f->buf;  f->prevd = d;  f->recs++;  f->roots += n;
+}
+
+static inline void progs_close (progs_file_t *f)
+{
+    if ( f->writing ) progs_flush (f);
+    fclose (f->fp);  free (f->buf);  free (f);
+}
+
+// opens <prefix>_<job> for reading, returns null if it can't be opened or is not a progression file
+static inline progs_file_t *progs_open (char *prefix, uint32_t job)
+{
+    progs_file_t *f = calloc (1, sizeof(*f));
+    char buf[1024];
+
+    assert (f);
+    f->fp = fopen (progs_file_name(buf,prefix,job), "rb");
+    if ( ! f->fp ) { free (f);  return 0; }
+    if ( fread (&f->hdr, sizeof(f->hdr), 1, f->fp) != 1 || f->hdr.magic != PROGS_MAGIC ) { fclose (f->fp);  free (f);  return 0; }
+    f->buf = malloc (PROGS_BUFSIZE+PROGS_MAXREC);  assert (f->buf);     // a truncated last record may be read past len (see below)
+    f->len = f->pos = 0;  f->bytes = sizeof(f->hdr);
+    return f;
+}
+
+// reads the next record from f into d, z, si, big and phase, returns the number of cuberoots or -1 at the end of the file
+static inline int progs_read (progs_file_t *f, uint64_t *d, uint64_t z[], unsigned *si, int *big, int *phase)
+{
+    uint128_t acc = 0;
+    uint64_t x, n, mask;
+    uint8_t *s;
+    int b, m = 0;
+
+    if ( f->len - f->pos < PROGS_MAXREC && ! feof (f->fp) ) {   // make sure the next record is in the buffer
+        memmove (f->buf, f->buf + f->pos, f->len - f->pos);  f->len -= f->pos;  f->pos = 0;
+        f->len += fread (f->buf + f->len, 1, PROGS_BUFSIZE - f->len, f->fp);
+    }
+    if ( f->pos == f->len ) return -1;
+    s = f->buf + f->pos;
+    s = progs_get_varint (s, &x);  *d = f->prevd + ((x >> 1) ^ -(x & 1));
+    s = progs_get_varint (s, &n);
+    if ( n >= (1<<16) || ! *d ) { fprintf (stderr, "ERROR: progression file is corrupted\n"); abort(); }
+    *big = *s & 1;  *si = (*s >> 1) & 1;  *phase = *s++ >> 2;
+    b = ui64_len(*d);  mask = ((uint64_t)1 << b) - 1;
+    for ( uint32_t i = 0 ; i < n ; i++ ) {
+        for ( ; m < b ; m += 8 ) acc |= (uint128_t)*s++ << m;
+        z[i] = (uint64_t)acc & mask;  acc >>= b;  m -= b;
+    }
+    if ( s > f->buf + f->len ) { fprintf (stderr, "ERROR: progression file is truncated\n"); abort(); }
+    f->bytes += s - (f->buf + f->pos);  f->pos = s - f->buf;  f->prevd = *d;  f->recs++;  f->roots += n;
+    return (int)n;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#define ZCUBES_NOMAIN
+#include "zcubes.c"                 // we want the same inlined kernels and precomputed tables that zcubes uses
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Replays z-check workloads captured by a zcubes build with TRACE defined (see trace.h), built with "make replay" and run as
+
+        replay n reps trace_0 [trace_1 ...]
+
+    All the trace files must come from the same run (same k, dmax, zmax).  We rebuild the precomputed tables for k, dmax, zmax, load all
+    the records into memory, and then fork n workers, each of which makes every recorded call reps times, calling the kernel the call was
+    recorded for (so a change to the direct/lift decision in procd does not change the workload).  The output consists of one line
+
+        REPLAY:k=<k>:dmax=<dmax>:zmax=<zmax>:every=<TRACE>:records=<records>:n=<n>:reps=<reps>:ver=<version>
+
+    followed by one line per kernel and one for all of them together, of the form
+
+        REPLAY:<kernel>:calls=<calls>:cyc/call=<cycles per call>:cyc/z=<cycles per candidate z>
+
+    where calls and cycles are summed over the workers and a candidate z is one term of a progression before any lifting (so for zrchecklift
+    cyc/z can be well below 1).  The last line also gives wall-clock cycles per call for the whole replay, which is what changes with n.
+    Solutions in the traced calls are found again and written to the output file as usual, once per worker and rep.
+*/
+
+struct replay_stat { uint64_t calls, zs, cycles; };
+
+static uint8_t *replay_buf;         // all the records, each a struct trace_rec followed by za[] and zb[] (not necessarily aligned)
+static uint64_t replay_bytes, replay_recs;
+static uint32_t replay_maxca, replay_maxcb;
+
+// sets zmax (and the values derived from it) to z, the z-check kernels read these globals
+static void replay_zmax (uint128_t z)
+    { zmax128 = z;  zmaxbits = ui128_len(zmax128);  zmaxld = (long double) (zmax128 + (zmax128>>62) + 1); }
+
+// appends the records in the trace file name to replay_buf, returns 0 if the file is not a trace file or does not match hdr
+static int replay_load (char *name, struct trace_hdr *hdr)
+{
+    struct trace_hdr h;
+    struct trace_rec rec;
+    uint64_t n, off;
+    FILE *fp;
+
+    fp = fopen (name, "rb");
+    if ( ! fp ) { fprintf (stderr, "ERROR: Unable to open trace file %s\n", name); return 0; }
+    if ( fread (&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC ) { fprintf (stderr, "ERROR: %s is not a trace file\n", name); fclose (fp); return 0; }
+    if ( h.k != hdr->k || h.dmax != hdr->dmax || h.zmax != hdr->zmax )
+        { fprintf (stderr, "ERROR: trace file %s does not come from the same run as the first trace file\n", name); fclose (fp); return 0; }
+    if ( strcmp (h.ver, VERSION_STRING) ) fprintf (stderr, "WARNING: trace file %s was written by version %s, this is version %s\n", name, h.ver, VERSION_STRING);
+    fseek (fp, 0, SEEK_END);  n = ftell (fp) - sizeof(h);  fseek (fp, sizeof(h), SEEK_SET);
+    replay_buf = realloc (replay_buf, replay_bytes + n);  assert (replay_buf);
+    if ( fread (replay_buf+replay_bytes, 1, n, fp) != n ) { fprintf (stderr, "ERROR: error reading trace file %s\n", name); fclose (fp); return 0; }
+    fclose (fp);
+    for ( off = replay_bytes ; off < replay_bytes + n ; ) {
+        if ( off + sizeof(rec) > replay_bytes + n ) break;
+        memcpy (&rec, replay_buf+off, sizeof(rec));
+        if ( rec.path >= TPATHS || rec.si > 1 || rec.ki >= kdcnt ) break;
+        off += sizeof(rec) + rec.ca*sizeof(uint64_t) + rec.cb*sizeof(uint32_t);
+        if ( off > replay_bytes + n ) break;
+        if ( rec.ca > replay_maxca ) replay_maxca = rec.ca;
+        if ( rec.cb > replay_maxcb ) replay_maxcb = rec.cb;
+        replay_recs++;
+    }
+    if ( off != replay_bytes + n ) { fprintf (stderr, "ERROR: trace file %s is corrupted or truncated\n", name); return 0; }
+    replay_bytes += n;
+    return 1;
+}
+
+// makes every recorded call reps times, accumulating stats for each kernel in s
+static void replay_worker (int reps, struct replay_stat s[TPATHS])
+{
+    struct trace_rec rec;
+    uint64_t *za = malloc ((replay_maxca+1)*sizeof(*za)), off, c0;
+    uint32_t *zb = malloc ((replay_maxcb+1)*sizeof(*zb));
+    int j;
+
+    assert (za && zb);
+    allocate_private_buffers ();
+    for ( j = 0 ; j < reps ; j++ ) {
+        for ( off = 0 ; off < replay_bytes ; ) {
+            memcpy (&rec, replay_buf+off, sizeof(rec));  off += sizeof(rec);
+            memcpy (za, replay_buf+off, rec.ca*sizeof(*za));  off += rec.ca*sizeof(*za);      // the kernels may modify these, so we copy them every time
+            memcpy (zb, replay_buf+off, rec.cb*sizeof(*zb));  off += rec.cb*sizeof(*zb);
+            c0 = get_cycles();
+            switch ( rec.path ) {
+            case TP_ONE: zrcheckone (rec.d, rec.si, rec.a, za, rec.ca, rec.b, zb, rec.cb, rec.ainvb, rec.binv); break;
+            case TP_AFEW: zrcheckafew (rec.d, rec.si, rec.a, za, rec.ca, rec.b, zb, rec.cb, rec.ainvb, rec.binv, rec.l); break;
+            default: zrchecklift (rec.d, rec.si, rec.ki, rec.a, za, rec.ca); break;
+            }
+            s[rec.path].cycles += get_cycles()-c0;  s[rec.path].calls++;  s[rec.path].zs += rec.ca*(uint64_t)(rec.cb ? rec.cb : 1)*rec.l;
+        }
+    }
+    free_private_buffers ();
+    free (za);  free (zb);
+}
+
+static void replay_report (char *kernel, struct replay_stat *s, uint64_t wall)
+{
+    if ( ! s->calls ) return;
+    printf ("REPLAY:%s:calls=%lu:cyc/call=%.1f:cyc/z=%.3f", kernel, s->calls, (double)s->cycles/s->calls, (double)s->cycles/s->zs);
+    if ( wall ) printf (":wall/call=%.1f", (double)wall/s->calls);
+    printf ("\n");
+    fflush (stdout);
+}
+
+int main (int argc, char *argv[])
+{
+    struct trace_hdr hdr;
+    struct replay_stat *stats, total[TPATHS+1];
+    char zbuf[64];
+    int i, n, reps, status;
+
+    if ( argc < 4 ) { fprintf (stderr, "    replay n reps trace_0 [trace_1 ...]\n    (version %s)\n", VERSION_STRING); return 0; }
+    n = atoi(argv[1]);  reps = atoi(argv[2]);
+    if ( n < 1 || reps < 1 ) { fprintf (stderr, "ERROR: n=%d and reps=%d must be positive\n", n, reps); return -1; }
+
+    // we need kdcnt to validate records, so read the first header and precompute before loading the records
+    memset (&hdr, 0, sizeof(hdr));
+    FILE *fp = fopen (argv[3], "rb");
+    if ( ! fp || fread (&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC ) { fprintf (stderr, "ERROR: %s is not a trace file\n", argv[3]); return -1; }
+    fclose (fp);
+    if ( ! goodk(hdr.k) ) { fprintf (stderr, "ERROR: trace file %s has invalid k=%u\n", argv[3], hdr.k); return -1; }
+    dmax = hdr.dmax;
+    replay_zmax (hdr.zmax);
+    budget_init (n, 0, 0, CDMAX, SDMAX, ZBUFBITS, IBATCH, PRIMES_PIPE_MAX_BUFSIZE);
+    precompute (hdr.k, 2, 1000);
+    if ( smzmaskb != hdr.smzmaskb ) fprintf (stderr, "WARNING: smzmaskb=%u differs from the traced run (%u), some kernel timings may differ\n", smzmaskb, hdr.smzmaskb);
+    for ( i = 3 ; i < argc ; i++ ) if ( ! replay_load (argv[i], &hdr) ) return -1;
+    if ( ! replay_recs ) { fprintf (stderr, "ERROR: no records to replay\n"); return -1; }
+
+    printf ("REPLAY:k=%u:dmax=%lu:zmax=%s:every=%u:records=%lu:n=%d:reps=%d:ver=%s\n", hdr.k, dmax, itoa128(zbuf,zmax128), hdr.every, replay_recs, n, reps, VERSION_STRING);
+    fflush (stdout);
+    stats = shared_calloc (n*TPATHS*sizeof(*stats));
+    uint64_t wall = get_cycles();
+    for ( i = 0 ; i < n ; i++ ) if ( !fork() ) { replay_worker (reps, stats+i*TPATHS);  _exit (0); }
+    while ( wait(&status) > 0 ) assert (WIFEXITED(status) && ! WEXITSTATUS(status));
+    wall = get_cycles()-wall;
+
+    memset (total, 0, sizeof(total));
+    for ( i = 0 ; i < n*TPATHS ; i++ ) {
+        struct replay_stat *s = stats+i, *t = total+(i%TPATHS);
+        t->calls += s->calls;  t->zs += s->zs;  t->cycles += s->cycles;
+        total[TPATHS].calls += s->calls;  total[TPATHS].zs += s->zs;  total[TPATHS].cycles += s->cycles;
+    }
+    for ( i = 0 ; i < TPATHS ; i++ ) replay_report (trace_path_name(i), total+i, 0);
+    replay_report ("all", total+TPATHS, wall);
+    return 0;
+}
@@ -12,6 +12,8 @@
 #include "m64.h"
 #include "mem.h"
 #include "cstd.h"
+#include "perfctr.h"
+#include "primes.h"
 
 /*
     Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
@@ -21,6 +23,7 @@
 #define VERSION_STRING      "1.1"   // must fit in 8 bytes (including null terminator)
 
 #define CHECKPOINTS         16      // number of intervals, we will only write CHECKPOINTS-1 checkpoints
+#define CYCR_SLACK          10      // report_comparisons flags cyc/r more than this many percent above the expected value
 
 // This module contains functions for reporting/tracking performance stats and for logging stats and any found solutions to the output file
 // Unless REPORT is defined at compile time (see the makefile), reporting will be turned off and only the output_* functions are relevant
@@ -133,15 +136,23 @@ static inline void report_reset (unsigned n) {}
 static inline int report_phase (int phase) { return 1; }
 static inline void report_job_start (unsigned job) {}
 static inline void report_job_end (unsigned job) {}
-static inline void report_comparisons (uint64_t ppcnt, uint64_t pccnt, uint64_t pdcnt, uint64_t prcnt) {}
+static inline void report_pipe (primes_pipe_ctx_t *pipe) {}
+static inline void report_waits (volatile uint64_t *cycles, volatile uint64_t *n) {}
+static inline int report_current_phase (void) { return 0; }
+static inline void report_no_checkpoints (void) {}
+static inline void report_keep_checkpoints (void) {}
+static inline void report_checkpoint_pass (int pass) {}
+static inline int report_comparisons (int64_t ppcnt, int64_t pccnt, int64_t pdcnt, int64_t prcnt, int64_t pscnt, double pcycr) { return 0; }
 static inline void report_end (void) {}
 
 static inline int report_p (uint64_t p) { return 1; }
+static inline uint64_t report_chkpt_pmax (void) { return ~(uint64_t)0; }
 static inline int report_c (uint32_t n) { return 1; }
 static inline int report_d (uint64_t d, uint32_t n) { return 1; }
 static inline int report_z (uint64_t d, uint64_t n, uint64_t l, uint32_t i) { return 1; }
 static inline void report_zpass (uint128_t absz) {}
 static inline void report_zcheck (uint128_t absz) {}
+static inline void report_zbmcache (int hit) {}
 static inline void report_s (uint64_t d, uint128_t absz) {}
 
 static inline void profile_start (void) {}
@@ -166,6 +177,18 @@ char *phases[] = { "precomputation", "cached", "uncached", "cocached", "nearprim
 static double adhoc_timer;  // used by report_reset, report_elapsed
 static uint64_t pcnt, rpcnt, ppcnt, ccnt, rccnt, pccnt, dcnt, rdcnt, pdcnt, rcnt, rrcnt, prcnt, pcur, zcnt, rzcnt, pzcnt, zccnt, zlcnt, zmcnt, zmpzcnt, bytes;
 static uint64_t zchks[3];
+static uint64_t zbmhits, zbmmisses;         // hits/misses in the zrcheckmany bitmap cache (see zbmcache in zcheck.h)
+static uint64_t *zbmstats;                  // shared array of per-job hits/misses (kept outside jobstat_rec so checkpoints are unaffected, not restored from checkpoints)
+static uint64_t perfcnts[PHASE_MAX+1][PERFCTRS];    // hardware performance counts by phase (PERFCTR only, see perfctr.h)
+static int perfavail;                       // bitmap of available hardware counters
+static struct perfrec { uint64_t cnts[PHASE_MAX+1][PERFCTRS]; int avail; } *perfstats; // shared array of per-job perfcnts (like zbmstats, not checkpointed)
+#define PIPECNTS 5                                  // cycles waiting for primes, number of waits, elapsed cycles, feeder busy cycles, feeder idle cycles
+static primes_pipe_ctx_t *report_pipe_ctx;          // prime pipe the workers are reading from (set by report_pipe)
+static volatile uint64_t *report_wait_cycles;       // where this worker counts cycles spent waiting for work (set by report_waits)
+static volatile uint64_t *report_wait_cnt;          // and the number of times it has waited
+static uint64_t pipecnts[PHASE_MAX+1][PIPECNTS];    // prime pipe counts by phase (feeder counts are attributed to the phase this worker is in)
+static uint64_t pipelast[PIPECNTS];                 // values of the pipe counters at the last call to report_pipe_sample
+static struct piperec { uint64_t cnts[PHASE_MAX+1][PIPECNTS]; } *pipestats;  // shared array of per-job pipecnts (like zbmstats, not checkpointed)
 static uint32_t report_k, report_p0, scnt;
 static uint64_t report_pmin, report_pmax, report_dmax, phase_lines;
 static uint128_t report_zmax, zmsum;
@@ -190,6 +213,9 @@ struct jobstat_rec {
 } *jobstats;                                // this will point to shared memory
 
 static uint32_t chkpt_id, num_chkpts;       // num_checkpts is typically CHECKPOINTS but my be smaller depending in (pmin,pmax)
+static int chkpt_off;                       // set by report_no_checkpoints, we still track checkpoint intervals but don't write or resume from checkpoint files
+static int chkpt_keep;                      // set by report_keep_checkpoints, report_end leaves checkpoint files in place so the run can be resumed
+static int chkpt_pass;                      // set by report_checkpoint_pass, iterative deepening passes use their own checkpoint files
 static uint64_t chkpt_pmax[CHECKPOINTS+1];  // entry 0 reserved for null, nth checkpoint covers p in [pmin,chkpt_max[n]], chkpt_max[CHECKPOINTS] = pmax is a sentinel
 
 void init_jobstats (struct jobstat_rec *x, uint32_t job)
@@ -215,18 +241,22 @@ void update_jobstats (struct jobstat_rec *x)
 }
 
 static inline char *checkpoint_file (char *buf, uint32_t job, uint32_t chkpt)
-    { sprintf (buf, "checkpoint_%u_%u", job, chkpt); return buf; }
+{
+    if ( chkpt_pass ) sprintf (buf, "checkpoint_pass%d_%u_%u", chkpt_pass, job, chkpt); else sprintf (buf, "checkpoint_%u_%u", job, chkpt);
+    return buf;
+}
 
 static void write_checkpoint ()  // writes current checkpoint for current job
 {
     FILE *fp;
     struct jobstat_rec rec;
-    char buf[32];
+    char buf[64];
     size_t cnt;
 
     verbose_printf ("Writing checkpoint %d (pmax=%lu) for job %d at p=%lu\n", chkpt_id, chkpt_pmax[chkpt_id], jobid, pcur);
 
     assert (chkpt_id && chkpt_id < num_chkpts && pcur <= chkpt_pmax[chkpt_id]);
+    if ( chkpt_off ) { chkpt_id++;  return; }
     rec = jobstats[jobid];
     update_jobstats (&rec); // update copy, not jobstats[jobid] because we are not clearing counters, they will get applied again
     fp = fopen (checkpoint_file(buf,jobid,chkpt_id),"wb"); assert(fp); cnt = fwrite(&rec, sizeof(rec), 1, fp); fclose(fp);  assert (cnt==1);
@@ -237,7 +267,7 @@ static void write_checkpoint ()  // writes current checkpoint for current job
 static int read_checkpoint (struct jobstat_rec *x, uint32_t job, uint32_t chkpt)
 {
     FILE *fp;
-    char buf[32];
+    char buf[64];
     size_t cnt;
 
     assert (job < jobs && chkpt && chkpt < num_chkpts);
@@ -251,7 +281,7 @@ static int read_checkpoint (struct jobstat_rec *x, uint32_t job, uint32_t chkpt)
 }
 
 static void delete_checkpoint (uint32_t job, uint32_t chkpt)
-    { char buf[32]; remove(checkpoint_file(buf,job,chkpt)); }
+    { char buf[64]; remove(checkpoint_file(buf,job,chkpt)); }
 
 
 static inline void report_printf (const char *format, ...) { va_list args;  va_start(args, format);  vprintf(format, args);  va_end(args); fflush(stdout); }
@@ -306,9 +336,13 @@ report_printf ("VERIFICATION:1\n");
 
     jobs = cores;
     jobstats = shared_malloc (jobs*sizeof(*jobstats));
+    zbmstats = shared_calloc (2*jobs*sizeof(*zbmstats));
+    if ( perfctrs() ) perfstats = shared_calloc (jobs*sizeof(*perfstats));
+    pipestats = shared_calloc (jobs*sizeof(*pipestats));
 
-    // search for last checkpoint written by every job (if any)
-    for ( j = 1 ; j < num_chkpts ; j++ ) {
+    // search for last checkpoint written by every job (if any), unless checkpoints are off, in which case we neither resume from
+    // checkpoint files nor delete them (they may belong to a run of the same command in a mode that writes them)
+    for ( j = 1 ; j < num_chkpts && ! chkpt_off ; j++ ) {
         for ( i = 0 ; i < jobs ; i++ ) {
             if ( ! (sts = read_checkpoint (jobstats+i, i, j)) ) break;
             if ( sts < 0 ) { report_printf ("Deleting inconsistent checkpoint file %s\n", checkpoint_file(buf,i,j)); delete_checkpoint(i,j);  break; }
@@ -342,11 +376,48 @@ report_printf ("VERIFICATION:1\n");
     }
     // IMPORTANT: we need to clear any extra checkpoint files to avoid possible inconsistencies in the future
     // We cannot assume the same jobs will get the same primes in our new run (this almost surely will not happen)
-    for ( i = 0 ; i < jobs ; i++ ) for ( j = chkpt_id ; j < num_chkpts ; j++ ) delete_checkpoint(i,j);
+    if ( ! chkpt_off ) for ( i = 0 ; i < jobs ; i++ ) for ( j = chkpt_id ; j < num_chkpts ; j++ ) delete_checkpoint(i,j);
     start_time = report_time = phase_time = get_time();  start_cycles = report_cycles = phase_cycles = get_cycles();
     return start_pmin;
 }
 
+// called before we fork off jobs with the pipe they will read primes from, so we can account for the time spent waiting on it
+static inline void report_pipe (primes_pipe_ctx_t *pipe)
+    { report_pipe_ctx = pipe; }
+
+// sets the wait counters of the calling worker (the prime pipe reader it uses by default), call before report_job_start
+static inline void report_waits (volatile uint64_t *cycles, volatile uint64_t *n)
+    { report_wait_cycles = cycles;  report_wait_cnt = n; }
+
+// returns the phase this worker is in (the phase after the last one passed to report_phase)
+static inline int report_current_phase (void) { return current_phase; }
+
+// checkpoint files will not be written or resumed from (for modes in which a job's counts do not cover every d for the primes it has read),
+// must be called before report_start
+static inline void report_no_checkpoints (void) { chkpt_off = 1; }
+
+// checkpoint files will be kept by report_end (for runs that stop before every prime has been processed)
+static inline void report_keep_checkpoints (void) { chkpt_keep = 1; }
+
+// iterative deepening pass j > 0 reads and writes checkpoint_passj_* in place of checkpoint_*, so that its report_start (which deletes
+// checkpoints that do not match its dmax and zmax) leaves those of the full run and of the other passes alone (must precede report_start)
+static inline void report_checkpoint_pass (int pass) { chkpt_pass = pass; }
+
+static inline void report_pipe_read (uint64_t v[PIPECNTS])
+{
+    v[0] = *report_wait_cycles;  v[1] = *report_wait_cnt;  v[2] = get_cycles();  v[3] = report_pipe_ctx->feed_busy;  v[4] = report_pipe_ctx->feed_idle;
+}
+
+// adds the changes in the pipe counters since the last call (or since report_job_start) to the current phase
+static inline void report_pipe_sample (void)
+{
+    uint64_t v[PIPECNTS];
+
+    if ( ! report_pipe_ctx || ! report_pipe_ctx->num_readers ) return;
+    report_pipe_read (v);
+    for ( int i = 0 ; i < PIPECNTS ; i++ ) { pipecnts[current_phase][i] += v[i]-pipelast[i];  pipelast[i] = v[i]; }
+}
+
 static inline void report_job_start (unsigned job)
 {
     assert (job < jobs);
@@ -358,9 +429,21 @@ static inline void report_job_start (unsigned job)
     zcnt = rzcnt = pzcnt = 0;
     zccnt = zlcnt = zmcnt = zmpzcnt = 0;
     zmsum = 0;
+    zbmhits = zbmmisses = 0;
     memset(zchks,0,sizeof(zchks));
     start_time = report_time = phase_time = get_time();
     start_cycles = report_cycles = phase_cycles = get_cycles();
+    if ( perfctrs() ) {
+        char errbuf[256];
+        memset (perfcnts,0,sizeof(perfcnts));
+        perfavail = perfctr_open (errbuf);
+        if ( errbuf[0] && ! job ) report_printf ("Warning: %s, hardware counters that could not be opened will be reported as n/a\n", errbuf);
+    }
+    memset (pipecnts,0,sizeof(pipecnts));
+    if ( report_pipe_ctx && report_pipe_ctx->num_readers ) {
+        if ( ! report_wait_cycles ) report_waits (&report_pipe_ctx->readers[job].wait_cycles, &report_pipe_ctx->readers[job].waits);
+        report_pipe_read (pipelast);
+    }
 }
 
 static inline void report_job_end (unsigned job)
@@ -369,6 +452,15 @@ static inline void report_job_end (unsigned job)
     assert (job == jobid);
     struct jobstat_rec *x = jobstats+jobid;
     update_jobstats (x);
+    zbmstats[2*jobid] += zbmhits;  zbmstats[2*jobid+1] += zbmmisses;
+    if ( perfctrs() ) {
+        perfctr_sample (perfcnts[current_phase]);  perfctr_close ();
+        struct perfrec *y = perfstats+jobid;
+        for ( int i = 0 ; i <= PHASE_MAX ; i++ ) for ( int j = 0 ; j < PERFCTRS ; j++ ) y->cnts[i][j] += perfcnts[i][j];
+        y->avail = perfavail;
+    }
+    report_pipe_sample ();
+    for ( int i = 0 ; i <= PHASE_MAX ; i++ ) for ( int j = 0 ; j < PIPECNTS ; j++ ) pipestats[jobid].cnts[i][j] += pipecnts[i][j];
     if ( report_p0 > 1 ) { sprintf(pminbuf,"%ux%lu",report_p0,report_pmin); sprintf(pmaxbuf,"%ux%lu",report_p0,report_pmax); }
     else { sprintf(pminbuf,"%lu",report_pmin); sprintf(pmaxbuf,"%lu",report_pmax); }
     string_time(tbuf); option_string(obuf,options);
@@ -413,6 +505,8 @@ static inline int report_phase (int n)
 
     if ( profiling() ) return 1;
     assert (n >= 0 && n <= PHASE_MAX);
+    if ( perfctrs() ) perfctr_sample (perfcnts[current_phase]);    // no-op unless this worker has opened its counters
+    report_pipe_sample ();
     if ( n < PHASE_MAX ) current_phase = n+1;
     t = get_time();
     if ( !n ) { 
@@ -433,11 +527,95 @@ static inline int report_phase (int n)
     return 1;
 }
 
+// prints the hardware counter totals for each phase and writes them to pbuf in the form :perf.<phase>=cyc,ins,l1dm,llcm,dtlbm,brm (unavailable counters are n/a)
+static inline void report_perfctrs (char pbuf[1024])
+{
+    uint64_t c[PHASE_MAX+1][PERFCTRS];
+    char cbuf[PERFCTRS][32], *s;
+    int i, j, k, avail;
+
+    pbuf[0] = '\0';
+    if ( ! perfctrs() ) return;
+    memset (c,0,sizeof(c));  avail = (1<<PERFCTRS)-1;
+    for ( k = 0 ; k < jobs ; k++ ) {
+        avail &= perfstats[k].avail;
+        for ( i = 0 ; i <= PHASE_MAX ; i++ ) for ( j = 0 ; j < PERFCTRS ; j++ ) c[i][j] += perfstats[k].cnts[i][j];
+    }
+    if ( ! avail ) { report_printf ("   perf: n/a (no hardware counters available)\n"); return; }
+    s = pbuf;
+    for ( i = 0 ; i <= PHASE_MAX ; i++ ) {
+        for ( j = 0 ; j < PERFCTRS && ! c[i][j] ; j++ );
+        if ( j == PERFCTRS ) continue;
+        for ( j = 0 ; j < PERFCTRS ; j++ ) if ( avail & (1<<j) ) sprintf (cbuf[j], "%lu", c[i][j]); else strcpy (cbuf[j], "n/a");
+        report_printf ("   perf: %-10s cyc=%s ins=%s", phases[i], cbuf[0], cbuf[1]);
+        if ( (avail&3) == 3 ) report_printf (" (%.2f IPC)", (double)c[i][1]/c[i][0]);
+        for ( j = 2 ; j < PERFCTRS ; j++ ) {
+            report_printf (" %s=%s", perfctr_name(j), cbuf[j]);
+            if ( (avail&2) && (avail&(1<<j)) ) report_printf (" (%.2f/kins)", 1000.0*c[i][j]/c[i][1]);
+        }
+        report_printf ("\n");
+        s += sprintf (s, ":perf.%s=", phases[i]);
+        for ( j = 0 ; j < PERFCTRS ; j++ ) s += sprintf (s, "%s%s", j ? "," : "", cbuf[j]);
+    }
+}
+
+// prints the time workers spent waiting for primes and the feeder's busy/idle time for each phase and writes them to pbuf in the form
+// :pipe.<phase>=<wait cycles>,<waits>,<worker cycles>,<feeder busy cycles>,<feeder idle cycles> (worker counts are summed over jobs,
+// feeder counts are attributed to phases by the phase changes of the last job, which is always a pipe reader), followed by
+// :feedbusy=<cycles>:feedidle=<cycles> for the whole run.  In pipeline mode consumers count their waits for d's as waits.
+static inline void report_pipes (char pbuf[1024])
+{
+    uint64_t c[PHASE_MAX+1][PIPECNTS], w, n, t;
+    char *s;
+    int i, j, k;
+
+    pbuf[0] = '\0';
+    if ( ! report_pipe_ctx || ! report_pipe_ctx->num_readers ) return;
+    memset (c,0,sizeof(c));
+    for ( k = 0 ; k < jobs ; k++ ) for ( i = 0 ; i <= PHASE_MAX ; i++ ) for ( j = 0 ; j < 3 ; j++ ) c[i][j] += pipestats[k].cnts[i][j];
+    for ( i = 0 ; i <= PHASE_MAX ; i++ ) for ( j = 3 ; j < PIPECNTS ; j++ ) c[i][j] = pipestats[jobs-1].cnts[i][j];
+    s = pbuf;  w = n = t = 0;
+    for ( i = 0 ; i <= PHASE_MAX ; i++ ) {
+        t += c[i][2];
+        if ( ! c[i][1] && ! c[i][3] ) continue;    // nothing happened in this phase
+        report_printf ("   pipe: %-10s wait=%.2f%% (%lu waits, %.0f cyc/wait) feeder busy=%.2f%%\n", phases[i], 100.0*c[i][0]/c[i][2], c[i][1],
+                       c[i][1] ? (double)c[i][0]/c[i][1] : 0.0, c[i][3]+c[i][4] ? 100.0*c[i][3]/(c[i][3]+c[i][4]) : 0.0);
+        s += sprintf (s, ":pipe.%s=%lu,%lu,%lu,%lu,%lu", phases[i], c[i][0], c[i][1], c[i][2], c[i][3], c[i][4]);
+        w += c[i][0];  n += c[i][1];
+    }
+    uint64_t busy = report_pipe_ctx->feed_busy, idle = report_pipe_ctx->feed_idle;
+    report_printf ("   pipe: %-10s wait=%.2f%% (%lu waits, %.0f cyc/wait) feeder busy=%.2f%% (%.3f gcycs busy, %.3f gcycs idle)\n", "total", t ? 100.0*w/t : 0.0, n,
+                   n ? (double)w/n : 0.0, busy+idle ? 100.0*busy/(busy+idle) : 0.0, busy/1000000000.0, idle/1000000000.0);
+    sprintf (s, ":feedbusy=%lu:feedidle=%lu", busy, idle);
+}
+
+// writes a line PIPE:<time>:n=<jobs>:k=<k>:job=<job>:wait=<wait cycles>:waits=<waits>:cyc=<worker cycles> for each job (summed over phases)
+// and prints the least and most any job waited, so that load imbalance between jobs shows up (the STATS line only has totals)
+static inline void report_job_pipes (void)
+{
+    char buf[256], tbuf[64];
+    double f, fmin = 100.0, fmax = 0.0;
+    int jmin = 0, jmax = 0;
+
+    if ( ! report_pipe_ctx || ! report_pipe_ctx->num_readers ) return;
+    string_time(tbuf);
+    for ( int k = 0 ; k < jobs ; k++ ) {
+        uint64_t c[3] = {0,0,0};
+        for ( int i = 0 ; i <= PHASE_MAX ; i++ ) for ( int j = 0 ; j < 3 ; j++ ) c[j] += pipestats[k].cnts[i][j];
+        sprintf (buf, "PIPE:%s:n=%d:k=%d:job=%d:wait=%lu:waits=%lu:cyc=%lu", tbuf, jobs, report_k, k, c[0], c[1], c[2]);
+        output (buf);
+        f = c[2] ? 100.0*c[0]/c[2] : 0.0;
+        if ( f < fmin ) { fmin = f;  jmin = k; }
+        if ( f > fmax ) { fmax = f;  jmax = k; }
+    }
+    report_printf ("   pipe: jobs       wait=%.2f%% (job %d) to %.2f%% (job %d), see the PIPE lines in the output file\n", fmin, jmin, fmax, jmax);
+}
+
 static inline void report_end (void)
 {
     double total_time, max_time;
     uint64_t total_cycles, maxrss;
-    char buf[1024],tbuf[64],obuf[256],zbuf[64],zmbuf[64],pminbuf[64],pmaxbuf[64];
+    char buf[4096],tbuf[64],obuf[256],zbuf[64],zmbuf[64],pminbuf[64],pmaxbuf[64],perfbuf[1024],pipebuf[1024];
 
     if ( report_p0 > 1 ) { sprintf(pminbuf,"%ux%lu",report_p0,report_pmin); sprintf(pmaxbuf,"%ux%lu",report_p0,report_pmax); }
     else { sprintf(pminbuf,"%lu",report_pmin); sprintf(pmaxbuf,"%lu",report_pmax); }
@@ -452,6 +630,7 @@ static inline void report_end (void)
         total_cycles += x->cycles; total_time += x->secs; bytes += x->bytes; maxrss += x->maxrss;
         scnt += x->scnt;
         if ( x->secs > max_time ) max_time = x->secs;
+        zbmhits += zbmstats[2*i];  zbmmisses += zbmstats[2*i+1];
     }
     uint64_t c = total_cycles;
     report_printf ("   pcnt: %20lu (%.0f cyc/p)\n", pcnt, (double)c/pcnt);
@@ -463,29 +642,63 @@ static inline void report_end (void)
     report_printf ("  zlcnt: %20lu (%.1f zl/r) (%.1f zl/d)\n", zlcnt, (double)zlcnt/rcnt, (double)zlcnt/dcnt);
     report_printf ("  zmcnt: %20lu (1/%.1f mp/z)\n", zmcnt, (double)zcnt/zmcnt);
     report_printf ("zmzpcnt: %20lu (1/%.1f mpz/z)\n", zmpzcnt, (double)zcnt/zmpzcnt);
+    report_printf ("  zbmhit: %19lu (%.1f%% of %lu custom bitmaps)\n", zbmhits, zbmhits+zbmmisses ? 100.0*zbmhits/(zbmhits+zbmmisses) : 0.0, zbmhits+zbmmisses);
+    report_perfctrs (perfbuf);
+    report_pipes (pipebuf);
     max_time += precompute_time;
     report_printf ("Total job cputime: %.1f secs, %.1f gcycs, Precompute cputime: %.1fs, Total wall time: %.1fs\n", total_time, total_cycles/1000000000.0, precompute_time, get_time()-start_time);
-    sprintf (buf, "STATS:%s:n=%d:k=%d:pmin=%s:pmax=%s:dmax=%lu:zmax=%s:cyc=%lu:pcnt=%lu:ccnt=%lu:dcnt=%lu:rcnt=%lu:zcnt=%lu:zccnt=%lu:zlcnt=%lu:zchk1=%lu:zchk2=%lu:zchk0=%lu:zmcnt=%lu:zmpzcnt=%lu:zmsum=%s:sMB=%.1f:pMB=%.1f:rMB=%.1f:secs=%.1f:psec=%.1f:wsecs=%.1f:cyc/p=%.0f:cyc/r=%.0f:cyc/z=%.1f:scnt=%u:ver=%s%s",
+    sprintf (buf, "STATS:%s:n=%d:k=%d:pmin=%s:pmax=%s:dmax=%lu:zmax=%s:cyc=%lu:pcnt=%lu:ccnt=%lu:dcnt=%lu:rcnt=%lu:zcnt=%lu:zccnt=%lu:zlcnt=%lu:zchk1=%lu:zchk2=%lu:zchk0=%lu:zmcnt=%lu:zmpzcnt=%lu:zmsum=%s:sMB=%.1f:pMB=%.1f:rMB=%.1f:secs=%.1f:psec=%.1f:wsecs=%.1f:cyc/p=%.0f:cyc/r=%.0f:cyc/z=%.1f:zbmhit=%lu:zbmmiss=%lu%s%s:scnt=%u:ver=%s%s",
             string_time(tbuf),jobs,report_k,pminbuf,pmaxbuf,report_dmax,itoa128(zbuf,report_zmax),total_cycles,pcnt,ccnt,dcnt,rcnt,zcnt,zccnt,zlcnt,zchks[1],zchks[2],zchks[0],zmcnt,zmpzcnt,itoa128(zmbuf,zmsum),(double)shared_bytes()/(1<<20),(double)bytes/(1<<20),(double)maxrss/(1<<10),
-            total_time,precompute_time,max_time,(double)total_cycles/pcnt,(double)total_cycles/rcnt,(double)total_cycles/zcnt,scnt,VERSION_STRING,obuf);
+            total_time,precompute_time,max_time,(double)total_cycles/pcnt,(double)total_cycles/rcnt,(double)total_cycles/zcnt,zbmhits,zbmmisses,perfbuf,pipebuf,scnt,VERSION_STRING,obuf);
     output (buf);
-    // clean up checkpoint files
-    for ( int i = 0 ; i < jobs ; i++ ) for ( int j = 1 ; j < num_chkpts ; j++ ) delete_checkpoint (i,j);
+    report_job_pipes ();
+    // clean up checkpoint files (none of which are ours if checkpoints are off), unless we stopped early, in which case a rerun will resume
+    // from the last checkpoint every job wrote
+    if ( chkpt_keep && ! chkpt_off ) {
+        uint32_t c = num_chkpts;
+        for ( int i = 0 ; i < jobs ; i++ ) if ( jobstats[i].chkpt_id < c ) c = jobstats[i].chkpt_id;
+        if ( c > 1 ) report_printf ("Stopped early, a rerun will resume from checkpoint %u (p > %lu)\n", c-1, chkpt_pmax[c-1]);
+        else report_printf ("Stopped early before the first checkpoint, a rerun will start from the beginning\n");
+        return;
+    }
+    if ( ! chkpt_off ) for ( int i = 0 ; i < jobs ; i++ ) for ( int j = 1 ; j < num_chkpts ; j++ ) delete_checkpoint (i,j);
 }
 
-static inline void report_comparisons (uint64_t cpcnt, uint64_t cccnt, uint64_t cdcnt, uint64_t crcnt)
+// compares counts (and cycles per progression) with expected values (negative counts and a non-positive cyc/r mean no expectation, so an
+// expected count of zero is checked), writes a CSTATS line,
+// and returns the number of mismatches, where cyc/r counts as a mismatch only if it exceeds the expected value by more than CYCR_SLACK percent
+static inline int report_comparisons (int64_t cpcnt, int64_t cccnt, int64_t cdcnt, int64_t crcnt, int64_t cscnt, double ccycr)
 {
-    char buf[1024],tbuf[64],zbuf[64],pminbuf[64],pmaxbuf[64];
+    char buf[1024],tbuf[64],zbuf[64],pminbuf[64],pmaxbuf[64],fbuf[64];
+    uint64_t cycles = 0;
+    double cycr;
+    int n = 0;
+
+    for ( int i = 0 ; i < jobs ; i++ ) cycles += jobstats[i].cycles;
+    cycr = rcnt ? (double)cycles/rcnt : 0.0;
+    fbuf[0] = '\0';
+    if ( cpcnt >= 0 && (uint64_t)cpcnt != pcnt ) { n++; strcat(fbuf,",pcnt"); }
+    if ( cccnt >= 0 && (uint64_t)cccnt != ccnt ) { n++; strcat(fbuf,",ccnt"); }
+    if ( cdcnt >= 0 && (uint64_t)cdcnt != dcnt ) { n++; strcat(fbuf,",dcnt"); }
+    if ( crcnt >= 0 && (uint64_t)crcnt != rcnt ) { n++; strcat(fbuf,",rcnt"); }
+    if ( cscnt >= 0 && cscnt != scnt ) { n++; strcat(fbuf,",scnt"); }
+    if ( ccycr > 0.0 && cycr > ccycr*(100+CYCR_SLACK)/100 ) { n++; strcat(fbuf,",cyc/r"); }
+    if ( n ) report_printf ("Comparison FAILED for %s (expected pcnt=%ld ccnt=%ld dcnt=%ld rcnt=%ld scnt=%ld cyc/r=%.0f)\n", fbuf+1, cpcnt, cccnt, cdcnt, crcnt, cscnt, ccycr);
     if ( report_p0 > 1 ) { sprintf(pminbuf,"%ux%lu",report_p0,report_pmin); sprintf(pmaxbuf,"%ux%lu",report_p0,report_pmax); }
     else { sprintf(pminbuf,"%lu",report_pmin); sprintf(pmaxbuf,"%lu",report_pmax); }
     string_time(tbuf);
-    sprintf (buf, "CSTATS:%s:n=%d:k=%d:pmin=%s:pmax=%s:dmax=%lu:zmax=%s:pcnt=%lu:ccnt=%lu:dcnt=%lu:rcnt=%lu:cpcnt=%lu:cccnt=%lu:cdcnt=%lu:crcnt=%lu:ver=%s",
-             string_time(tbuf),jobs,report_k,pminbuf,pmaxbuf,report_dmax,itoa128(zbuf,report_zmax),pcnt,ccnt,dcnt,rcnt,cpcnt,cccnt,cdcnt,crcnt,VERSION_STRING);
+    sprintf (buf, "CSTATS:%s:n=%d:k=%d:pmin=%s:pmax=%s:dmax=%lu:zmax=%s:pcnt=%lu:ccnt=%lu:dcnt=%lu:rcnt=%lu:scnt=%u:cyc/r=%.0f:cpcnt=%ld:cccnt=%ld:cdcnt=%ld:crcnt=%ld:cscnt=%ld:ccyc/r=%.0f:%s%s:ver=%s",
+             string_time(tbuf),jobs,report_k,pminbuf,pmaxbuf,report_dmax,itoa128(zbuf,report_zmax),pcnt,ccnt,dcnt,rcnt,scnt,cycr,cpcnt,cccnt,cdcnt,crcnt,cscnt,ccycr,
+             n ? "FAILED=" : "OK", fbuf+(n?1:0), VERSION_STRING);
     output(buf);
+    return n;
 }
 
 static inline int report_p (uint64_t p)
 {
+    // once the pipe has been stopped (first=1) primes still sitting in a caller's batch will not be processed, so we must not count them
+    // or write a checkpoint that claims them (report_end keeps the checkpoints we have written so that the run can be resumed)
+    if ( report_pipe_ctx && report_pipe_ctx->stop ) return 0;
     softassert (p > pcur && p <= report_pmax);
     // Note that prime_pipe can skip over an entire checkpoint interval (other threads may have processed all the primes)
     // But we are guaranteed to see primes in increasing order.
@@ -495,6 +708,9 @@ static inline int report_p (uint64_t p)
     return 1;
 }
 
+// returns the largest p covered by the current checkpoint, callers that process primes out of order should not read past this before processing what they have
+static inline uint64_t report_chkpt_pmax (void) { return chkpt_pmax[chkpt_id]; }
+
 static inline int report_c (uint32_t n)
 {
     ccnt += n;
@@ -527,6 +743,7 @@ static inline int report_z (uint64_t d, uint64_t n, uint64_t l, uint32_t locatio
 
 static inline void report_zpass (uint128_t absz) { zmcnt++; zmsum += absz; }
 static inline void report_zcheck (uint128_t absz) { zmpzcnt++; }
+static inline void report_zbmcache (int hit) { if ( hit ) zbmhits++; else zbmmisses++; }
 
 #ifndef PROFILE
 
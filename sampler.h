@@ -0,0 +1,148 @@
+#ifndef _SAMPLER_INCLUDE_
+#define _SAMPLER_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Statistical profiler for full multi-core runs.  If SAMPLER is defined at compile time (this requires REPORT), each worker sets up a
+    SIGPROF timer that fires every SAMPLER_USECS microseconds of cpu time, and the signal handler counts a sample for the current code path,
+    which is the triple (phase, function, kernel).  The function is the innermost of enumd, enumcd, procd, procdcoprime, procdbigprime we
+    are in (or "other", e.g. when reading primes and computing cuberoots in process_primes), the kernel is the innermost of zrcheckone,
+    zrcheckafew, zrcheckmany, zrchecklift, zcheck_mpz ("gmp") we are in (or "none").  Tagging a path costs a couple of stores.
+
+    Unlike PROFILE, this does not change the number of cores or stop the run early, the counts are aggregated across workers at the end of
+    the run, summarized on stdout, and written to the output file in a SAMPLES line of the form
+
+        SAMPLES:<time>:n=<jobs>:k=<k>:usecs=<usecs>:total=<samples>:<phase>.<function>.<kernel>=<samples>:...
+
+    listing every path with a nonzero count.
+*/
+
+#if defined(SAMPLER) && ! defined(REPORT)
+#error SAMPLER requires REPORT
+#endif
+
+#define SAMPLER_USECS       4000    // sampling interval in microseconds of cpu time (cpu timers only fire on scheduler ticks, so there is no point going below 1/HZ)
+#define SAMPLER_TOP         20      // number of paths listed on stdout
+
+#define SF_OTHER            0
+#define SF_ENUMD            1
+#define SF_ENUMCD           2
+#define SF_PROCD            3
+#define SF_PROCDCOPRIME     4
+#define SF_PROCDBIGPRIME    5
+#define SFUNCS              6
+
+#define SK_NONE             0
+#define SK_ONE              1
+#define SK_AFEW             2
+#define SK_MANY             3
+#define SK_LIFT             4
+#define SK_GMP              5
+#define SKERNELS            6
+
+#ifndef SAMPLER
+// sets the current function (or kernel) tag and returns the previous one, which should be restored with sampler_func_end (or sampler_kernel_end)
+static inline int sampler_func (int f) { return 0; }
+static inline void sampler_func_end (int f) {}
+static inline int sampler_kernel (int k) { return 0; }
+static inline void sampler_kernel_end (int k) {}
+static inline void sampler_stats_start (int jobs) {}
+static inline void sampler_start (void) {}
+static inline void sampler_end (unsigned job) {}
+static inline void sampler_stats_output (int k) {}
+#else
+static char *sfnames[SFUNCS] = { "other", "enumd", "enumcd", "procd", "procdcoprime", "procdbigprime" };
+static char *sknames[SKERNELS] = { "none", "one", "afew", "many", "lift", "gmp" };
+
+static volatile sig_atomic_t sampler_f, sampler_k;  // current function and kernel tags
+
+typedef uint64_t samplerstats_t[PHASE_MAX+1][SFUNCS][SKERNELS];
+static samplerstats_t samplercnt;       // per-worker sample counts (only modified by the signal handler)
+static samplerstats_t *samplerstats;    // shared array with a copy of samplercnt for each job
+static int samplerjobs;
+
+static inline int sampler_func (int f) { int x = sampler_f; sampler_f = f; return x; }
+static inline void sampler_func_end (int f) { sampler_f = f; }
+static inline int sampler_kernel (int k) { int x = sampler_k; sampler_k = k; return x; }
+static inline void sampler_kernel_end (int k) { sampler_k = k; }
+
+static void sampler_handler (int sig)
+    { samplercnt[current_phase][sampler_f][sampler_k]++; }
+
+// called before we fork off jobs
+static void sampler_stats_start (int jobs)
+    { samplerjobs = jobs; samplerstats = shared_calloc (jobs*sizeof(*samplerstats)); }
+
+// called by each job after report_job_start (timers are not inherited across fork)
+static void sampler_start (void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+    int sts;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = sampler_handler;  sa.sa_flags = SA_RESTART;  sigemptyset (&sa.sa_mask);
+    sts = sigaction (SIGPROF, &sa, 0);  assert (!sts);
+    it.it_interval.tv_sec = it.it_value.tv_sec = 0;  it.it_interval.tv_usec = it.it_value.tv_usec = SAMPLER_USECS;
+    sts = setitimer (ITIMER_PROF, &it, 0);  assert (!sts);
+}
+
+// called by each job when it is done
+static void sampler_end (unsigned job)
+{
+    struct itimerval it;
+    int sts;
+
+    assert (job < samplerjobs);
+    memset (&it, 0, sizeof(it));
+    sts = setitimer (ITIMER_PROF, &it, 0);  assert (!sts);
+    signal (SIGPROF, SIG_IGN);
+    memcpy (samplerstats[job], samplercnt, sizeof(samplercnt));
+}
+
+// called after all jobs are done (and report_end has written the STATS line)
+static void sampler_stats_output (int k)
+{
+    char buf[16384], tbuf[256], *s;
+    uint64_t total, top[SAMPLER_TOP];
+    int i, j, m, n, p, f, x, topi[SAMPLER_TOP];
+
+    memset (samplercnt, 0, sizeof(samplercnt));
+    for ( i = 0 ; i < samplerjobs ; i++ ) for ( p = 0 ; p <= PHASE_MAX ; p++ ) for ( f = 0 ; f < SFUNCS ; f++ ) for ( x = 0 ; x < SKERNELS ; x++ )
+        samplercnt[p][f][x] += samplerstats[i][p][f][x];
+    uint64_t *c = &samplercnt[0][0][0];
+    for ( total = 0, i = 0 ; i < (PHASE_MAX+1)*SFUNCS*SKERNELS ; i++ ) total += c[i];
+
+    // list the SAMPLER_TOP most sampled paths
+    for ( m = n = 0, i = 0 ; i < (PHASE_MAX+1)*SFUNCS*SKERNELS ; i++ ) {
+        if ( ! c[i] ) continue;
+        m++;
+        for ( j = n ; j > 0 && top[j-1] < c[i] ; j-- ) if ( j < SAMPLER_TOP ) { top[j] = top[j-1]; topi[j] = topi[j-1]; }
+        if ( j < SAMPLER_TOP ) { top[j] = c[i]; topi[j] = i; if ( n < SAMPLER_TOP ) n++; }
+    }
+    report_printf ("Sampled %d code paths every %dus of cpu time, %lu samples (%.1f secs), top %d:\n", m, SAMPLER_USECS, total, total*SAMPLER_USECS/1000000.0, n);
+    for ( i = 0 ; i < n ; i++ ) {
+        p = topi[i]/(SFUNCS*SKERNELS);  f = (topi[i]/SKERNELS)%SFUNCS;  x = topi[i]%SKERNELS;
+        report_printf ("  %5.1f%%  %-14s %-14s %-5s %lu\n", 100.0*top[i]/total, phases[p], sfnames[f], sknames[x], top[i]);
+    }
+
+    s = buf + sprintf (buf, "SAMPLES:%s:n=%d:k=%d:usecs=%d:total=%lu", string_time(tbuf), samplerjobs, k, SAMPLER_USECS, total);
+    for ( p = 0 ; p <= PHASE_MAX ; p++ ) for ( f = 0 ; f < SFUNCS ; f++ ) for ( x = 0 ; x < SKERNELS ; x++ )
+        if ( samplercnt[p][f][x] ) s += sprintf (s, ":%s.%s.%s=%lu", phases[p], sfnames[f], sknames[x], samplercnt[p][f][x]);
+    output (buf);
+}
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+#   Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+#   See LICENSE file for license details.
+#
+#   Runs the same zcubes job with each of the given numbers of workers and reports the parallel efficiency of each run relative to the
+#   first one, along with the fraction of worker time spent waiting for primes (this requires a build with -DREPORT).  Each run is made
+#   in its own directory scaling_<n> (zcubes writes its output and checkpoint files to the current directory), e.g.
+#
+#       ./scaling.sh "1 2 4 8" 57 1 1e8 1e8 1e10
+#
+#   The times used are wall-clock seconds excluding the precomputation (which is not parallel).  Set ZCUBES to use a different binary.
+
+if [ $# -lt 6 ]; then echo "    scaling.sh \"n1 n2 ...\" k pmin pmax dmax zmax [options]"; exit 0; fi
+ns=$1; shift
+zcubes=${ZCUBES:-$(pwd)/zcubes}
+base=""
+
+echo "SCALING:k=$1:pmin=$2:pmax=$3:dmax=$4:zmax=$5"
+for n in $ns; do
+    rm -rf scaling_$n && mkdir scaling_$n || exit 1
+    (cd scaling_$n && "$zcubes" $n "$@" > log 2>&1) || { echo "ERROR: zcubes failed for n=$n, see scaling_$n/log"; exit 1; }
+    # secs from the END line, psec and the pipe counts from the STATS line
+    line=$(awk -F: '
+        /^END:/ { for ( i = 1 ; i <= NF ; i++ ) if ( $i ~ /^secs=/ ) secs = substr($i,6) }
+        /^STATS:/ { for ( i = 1 ; i <= NF ; i++ ) {
+            if ( $i ~ /^psec=/ ) psec = substr($i,6)
+            if ( $i ~ /^pipe\./ ) { split (substr($i,index($i,"=")+1), c, ","); wait += c[1]; cyc += c[3] }
+        } }
+        END { printf "%f %f", secs-psec, (cyc ? 100.0*wait/cyc : 0) }' scaling_$n/output)
+    t=${line% *}; w=${line#* }
+    if [ -z "$base" ]; then base=$(awk -v n=$n -v t=$t 'BEGIN { print n*t }'); fi
+    awk -v n=$n -v t=$t -v w=$w -v b=$base 'BEGIN { printf "SCALING:n=%d:secs=%.2f:speedup=%.2f:efficiency=%.1f%%:pipewait=%.2f%%\n", n, t, (t > 0 ? b/t : 0), (t > 0 ? 100.0*b/(n*t) : 0), w }'
+done
@@ -0,0 +1,97 @@
+#ifndef _TRACE_INCLUDE_
+#define _TRACE_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Capture of z-check workloads for replay.  If TRACE is defined at compile time (e.g. -DTRACE=1000) each worker records every TRACE-th
+    call that procd, procdcoprime and procdbigprime make to zrcheckone, zrcheckafew or zrchecklift (with -DTRACE alone every call is recorded)
+    in the binary file trace_<job>, which is closed when it reaches TRACE_MAXBYTES.  Each record holds all the inputs of the call, and the
+    file starts with a header giving the parameters the kernels depend on (k, dmax, zmax, smzmaskb), so replay.c can rebuild the precomputed
+    tables and feed the same calls back into the kernels.
+
+    A trace file consists of a struct trace_hdr, followed by records, each of which is a struct trace_rec followed by za[ca] (as uint64_t's)
+    and zb[cb] (as uint32_t's).  For zrchecklift records cb=0 (lifting does not use zb), and b and l are the modulus and progression length
+    that procd/procdcoprime computed before deciding to lift.  For zrcheckone records l=1.  Both structs are written in native byte order.
+*/
+
+#define TRACE_MAGIC         0x003145434152545aUL // "ZTRACE1" (little endian)
+#define TRACE_MAXBYTES      (1UL<<30)           // per worker
+
+#define TP_ONE              0
+#define TP_AFEW             1
+#define TP_LIFT             2
+#define TPATHS              3
+
+struct trace_hdr { uint64_t magic, dmax; uint128_t zmax; uint32_t k, every, smzmaskb, job; char ver[8]; };
+struct trace_rec { uint64_t d, a, binv, l; uint32_t ca, b, cb, ainvb; uint16_t ki; uint8_t si, path, pad[4]; };
+
+static inline char *trace_file (char *buf, uint32_t job)
+    { sprintf (buf, "trace_%u", job); return buf; }
+
+static inline char *trace_path_name (int path)
+    { static char *names[TPATHS] = { "zrcheckone", "zrcheckafew", "zrchecklift" };  return names[path]; }
+
+#ifndef TRACE
+static inline int tracing (void) { return 0; }
+static inline void trace_start (unsigned job, int k, uint64_t dmax, uint128_t zmax, uint32_t smzmaskb) {}
+static inline void trace_call (int path, uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za, uint32_t ca,
+                               uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint64_t l) {}
+static inline void trace_end (void) {}
+#else
+static inline int tracing (void) { return 1; }
+
+static FILE *trace_fp;
+static uint64_t trace_calls, trace_recs, trace_bytes;
+
+// called by each job after it is forked
+static void trace_start (unsigned job, int k, uint64_t dmax, uint128_t zmax, uint32_t smzmaskb)
+{
+    struct trace_hdr hdr;
+    char buf[64];
+
+    trace_fp = fopen (trace_file(buf,job), "wb");
+    if ( ! trace_fp ) { fprintf (stderr, "Error opening trace file %s!\n", buf); abort(); }
+    memset (&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;  hdr.dmax = dmax;  hdr.zmax = zmax;  hdr.k = k;  hdr.every = TRACE;  hdr.smzmaskb = smzmaskb;  hdr.job = job;
+    strcpy (hdr.ver, VERSION_STRING);
+    if ( fwrite (&hdr, sizeof(hdr), 1, trace_fp) != 1 ) { fprintf (stderr, "Error writing trace file %s!\n", buf); abort(); }
+    trace_calls = trace_recs = 0;  trace_bytes = sizeof(hdr);
+}
+
+static inline void trace_call (int path, uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za, uint32_t ca,
+                               uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint64_t l)
+{
+    struct trace_rec rec;
+    size_t n;
+
+    if ( (trace_calls++ % TRACE) || ! trace_fp ) return;
+    n = sizeof(rec) + ca*sizeof(*za) + cb*sizeof(*zb);
+    if ( trace_bytes + n > TRACE_MAXBYTES ) { fclose (trace_fp);  trace_fp = 0;  return; }
+    memset (&rec, 0, sizeof(rec));
+    rec.d = d;  rec.a = a;  rec.binv = binv;  rec.l = l;  rec.ca = ca;  rec.b = b;  rec.cb = cb;  rec.ainvb = ainvb;
+    rec.ki = ki;  rec.si = si;  rec.path = path;
+    if ( fwrite (&rec, sizeof(rec), 1, trace_fp) != 1 || fwrite (za, sizeof(*za), ca, trace_fp) != ca || (cb && fwrite (zb, sizeof(*zb), cb, trace_fp) != cb) )
+        { fprintf (stderr, "Error writing trace file!\n"); abort(); }
+    trace_recs++;  trace_bytes += n;
+}
+
+// called by each job when it is done
+static void trace_end (void)
+{
+    if ( trace_fp ) { fclose (trace_fp);  trace_fp = 0; }
+    report_printf ("Traced %lu of %lu z-check calls (%.1f MB)\n", trace_recs, trace_calls, (double)trace_bytes/(1<<20));
+}
+#endif
+
+#endif
@@ -1,6 +1,9 @@
 #include "b32.h"
 #include "m64.h"
 #include "cstd.h"
+#include "budget.h"
+#include "zfilter.h"
+#include "sampler.h"
 
 /*
     Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
@@ -33,16 +36,21 @@
 #define ZSHORT      48      // we only call zrchecklift/many (which increases the number of progressions and shortens them) for progressions longer than this
                             // (after lifting mod the largest of km1,km2,km3,km4 we can use, this is done before ZSHORT is tested)
 #define ZFEW        512     // we only call zrchecklift/many when we have least this many z's to check
-#define ZBUFBITS    24      // we allocate 2 zabufs and 2 zbbufs to hold 1<<ZRBUFBITS entries each, permitting up to 1<<(2*ZRMAXBITS) z-progressions for a given d
-                            // memory utilization is 24*(1<<ZRBUFBITS) bytes (per core)
-                            // lowering ZRBUFBITS will reduce the extent to which we can split progressions (the code will work just more slowly)
+#define ZBUFBITS    24      // we allocate 2 zabufs and 2 zbbufs to hold 1<<budget.zbufbits entries each, permitting up to 1<<(2*budget.zbufbits) z-progressions for a given d
+                            // memory utilization is 24*(1<<budget.zbufbits) bytes (per core), ZBUFBITS is an upper bound, budget.zbufbits is set from the per-worker budget
+                            // lowering zbufbits will reduce the extent to which we can split progressions (the code will work just more slowly)
 #define BMBITS      21      // allow bitmap with 128*128*128 entries
 
 // Thread local buffers
-static uint64_t *zabuf[2];  // each zabuf points to a thread-private buffer with (1<<ZRBUFBITS) entries
+static uint64_t *zabuf[2];  // each zabuf points to a thread-private buffer with (1<<budget.zbufbits) entries
 static uint32_t *zbbuf[2];  // ditto
 static uint64_t *bm0buf;    // thread-private buffer of size (1<<BMBITS)/8 bytes used for computing custom bitmaps
 static uint64_t *bm1buf;    // digtto
+#define ZBMC2BITS   14      // slots in the pair pool of the bitmap cache hold 1<<ZBMC2BITS bits (enough for m = p*q with p,q < 128)
+static struct zbmctag { uint32_t m, dm; uint8_t si; } *zbmctags[2];    // thread-private tags for the bitmap cache pools (pairs, triples), m=0 for empty slots
+static uint64_t *zbmcbuf[2];    // thread-private bitmap cache pools, zbmcslots[0] slots of 1<<ZBMC2BITS bits and zbmcslots[1] slots of 1<<BMBITS bits
+static uint32_t zbmcslots[2];   // number of slots in each pool, set from budget.zbmcbytes
+static uint32_t zslice, zslices = 1;    // in deep search mode (zcubes option ds=) we only check slice zslice of zslices of the progressions zrchecklift produces
 
 // Everything from hear down is precomputed and then shared
 #define PI64        16
@@ -140,19 +148,22 @@ static uint64_t mod64zmask[2][64];
 static uint16_t onezmod7mask;       // the 7*(s+1)/2 + (d mod 7)th bit of l7mask is set if there is only 1 admissible z mod 7 for d and s
 static inline int onezmod7 (uint64_t d, unsigned si) { softassert(si<2); return onezmod7mask & (1<<(7*si+mod7(d))); }
 
-#define SMZMASKB    3072    // all products of p128 < SMZMASKB are precomputed, should be at least 1536
+#define SMZMASKB    3072    // upper bound on smzmaskb, all products of p128 < smzmaskb are precomputed
+#define SMZMASKBMIN 1536    // lower bound on smzmaskb (sm2 and sm3 below must be less than this)
+#define SMZMASKBSTEP 256    // we choose smzmaskb as the largest multiple of this in [SMZMASKBMIN,SMZMASKB] whose zmasks fit in budget.smzbytes
 
 // precomputed zmasks for products of small primes used for z-testing
+static uint32_t smzmaskb;                       // all products of p128 < smzmaskb are precomputed (chosen at runtime, see precompute_zchecks)
 static uint64_t sminv[SMZMASKB];
 static uint64_t *smzmasks[2][2*SMZMASKB];
-static uint32_t sm0,sm1,sm2,sm3;                // precomputed products of p64 primes < SMZMASKBB
+static uint32_t sm0,sm1,sm2,sm3;                // precomputed products of p64 primes
 static uint64_t sm0inv,sm1inv,sm2inv,sm3inv;
 static uint64_t *sm0zs[2], *sm1zs[2], *sm2zs[2], *sm3zs[2];
 
 static inline uint64_t *zsmodm (uint32_t d, unsigned si, uint32_t m)
-    { softassert (si < 2 && m && m < SMZMASKB && smzmasks[si][m] && d < m);  return smzmasks[si][m] + d*((m>>6)+1); }
+    { softassert (si < 2 && m && m < smzmaskb && smzmasks[si][m] && d < m);  return smzmasks[si][m] + d*((m>>6)+1); }
 static inline uint64_t *zsmodmred (uint64_t d, unsigned si, uint32_t m)
-    { softassert (si < 2 && m < SMZMASKB && sminv[m]); return zsmodm (b32_red(d,m,sminv[m]),si,m); }
+    { softassert (si < 2 && m < smzmaskb && sminv[m]); return zsmodm (b32_red(d,m,sminv[m]),si,m); }
 static inline uint64_t *zsmodm0 (uint32_t d, unsigned si) { softassert(si<2 && d<sm0); return sm0zs[si] + d*((sm0>>6)+1); }
 static inline uint64_t *zsmodm0red (uint64_t d, unsigned si) { softassert(si<2); return sm0zs[si] + b32_red(d,sm0,sm0inv)*((sm0>>6)+1); }
 static inline uint64_t *zsmodm1 (uint32_t d, unsigned si) { softassert(si<2 && d<sm1); return sm1zs[si] + d*((sm1>>6)+1); }
@@ -162,6 +173,29 @@ static inline uint64_t *zsmodm2red (uint64_t d, unsigned si) { softassert(si<2);
 static inline uint64_t *zsmodm3 (uint32_t d, unsigned si) { softassert(si<2 && d<sm3); return sm3zs[si] + d*((sm3>>6)+1); }
 static inline uint64_t *zsmodm3red (uint64_t d, unsigned si) { softassert(si<2); return sm3zs[si] + b32_red(d,sm3,sm3inv)*((sm3>>6)+1); }
 
+// prefetch the fixed bitmap rows zrcheckone and zrcheckafew will use for d and si (used to overlap cache misses for one d with work on another)
+static inline void zsprefetch (uint64_t d, unsigned si)
+{
+    __builtin_prefetch (&mod64zmask[si][d&0x3f]);
+    bm_prefetch (zsmodm0red(d,si),sm0);  bm_prefetch (zsmodm1red(d,si),sm1);
+    bm_prefetch (zsmodm2red(d,si),sm2);  bm_prefetch (zsmodm3red(d,si),sm3);
+}
+
+// returns the number of 64-bit words needed to store zmasks (for one sign) modulo products of 2 or 3 p128 primes that are less than b,
+// plus those needed for sm0 and sm1 if they are not less than b
+static uint64_t smzmask_words (uint32_t b)
+{
+    uint64_t sm = 0;
+    uint32_t i, j, n, m;
+
+    for ( i = 0 ; i < p128cnt ; i++ ) for ( j = i+1 ; j < p128cnt && (m=p128[i]*p128[j]) < b ; j++ ) {
+        sm += m*((m>>6)+1);
+        for ( n = j+1 ; n < p128cnt && (m=p128[i]*p128[j]*p128[n]) < b ; n++ ) sm += m*((m>>6)+1);
+    }
+    if ( (m = p64[0]*p64[3]*p64[5]) >= b ) sm += m*((m>>6)+1);
+    if ( (m = p64[1]*p64[2]*p64[4]) >= b ) sm += m*((m>>6)+1);
+    return sm;
+}
 
 static void precompute_zmasks (uint32_t k)
 {
@@ -212,30 +246,32 @@ static void precompute_zmasks (uint32_t k)
         assert (ui64_wt(onezmod7mask)==6);
     } 
 
-    // precompute zmasks for all composite squarefree m <= SMZMASKB that are products of primes p in (5,128) not dividing k (uses a few hundred MB)
+    // precompute zmasks for all composite squarefree m < smzmaskb that are products of primes p in (5,128) not dividing k (uses a few hundred MB)
+    // we choose smzmaskb so that these fit in our memory budget
+    for ( smzmaskb = SMZMASKB ; smzmaskb > SMZMASKBMIN && 2*smzmask_words(smzmaskb)*sizeof(uint64_t) > budget.smzbytes ; smzmaskb -= SMZMASKBSTEP );
     sm = z = zbig = 0;
-    for ( i = 0 ; i < p128cnt ; i++ ) for ( j = i+1 ; j < p128cnt && (m=p128[i]*p128[j]) < SMZMASKB ; j++ ) { z++; sminv[m] = b32_inv(m); sm += m*((m>>6)+1); }
-    for ( i = 0 ; i < p128cnt ; i++ ) for ( j = i+1 ; j < p128cnt && p128[i]*p128[j] < SMZMASKB ; j++ )
-        for ( n = j+1 ; n < p128cnt && (m=p128[i]*p128[j]*p128[n]) < SMZMASKB ; n++ ) { z++; sminv[m] = b32_inv(m); sm += m*((m>>6)+1); }
+    for ( i = 0 ; i < p128cnt ; i++ ) for ( j = i+1 ; j < p128cnt && (m=p128[i]*p128[j]) < smzmaskb ; j++ ) { z++; sminv[m] = b32_inv(m); sm += m*((m>>6)+1); }
+    for ( i = 0 ; i < p128cnt ; i++ ) for ( j = i+1 ; j < p128cnt && p128[i]*p128[j] < smzmaskb ; j++ )
+        for ( n = j+1 ; n < p128cnt && (m=p128[i]*p128[j]*p128[n]) < smzmaskb ; n++ ) { z++; sminv[m] = b32_inv(m); sm += m*((m>>6)+1); }
 
     // fixed moduli that are products of small primes to be used for fast ztesting where we don't want to optimized for d (as in zrcheckone)
-    // sm2 and sm3 should be < SMZMASKB, so along with everything else, but we will need to handle sm0 and sm1 separately
+    // sm2 and sm3 should be < smzmaskb, so along with everything else, but we will need to handle sm0 and sm1 separately
     sm0 = p64[0]*p64[3]*p64[5]; sm0inv = b32_inv(sm0);
     sm1 = p64[1]*p64[2]*p64[4]; sm1inv = b32_inv(sm1);
-    sm2 = p64[6]*p64[9]; sm2inv = b32_inv(sm2); assert(sm2 < SMZMASKB); // sm2 < 1333 for all admissible k < 1000
-    sm3 = p64[7]*p64[8]; sm3inv = b32_inv(sm3); assert(sm3 < SMZMASKB); // sm3 < 1517 for all admissible k < 1000
-    if ( sm0 >= SMZMASKB ) { sm += sm0*((sm0>>6)+1); z++; zbig++; }
-    if ( sm1 >= SMZMASKB ) { sm += sm1*((sm1>>6)+1); z++; zbig++; }
+    sm2 = p64[6]*p64[9]; sm2inv = b32_inv(sm2); assert(sm2 < smzmaskb); // sm2 < 1333 for all admissible k < 1000
+    sm3 = p64[7]*p64[8]; sm3inv = b32_inv(sm3); assert(sm3 < smzmaskb); // sm3 < 1517 for all admissible k < 1000
+    if ( sm0 >= smzmaskb ) { sm += sm0*((sm0>>6)+1); z++; zbig++; }
+    if ( sm1 >= smzmaskb ) { sm += sm1*((sm1>>6)+1); z++; zbig++; }
 
     mm = mp = shared_malloc(bytes=2*sm*sizeof(*mm));  mem += bytes;
-    if ( sm0 >= SMZMASKB ) {
+    if ( sm0 >= smzmaskb ) {
         i = 0; j = 3; n = 5;
         p = p64[i]; q = p64[j]; r = p64[n];
         pinvq = p128itab[j][p64[i]]; qinv = p64inv[j]; rinv = p64inv[n]; pqinvr = p64itab[n][b32_red(p*q,r,rinv)];
         for ( si = 0 ; si < 2 ; si++ ) for ( sm0zs[si] = mp, d = 0 ; d < sm0 ; d++, mp += (sm0>>6)+1 )
             { b32_crt3map64 (mp, zsmodp64red(d,si,i), p, zsmodp64red(d,si,j), q, zsmodp64red(d,si,n), r, pinvq, qinv, pqinvr, rinv); softassert (zsmodm0(d,si)==mp); }
     }
-    if ( sm1 >= SMZMASKB ) {
+    if ( sm1 >= smzmaskb ) {
         i = 1; j = 2; n = 4;
         p = p64[i]; q = p64[j]; r = p64[n];
         pinvq = p128itab[j][p64[i]]; qinv = p64inv[j]; rinv = p64inv[n]; pqinvr = p64itab[n][b32_red(p*q,r,rinv)];
@@ -244,14 +280,14 @@ static void precompute_zmasks (uint32_t k)
     }
     for ( si = 0 ; si < 2 ; si++ )
         for ( i = 0 ; i < p128cnt ; i++ )
-            for ( j = i+1 ; j < p128cnt && (m=(p=p128[i])*(q=p128[j])) < SMZMASKB ; j++ )
+            for ( j = i+1 ; j < p128cnt && (m=(p=p128[i])*(q=p128[j])) < smzmaskb ; j++ )
                 for ( pinvq = p128itab[j][p], qinv = p128inv[j], smzmasks[si][m] = mp, d = 0 ; d < m ; d++, mp += (m>>6)+1 )
                     { b32_crtmap128 (mp, zsmodp128red(d,si,i), p, zsmodp128red(d,si,j), q, pinvq, qinv); softassert (zsmodm(d,si,m)==mp); }
     // the loop below takes a while, it might be worth optimizing (e.g. by CRTing against pq bitmaps already computed)
     for ( si = 0 ; si < 2 ; si++ )
         for ( i = 0 ; i < p128cnt ; i++ )
-            for ( j = i+1 ; j < p128cnt && (p=p128[i])*(q=p128[j]) < SMZMASKB ; j++ )
-                for ( pinvq = p128itab[j][p], qinv = p128inv[j], n = j+1 ; n < p128cnt && (m=p*q*(r=p128[n])) < SMZMASKB ; n++ )
+            for ( j = i+1 ; j < p128cnt && (p=p128[i])*(q=p128[j]) < smzmaskb ; j++ )
+                for ( pinvq = p128itab[j][p], qinv = p128inv[j], n = j+1 ; n < p128cnt && (m=p*q*(r=p128[n])) < smzmaskb ; n++ )
                     for ( smzmasks[si][m] = mp, rinv = p128inv[n], pqinvr = p128itab[n][b32_red(p*q,r,rinv)], d = 0 ; d < m ; d++, mp += (m>>6)+1 )
                         { b32_crt3map128 (mp, zsmodp128red(d,si,i), p, zsmodp128red(d,si,j), q, zsmodp128red(d,si,n), r, pinvq, qinv, pqinvr, rinv);  softassert (zsmodm(d,si,m)==mp); }
     assert (mp-mm == 2*sm);
@@ -266,7 +302,7 @@ uint64_t *zm;
 printf ("Verifying pq zmasks..."); fflush(stdout);
     for ( si = 0 ; si < 2 ; si++ )
         for ( i = 0 ; i < p128cnt ; i++ )
-            for ( pinv = p128inv[i], j = i+1 ; j < p128cnt && (m=(p=p128[i])*(q=p128[j])) < SMZMASKB ; j++ )
+            for ( pinv = p128inv[i], j = i+1 ; j < p128cnt && (m=(p=p128[i])*(q=p128[j])) < smzmaskb ; j++ )
                 for ( qinv = p128inv[j], d = 0 ; d < m ; d++ )
                     for ( pm = zsmodp128red(d,si,i), qm = zsmodp128red(d,si,j), zm = zsmodm(d,si,m), z = 0 ; z < m ; z++ )
                         assert ( ((((uint128_t)1<<b32_red(z,p,pinv))&pm) && (((uint128_t)1<<b32_red(z,q,qinv))&qm) ? 1 : 0) == bm_test(zm,z));
@@ -274,8 +310,8 @@ printf ("verified\n");
 printf ("Verifying pqr zmasks..."); fflush(stdout);
     for ( si = 0 ; si < 2 ; si++ )
         for ( i = 0 ; i < p128cnt ; i++ )
-            for ( pinv = p128inv[i], j = i+1 ; j < p128cnt && (p=p128[i])*(q=p128[j]) < SMZMASKB ; j++ )
-                for ( qinv = p128inv[j], n = j+1 ; n < p128cnt && (m=p*q*(r=p128[n])) < SMZMASKB ; n++ )
+            for ( pinv = p128inv[i], j = i+1 ; j < p128cnt && (p=p128[i])*(q=p128[j]) < smzmaskb ; j++ )
+                for ( qinv = p128inv[j], n = j+1 ; n < p128cnt && (m=p*q*(r=p128[n])) < smzmaskb ; n++ )
                     for ( rinv = p128inv[n], d = 0 ; d < m ; d++ )
                         for ( pm = zsmodp128red(d,si,i), qm = zsmodp128red(d,si,j), rm = zsmodp128red(d,si,n), zm = zsmodm(d,si,m), z = 0 ; z < m ; z++ )
                             assert ( ((((uint128_t)1<<b32_red(z,p,pinv))&pm) && (((uint128_t)1<<b32_red(z,q,qinv))&qm) && (((uint128_t)1<<b32_red(z,r,rinv))&rm) ? 1 : 0) == bm_test(zm,z));
@@ -321,10 +357,11 @@ printf ("verified\n");
     assert (rp-spbbuf <= sizeof(spbbuf));
 
     report_printf ("Precomputed %u zmasks for %u p in (5,128) prime to k, %u smooth squarefree m < %d and %u larger smooth m in %.1fs using %.1f MB\n",
-                    p128cnt+z, p128cnt, z-zbig, SMZMASKB, zbig, report_timer_elapsed(), (double)mem/(1<<20));
+                    p128cnt+z, p128cnt, z-zbig, smzmaskb, zbig, report_timer_elapsed(), (double)mem/(1<<20));
 }
 
 static mpz_t X,Y,Z;
+static volatile uint32_t *zcheck_found;     // if set we set *zcheck_found when we find a solution (zcubes option first=1)
 
 void precompute_zchecks (int k)
 {
@@ -358,6 +395,7 @@ static inline int zcheck_mpz (uint64_t d, unsigned si, uint128_t absz)
 {
     report_zcheck (absz);
     softassert ((si==0 || si==1));
+    int sk = sampler_kernel (SK_GMP);
 
     mpz_set_ui128(X,absz); mpz_mul_ui(X,X,absz);  mpz_mul_ui(X,X,absz);     // X = |z|^3
     mpz_set_si(Y,(si?-1:1)*(int)K); mpz_add(X,X,Y); mpz_mul_2exp(X,X,2);    // X = 4*(|z|^3-sgn(z)*k)
@@ -371,8 +409,11 @@ static inline int zcheck_mpz (uint64_t d, unsigned si, uint128_t absz)
         mpz_set_ui128(Z,absz); if ( !si ) mpz_neg(Z,Z);
         output_solution (K,d,X,Y,Z);
         report_s (d,absz);
+        if ( zcheck_found ) *zcheck_found = 1;
+        sampler_kernel_end (sk);
         return 1;
     }
+    sampler_kernel_end (sk);
     return 0;
 }
 
@@ -396,6 +437,23 @@ static inline uint64_t *p128crt3zmaps (uint64_t *bm,  uint64_t d, unsigned si, u
     return b32_crt3map128 (bm, zsmodp128red(d,si,i), p, zsmodp128red(d,si,j), q, zsmodp128red(d,si,k), r, p128itab[j][p], p128inv[j], p128itab[k][b32_red(p*q,r,rinv)], rinv);
 }
 
+// Per-worker cache of custom bitmaps for zrcheckmany, keyed by (m, d mod m, si), where m is the product of the 2 or 3 primes p < 128 (which
+// determines them).  There are two direct-mapped pools, one for pairs (m < 2^ZBMC2BITS) and one for triples (m < 2^BMBITS).
+static inline uint64_t *zbmcache (uint64_t *buf, uint64_t *avoid, uint64_t d, unsigned si, uint32_t m, uint64_t minv, uint32_t p, uint32_t q, uint32_t r)
+{
+    int k = r ? 1 : 0;
+    if ( ! zbmcslots[k] ) return r ? p128crt3zmaps (buf,d,si,p,q,r) : p128crtzmaps (buf,d,si,p,q);
+    uint32_t dm = b32_red(d,m,minv);
+    uint64_t h = ((m*0x9E3779B97F4A7C15UL) ^ (2*(uint64_t)dm+si)) % zbmcslots[k];
+    struct zbmctag *t = &zbmctags[k][h];
+    uint64_t *bm = zbmcbuf[k] + (h << (k ? BMBITS-6 : ZBMC2BITS-6));
+    if ( bm == avoid ) return r ? p128crt3zmaps (buf,d,si,p,q,r) : p128crtzmaps (buf,d,si,p,q);   // don't overwrite the other bitmap in use
+    if ( t->m == m && t->dm == dm && t->si == si ) { report_zbmcache (1); return bm; }
+    report_zbmcache (0);
+    t->m = m; t->dm = dm; t->si = si;
+    return r ? p128crt3zmaps (bm,d,si,p,q,r) : p128crtzmaps (bm,d,si,p,q);
+}
+
 // get m best primes p < 128 by benefit for d and si
 static inline int best_pi (uint8_t pis[], uint64_t d, unsigned si, unsigned m)
 {
@@ -461,8 +519,8 @@ static inline int sanity_check_solutions_64 (uint64_t d, uint64_t z[], unsigned
 static inline int sanity_check_solutions_32 (uint64_t d, uint32_t z[], unsigned n, uint32_t m)
     { for ( unsigned i = 0 ; i < n ; i++ ) { if ( ! sanity_check_solution (d, z[i], m) ) return 0; } return 1; }
 
-// used to check z's in progressions defined by (za[i] mod a, zb[j] mod b) when the modulus a*b exceeds zmax
-static inline void zrcheckone (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv)
+// used to check z's in progressions defined by (za[i] mod a, zb[j] mod b) when the modulus a*b exceeds zmax, applying the filter stages in order v (see zfilter.h)
+ZFILTER_INLINE void zrcheckone_ord (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, int v)
 {
     uint64_t zmask64;
     uint32_t i, j;
@@ -483,6 +541,7 @@ static inline void zrcheckone (uint64_t d, unsigned si, uint64_t a, uint64_t *za
     zmask64 = mod64zmask[si][d&0x3f];
     uint128_t zmin128 = ((uint128_t)17742641545548602771UL*d)>>62;
     uint32_t d0 = b32_red(d,sm0,sm0inv), a0 = b32_red(a,sm0,sm0inv);
+    const struct zfchain *zc = &zfdefault[ZK_ONE];  // the lengths of the chain and its groups (the order is given by zfilter_stage)
 
     for ( j = 0 ; j < cb ; j++ ) {
         softassert (zb[j] < b);
@@ -492,21 +551,33 @@ static inline void zrcheckone (uint64_t d, unsigned si, uint64_t a, uint64_t *za
             uint64_t aza = !si && za[i] ? a-za[i] : za[i];
             uint64_t c = zbuf[i]+ x; if ( c >= b ) c -= b;  // c = (azb-aza)/a mod b, so aza + c*a is the CRT lift of (|z| mod a,|z| mod b) in [0,ab)   
             uint128_t z = aza + (uint128_t)c*a;
-            if ( z < zmin128 || z > zmax128 ) continue;
-            if ( !(zmask64 & ((uint64_t)1 << (z&0x3f))) ) continue; // this catches about 1/8 when k is not 0 mod 4 and is very cheap
-            if ( !bm_test(zsmodm0(d0,si),b32_red(aza+c*a0,sm0,sm0inv)) ) continue;
-            if ( !bm_test(zsmodm1red(d,si),b32_red(aza+c*b32_red(a,sm1,sm1inv),sm1,sm1inv)) ) continue;
-            report_zpass (z);
-            if ( !bm_test(zsmodm2red(d,si),b32_red(aza+c*b32_red(a,sm2,sm2inv),sm2,sm2inv)) ) continue;
-            if ( !bm_test(zsmodm3red(d,si),b32_red(aza+c*b32_red(a,sm3,sm3inv),sm3,sm3inv)) ) continue;
-            zcheck_mpz(d,si,z);
+            unsigned s, st;
+            int t;
+            if ( ! zfilter_count (ZK_ONE, ZF_RANGE, z >= zmin128 && z <= zmax128) ) continue;
+            zfilter_start (ZK_ONE,si,v);
+            #pragma GCC unroll 8
+            for ( s = 1 ; s < zc->n ; s++ ) {                   // for v >= 0 the first group unrolls into a fixed sequence of tests
+                if ( s == zc->n1 ) report_zpass (z);
+                switch ( (st = zfilter_stage (ZK_ONE,si,v,s)) ) {
+                case ZF_MOD64: t = (zmask64 & ((uint64_t)1 << (z&0x3f))) != 0; break;  // this catches about 1/8 when k is not 0 mod 4 and is very cheap
+                case ZF_SM0: t = bm_test(zsmodm0(d0,si),b32_red(aza+c*a0,sm0,sm0inv)); break;
+                case ZF_SM1: t = bm_test(zsmodm1red(d,si),b32_red(aza+c*b32_red(a,sm1,sm1inv),sm1,sm1inv)); break;
+                case ZF_SM2: t = bm_test(zsmodm2red(d,si),b32_red(aza+c*b32_red(a,sm2,sm2inv),sm2,sm2inv)); break;
+                default: t = bm_test(zsmodm3red(d,si),b32_red(aza+c*b32_red(a,sm3,sm3inv),sm3,sm3inv)); break;
+                }
+                if ( ! zfilter_pass (ZK_ONE,si,v,st,t) ) break;
+            }
+            if ( s == zc->n ) { zfilter_count (ZK_ONE, ZF_MPZ, 1); zcheck_mpz(d,si,z); }
         }
     }
 }
 
+static inline void zrcheckone (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv)
+    { int sk = sampler_kernel (SK_ONE);  ZFILTER_DISPATCH (ZK_ONE, si, zrcheckone_ord (d, si, a, za, ca, b, zb, cb, ainvb, binv, zfv));  sampler_kernel_end (sk); }
+
 
 // used to check z's in progressions defined by (za[i] mod a, zb[j] mod b) when the modulus l*a*b > zmax with l smallish (depending on ZSHORT and ZFEW)
-static inline void zrcheckafew (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint32_t l)
+ZFILTER_INLINE void zrcheckafew_ord (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint32_t l, int v)
 {
     uint128_t ab;
     uint32_t m0, m1;
@@ -535,6 +606,7 @@ static inline void zrcheckafew (uint64_t d, unsigned si, uint64_t a, uint64_t *z
     uint32_t a0 = b32_red(a,m0,m0inv), ab0 = b32_red((uint64_t)a0*b,m0,m0inv), a1 = b32_red(a,m1,m1inv), ab1 = b32_red((uint64_t)a1*b,m1,m1inv);
 
     uint128_t zmin128 = ((uint128_t)17742641545548602771UL*d)>>62;
+    const struct zfchain *zc = &zfdefault[ZK_AFEW];  // the lengths of the chain and its groups (the order is given by zfilter_stage)
 
     for ( j = 0 ; j < cb ; j++ ) {
         softassert (zb[j] < b);
@@ -547,27 +619,40 @@ static inline void zrcheckafew (uint64_t d, unsigned si, uint64_t a, uint64_t *z
             // note that r (and c) need to be 64-bits (or need to be cast them to 64 bits when multiplying below)
             for ( uint64_t r = 0 ; r < l ; r++, z0 += ab0 ) {                   // our arithmetic progression is |z| = aza + c*a + r*ab
                 if ( z0 >= m0 ) z0 -= m0;
-                if ( !bm_test(bm0,z0) ) continue;
-                if ( !bm_test(bm1,b32_red(z1+r*ab1,m1,m1inv)) ) continue;
                 uint128_t z = aza + c*(uint128_t)a + r*ab;
-                if ( !(zmask64 & ((uint64_t)1 << (z&0x3f))) ) continue;
-                if ( z < zmin128 || z > zmax128 ) continue;
-                report_zpass (z);
-                // we could cache a2, ab2, bm2 to avoid recomputing them but this does not appear to be worth doing (typically we only get here once or twice)
-                uint32_t a2 = b32_red(a,sm2,sm2inv), ab2 = b32_red((uint64_t)a2*b,sm2,sm2inv);
-                if ( !bm_test(zsmodm2red(d,si),b32_red(aza+c*a2+r*ab2,sm2,sm2inv)) ) continue;
-                uint32_t a3 = b32_red(a,sm3,sm3inv), ab3 = b32_red((uint64_t)a3*b,sm3,sm3inv);
-                if ( !bm_test( zsmodm3red(d,si),b32_red(aza+c*a3+r*ab3,sm3,sm3inv)) ) continue;
-                zcheck_mpz(d,si,z);
+                uint32_t a2, ab2, a3, ab3;
+                unsigned s, st;
+                int t;
+                if ( ! zfilter_count (ZK_AFEW, ZF_SM0, bm_test(bm0,z0)) ) continue;
+                zfilter_start (ZK_AFEW,si,v);
+                #pragma GCC unroll 8
+                for ( s = 1 ; s < zc->n ; s++ ) {
+                    if ( s == zc->n1 ) report_zpass (z);
+                    switch ( (st = zfilter_stage (ZK_AFEW,si,v,s)) ) {
+                    case ZF_SM1: t = bm_test(bm1,b32_red(z1+r*ab1,m1,m1inv)); break;
+                    case ZF_MOD64: t = (zmask64 & ((uint64_t)1 << (z&0x3f))) != 0; break;
+                    case ZF_RANGE: t = z >= zmin128 && z <= zmax128; break;
+                    // we could cache a2, ab2, bm2 to avoid recomputing them but this does not appear to be worth doing (typically we only get here once or twice)
+                    case ZF_SM2: a2 = b32_red(a,sm2,sm2inv); ab2 = b32_red((uint64_t)a2*b,sm2,sm2inv);
+                                 t = bm_test(zsmodm2red(d,si),b32_red(aza+c*a2+r*ab2,sm2,sm2inv)); break;
+                    default:     a3 = b32_red(a,sm3,sm3inv); ab3 = b32_red((uint64_t)a3*b,sm3,sm3inv);
+                                 t = bm_test(zsmodm3red(d,si),b32_red(aza+c*a3+r*ab3,sm3,sm3inv)); break;
+                    }
+                    if ( ! zfilter_pass (ZK_AFEW,si,v,st,t) ) break;
+                }
+                if ( s == zc->n ) { zfilter_count (ZK_AFEW, ZF_MPZ, 1); zcheck_mpz(d,si,z); }
             }
         }
     }
 }
 
+static inline void zrcheckafew (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint32_t l)
+    { int sk = sampler_kernel (SK_AFEW);  ZFILTER_DISPATCH (ZK_AFEW, si, zrcheckafew_ord (d, si, a, za, ca, b, zb, cb, ainvb, binv, l, zfv));  sampler_kernel_end (sk); }
+
 
 // used to check z's in progressions defined by (za[i] mod a, zb[j] mod b) when the number of progressions and/or their length is large
 // pis[] contains a list of n indexes into p128 we should use for building zmasks (typically computed by zrchecklift)
-static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint8_t pis[10], unsigned n)
+ZFILTER_INLINE void zrcheckmany_ord (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint8_t pis[10], unsigned n, int v)
 {
     uint128_t ab,qm0,qm1,qm2,qm3;
     uint32_t m0, m1;
@@ -593,20 +678,20 @@ static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *z
     for ( i = 0 ; i < 6 ; i++ ) ps[i] = p128[pis[i]];
     if ( !(cnt>>20) && !(l>>20) && (cnt*l) < ps[3]*ps[4]*ps[5] ) {
         m0 = ps[0]*ps[1]*ps[2]; n = 3;
-        if ( m0 >= SMZMASKB ) { m0 = ps[0]*ps[1]; n = 2; }
-        if ( m0 < SMZMASKB ) { m0inv = sminv[m0];  bm0 = zsmodm(b32_red(d,m0,m0inv),si,m0); }
-        else { m0inv = b32_inv(m0); bm0 = p128crtzmaps (bm0buf,d,si,ps[0],ps[1]); }
+        if ( m0 >= smzmaskb ) { m0 = ps[0]*ps[1]; n = 2; }
+        if ( m0 < smzmaskb ) { m0inv = sminv[m0];  bm0 = zsmodm(b32_red(d,m0,m0inv),si,m0); }
+        else { m0inv = b32_inv(m0); bm0 = zbmcache (bm0buf,0,d,si,m0,m0inv,ps[0],ps[1],0); }
         m1 = ps[n]*ps[n+1];
-        if ( m1 < SMZMASKB ) { m1inv = sminv[m1];  bm1 = zsmodm(b32_red(d,m1,m1inv),si,m1); }
-        else { m1inv = b32_inv(m1);  bm1 = p128crtzmaps (bm1buf,d,si,ps[n],ps[n+1]); }
+        if ( m1 < smzmaskb ) { m1inv = sminv[m1];  bm1 = zsmodm(b32_red(d,m1,m1inv),si,m1); }
+        else { m1inv = b32_inv(m1);  bm1 = zbmcache (bm1buf,bm0,d,si,m1,m1inv,ps[n],ps[n+1],0); }
         n += 2;
     } else {
         m0 = ps[0]*ps[1]*ps[2];
-        if ( m0 < SMZMASKB ) { m0inv = sminv[m0];  bm0 = zsmodm(b32_red(d,m0,m0inv),si,m0); }
-        else { m0inv = b32_inv(m0);  bm0 = p128crt3zmaps (bm0buf,d,si,ps[0],ps[1],ps[2]); }
+        if ( m0 < smzmaskb ) { m0inv = sminv[m0];  bm0 = zsmodm(b32_red(d,m0,m0inv),si,m0); }
+        else { m0inv = b32_inv(m0);  bm0 = zbmcache (bm0buf,0,d,si,m0,m0inv,ps[0],ps[1],ps[2]); }
         m1 = ps[3]*ps[4]*ps[5];
-        if ( m1 < SMZMASKB ) { m1inv = sminv[m1];  bm1 = zsmodm(b32_red(d,m1,m1inv),si,m1); }
-        else { m1inv = b32_inv(m1);  bm1 = p128crt3zmaps (bm1buf,d,si,ps[3],ps[4],ps[5]); }
+        if ( m1 < smzmaskb ) { m1inv = sminv[m1];  bm1 = zsmodm(b32_red(d,m1,m1inv),si,m1); }
+        else { m1inv = b32_inv(m1);  bm1 = zbmcache (bm1buf,bm0,d,si,m1,m1inv,ps[3],ps[4],ps[5]); }
         n = 6;
     }
     i = pis[n++]; q0 = p128[i]; q0inv = p128inv[i]; qm0 = zsmodp128red(d,si,i);
@@ -630,6 +715,8 @@ static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *z
 
     uint128_t zmin128 = ((uint128_t)17742641545548602771UL*d)>>62;
 
+    const struct zfchain *zc = &zfdefault[ZK_MANY];  // the lengths of the chain and its groups (the order is given by zfilter_stage)
+
     profile_zrcheck_setup();
 
     for ( i = 0 ; i < ca ; i++ ) {
@@ -644,18 +731,27 @@ static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *z
             // note that r (and c) need to be 64-bits (or need to be cast to 64 bits when multiplying below)
             for ( uint64_t r = 0 ; r < l ; r++, z0 += ab0 ) {                   // our arithmetic progression is |z| = aza + c*a + r*ab
                 if ( z0 >= m0 ) z0 -= m0;
-                if ( !bm_test(bm0,z0) ) continue;
-                if ( !bm_test(bm1,b32_red(z1+r*ab1,m1,m1inv)) ) continue;
-                uint128_t z = aza + c*(uint128_t)a + r*ab;
-                if ( !(zmask64 & ((uint64_t)1 << (z&0x3f))) ) continue; // this catches about 1/8 when k is not 0 mod 4 and is really cheap so we do it first
-                if ( z < zmin128 || z > zmax128 ) continue;
-                report_zpass (z);
-                uint32_t zq = b32_red(aza+c*aq+r*abq,q,qinv);
-                if ( !(qm0 & ((uint128_t)1 << b32_red(zq,q0,q0inv))) ) continue;
-                if ( !(qm1 & ((uint128_t)1 << b32_red(zq,q1,q1inv))) ) continue;
-                if ( !(qm2 & ((uint128_t)1 << b32_red(zq,q2,q2inv))) ) continue;
-                if ( !(qm3 & ((uint128_t)1 << b32_red(zq,q3,q3inv))) ) continue;
-                zcheck_mpz(d,si,z);
+                uint128_t z = aza + c*(uint128_t)a + r*ab;     // only computed if one of the stages needs it (the compiler sinks it)
+                uint32_t zq = ~(uint32_t)0;                     // |z| mod q, computed by the first Q stage we run (q < 2^28, so ~0 means not yet)
+                unsigned s, st;
+                int t;
+                if ( ! zfilter_count (ZK_MANY, ZF_BM0, bm_test(bm0,z0)) ) continue;
+                zfilter_start (ZK_MANY,si,v);
+                #pragma GCC unroll 8
+                for ( s = 1 ; s < zc->n ; s++ ) {
+                    if ( s == zc->n1 ) report_zpass (z);
+                    switch ( (st = zfilter_stage (ZK_MANY,si,v,s)) ) {
+                    case ZF_BM1: t = bm_test(bm1,b32_red(z1+r*ab1,m1,m1inv)); break;
+                    case ZF_MOD64: t = (zmask64 & ((uint64_t)1 << (z&0x3f))) != 0; break;   // this catches about 1/8 when k is not 0 mod 4 and is really cheap
+                    case ZF_RANGE: t = z >= zmin128 && z <= zmax128; break;
+                    case ZF_Q0: if ( zq == ~(uint32_t)0 ) zq = b32_red(aza+c*aq+r*abq,q,qinv);  t = (qm0 & ((uint128_t)1 << b32_red(zq,q0,q0inv))) != 0; break;
+                    case ZF_Q1: if ( zq == ~(uint32_t)0 ) zq = b32_red(aza+c*aq+r*abq,q,qinv);  t = (qm1 & ((uint128_t)1 << b32_red(zq,q1,q1inv))) != 0; break;
+                    case ZF_Q2: if ( zq == ~(uint32_t)0 ) zq = b32_red(aza+c*aq+r*abq,q,qinv);  t = (qm2 & ((uint128_t)1 << b32_red(zq,q2,q2inv))) != 0; break;
+                    default:    if ( zq == ~(uint32_t)0 ) zq = b32_red(aza+c*aq+r*abq,q,qinv);  t = (qm3 & ((uint128_t)1 << b32_red(zq,q3,q3inv))) != 0; break;
+                    }
+                    if ( ! zfilter_pass (ZK_MANY,si,v,st,t) ) break;
+                }
+                if ( s == zc->n ) { zfilter_count (ZK_MANY, ZF_MPZ, 1); zcheck_mpz(d,si,z); }
             }
         }
     }
@@ -663,6 +759,25 @@ static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *z
     profile_zrcheck_end();
 }
 
+static inline void zrcheckmany (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint8_t pis[10], unsigned n)
+    { int sk = sampler_kernel (SK_MANY);  ZFILTER_DISPATCH (ZK_MANY, si, zrcheckmany_ord (d, si, a, za, ca, b, zb, cb, ainvb, binv, pis, n, zfv));  sampler_kernel_end (sk); }
+
+// checks our share of the progressions (za[i],zb[j]), the zslice-th of zslices contiguous ranges of the index i*cb+j in [0,ca*cb), which is
+// a partial row of i's (a single za[i] with a suffix of zb), some whole rows, and a partial row (with a prefix of zb), so that every job
+// gets the same number of progressions however ca and cb compare.  zrcheckmany and zrcheckafew use zbbuf[0] as workspace when zb is the
+// start of zbbuf[1], so we move zb there to keep it intact across the calls (the suffix is shifted in place and checked last)
+static inline void zrcheckslice (uint64_t d, unsigned si, uint64_t a, uint64_t *za, uint32_t ca, uint32_t b, uint32_t *zb, uint32_t cb, uint32_t ainvb, uint64_t binv, uint8_t pis[10], unsigned n)
+{
+    uint64_t lo = (uint64_t)ca*cb*zslice/zslices, hi = (uint64_t)ca*cb*(zslice+1)/zslices;
+    uint32_t i0 = lo/cb, j0 = lo%cb, i1 = hi/cb, j1 = hi%cb;
+
+    if ( lo == hi ) return;
+    if ( zb != zbbuf[1] ) { memcpy (zbbuf[1], zb, cb*sizeof(*zb));  zb = zbbuf[1]; }
+    if ( i0 == i1 ) { memmove (zb, zb+j0, (j1-j0)*sizeof(*zb));  zrcheckmany (d, si, a, za+i0, 1, b, zb, j1-j0, ainvb, binv, pis, n); return; }
+    if ( i1 > i0+(j0>0) ) zrcheckmany (d, si, a, za+i0+(j0>0), i1-i0-(j0>0), b, zb, cb, ainvb, binv, pis, n);
+    if ( j1 ) zrcheckmany (d, si, a, za+i1, 1, b, zb, j1, ainvb, binv, pis, n);
+    if ( j0 ) { memmove (zb, zb+j0, (cb-j0)*sizeof(*zb));  zrcheckmany (d, si, a, za+i0, 1, b, zb, cb-j0, ainvb, binv, pis, n); }
+}
 
 void zrchecklift (uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za, uint32_t ca)
 {
@@ -674,6 +789,7 @@ void zrchecklift (uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za
     uint32_t b, cb, *zb, ainvb;
     uint32_t m, mi, dm, pmask;
     unsigned i,j, npi,nqi,nmi;
+    int sk = sampler_kernel (SK_LIFT);
 
     profile_zrlift_start();
 
@@ -721,7 +837,7 @@ void zrchecklift (uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za
         for ( i = j = 0 ; q ; q >>= 1, i++ ) if ( (q&1) ) { softassert(i<p&&j<cp); zp[j++] = !si && i ? p-i : i; }
         // verbose_printf ("d=%lu, folding %s=%lu using p=%u with cp=%u, new ca=%u cb=%u (factor of %.3f, benefit %.3f bits/bit)\n", d, t<0?"a":"b",t<0?a:b,p,cp,ca,cb, (double)p/cp, 1.0-log((double)cp)/log(p));
         if ( t <= 0 ) {
-            if ( ((uint64_t)ca*cp) >> ZBUFBITS ) { verbose_printf ("Exceeded ZRBUFBITS: d=%lu, a=%lu, ca=%u, b=%u, cb=%u, p=%u, cp=%u\n",d,a,ca,b,cb,p,cp); break; }
+            if ( ((uint64_t)ca*cp) >> budget.zbufbits ) { verbose_printf ("Exceeded ZRBUFBITS: d=%lu, a=%lu, ca=%u, b=%u, cb=%u, p=%u, cp=%u\n",d,a,ca,b,cb,p,cp); break; }
             uint64_t *zbuf = ( za == zabuf[0] ? zabuf[1] : zabuf[0] ), *zz = zbuf;
             uint64_t ainvp = itab[b32_red(a,p,pinv)];
             for ( i = 0 ; i < ca ; i++ ) for ( j = 0 ; j < cp ; j++ ) *zz++ = b32_crt64 (za[i],a,zp[j],p,ainvp,pinv);
@@ -729,7 +845,7 @@ void zrchecklift (uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za
             uint64_t pinvb = b - (((uint64_t)b*itab[b32_red(b,p,pinv)]-1) / p); // solve 1 = p*(1/p mod b) + b*(1/b mod p) for 1/p mod b, here p is small
             ainvb = b32_red(ainvb*pinvb,b,binv);
         } else {
-            if ( ((uint64_t)cb*cp) >> ZBUFBITS ) { verbose_printf ("Exceeded ZRBUFBITS: d=%lu, a=%lu, ca=%u, b=%u, cb=%u, p=%u, cp=%u\n", d,a,ca,b,cb,p,cp); break; }
+            if ( ((uint64_t)cb*cp) >> budget.zbufbits ) { verbose_printf ("Exceeded ZRBUFBITS: d=%lu, a=%lu, ca=%u, b=%u, cb=%u, p=%u, cp=%u\n", d,a,ca,b,cb,p,cp); break; }
             uint32_t *zbuf = ( zb == zbbuf[0] ? zbbuf[1] : zbbuf[0] ), *zz = zbuf;
             uint32_t binvp = itab[b32_red(b,p,pinv)];
             for ( i = 0 ; i < cb ; i++ ) for ( j = 0 ; j < cp ; j++ ) *zz++ = b32_crt64 (zb[i],b,zp[j],p,binvp,pinv);
@@ -740,5 +856,6 @@ void zrchecklift (uint64_t d, unsigned si, unsigned ki, uint64_t a, uint64_t *za
     }
     profile_zrlift_end();
     
-    zrcheckmany (d, si, a, za, ca, b, zb, cb, ainvb, binv, qis, nqi);
+    if ( zslices > 1 ) zrcheckslice (d, si, a, za, ca, b, zb, cb, ainvb, binv, qis, nqi); else zrcheckmany (d, si, a, za, ca, b, zb, cb, ainvb, binv, qis, nqi);
+    sampler_kernel_end (sk);
 }
\ No newline at end of file
@@ -15,6 +15,7 @@
 #define CSTD_ONCE
 #include "cstd.h"                   // define SOFTASSERTS before this inlude if you want them on
 #include "report.h"                 // reporting and output functions
+#include "budget.h"                 // runtime sizing of caches and buffers from a memory budget and the detected cache sizes
 #include "kdata.h"                  // loads cubic-reciprocity constraints for k, precomputes admissible d|k
 #include "cbrts.h"                  // code for accessing precomputed cuberoots, inverses modulo small d, static cpmax, cdmin, sdmin, sdtab, ... declared here
 
@@ -32,7 +33,21 @@ static uint128_t zmax128;           // zmax128 <= ZMAX, zmin128 is a lower bound
 static long double zmaxld;          // long doubles only have 64 bits of integer precision (16 bit exponent), and we may truncate to double in certain situations
                                     // We add a fudge factor to handle this (zmaxld is zmax128*(1+2^-62) + 1
 #include "zcheck.h"                 // code for testing z's in arithmetic progressions and splitting long progressions
+#include "adapt.h"                  // choice between checking progressions directly and lifting them (adaptive if ADAPTIVE is defined)
+#include "trace.h"                  // capture of z-check calls for replay (only if TRACE is defined)
+#include "dpipe.h"                  // queues of d's from producers to consumers in pipeline mode (option consumers=m)
+#include "progs.h"                  // export and import of arithmetic progressions (options export=prefix and import=prefix)
+#include "ledger.h"                 // record of the regions searched by completed runs (option ledger=file)
 static uint64_t *rbuf;              // local to this module
+static dpipe_ctx_t *dpipe;          // d pipe (pipeline mode only)
+static int dpipe_job = -1;          // index of our ring in the d pipe if we are a producer in pipeline mode, -1 otherwise
+static progs_file_t *progs_out;     // file we write progressions to instead of checking them (export mode only)
+static uint32_t *wbuf;              // workspace for b32_crt64_negs in enumd/enumcd, local to this module
+#if PBUCKETS
+static struct pwrec { uint64_t key, p, z[3]; uint32_t n; } *pwbuf;  // window of primes and their cuberoots (sorted by key in process_prime_window)
+static int pwrec_cmp (const void *a, const void *b)
+    { return ((struct pwrec*)a)->key < ((struct pwrec*)b)->key ? -1 : ( ((struct pwrec*)a)->key > ((struct pwrec*)b)->key ? 1 : 0 ); }
+#endif
 
 /*
     This is the main module for zcubes, which has the following command line interfaces
@@ -44,6 +59,28 @@ static uint64_t *rbuf;              // local to this module
     If specified options is a number from 1 to 6 which will cause the program to only perform a subset of its functions (e.g. just enuemrate primes,
     just compute cuberoots mod primes, just enumerate arithmetic progressions, etc...), see report.h for a complete list of options.
 
+    The options mem=M and wmem=W set the total memory budget and the per-worker budget (in MB, or with a K/M/G/T suffix), which together with
+    the detected cache sizes determine the sizes of the caches and buffers used below (see budget.h).
+
+    The option export=prefix makes each job write the progressions it would have checked to the file prefix_<job> (see progs.h) instead
+    of checking them, and import=prefix checks the progressions in the files prefix_0, prefix_1, ... written by an export run with the same
+    k, pmin, pmax, dmax (but any zmax and any number of jobs) instead of enumerating them.  Checkpoints are not written in either mode.
+
+    The option primes=lo..hi,lo..hi,... restricts the search to the primes in the given (disjoint increasing) intervals within [pmin,pmax],
+    and ledger=file records the primes covered by each completed run in file, and skips the primes that file says have already been covered
+    for k with at least dmax and zmax (see ledger.h).
+
+    The option first=1 stops every job once a solution has been found, keeping checkpoint files so that the search can be resumed, and
+    deepen=f (which implies first=1) first searches |z| <= zmax/f^j for j = m, ..., j0 (with dmax reduced to match, j0 is the first j for which
+    this reduces dmax) in separate passes, each with its own checkpoint files (checkpoint_passj_*), so rerunning the same command resumes the pass that stopped.
+
+    The option ds=d1,d2,... selects deep search mode: instead of enumerating primes we search just the listed d's (pmin and pmax are ignored),
+    and rather than giving each d to one job every job lifts the progressions of each d with zrchecklift and checks its own slice of them,
+    so that a single d with a very large zmax/d is spread over all the jobs.  Checkpoints are not written in this mode.
+
+    The option consumers=m (0 < m <= n/2) selects pipeline mode: n-m workers (producers) read primes and enumerate d's, and hand each d with
+    its cuberoots to the other m workers (consumers), which check z's for them (see dpipe.h).  Checkpoints are not written in pipeline mode.
+
     The parent process creates a prime pipe to enuemrate all primes p in [pmin,pmax] and creates n child processes to read the pripe and a separate sibling
     to feed the pipe (this sibling is the only process that will call primesieve -- this is both more efficient and reduces the memory footprint).
     The parent thread simply waits for all its children to finish, but it watches for aborts (if any child aborts due to an assert failure the parent
@@ -75,8 +112,15 @@ static uint64_t *rbuf;              // local to this module
 
 
 #define MAXK                1000
-#define IBATCH              256
+#define IBATCH              256     // maximum number of inversions batched in enumd/enumcd (the value used is budget.ibatch)
+#define PBATCH              8       // number of primes we read ahead in the prime and bigprime phases so we can prefetch table entries for them
+#ifndef PBUCKETS
+#define PBUCKETS            0       // if nonzero, size of the window of primes bucketed by (si, p mod sm0) in the prime and bigprime phases (see process_prime_window)
+#endif
 #define CUBEROOT_BUFSIZE    88573   // 1+3+3^2+...+3^9+3^10, here 3^10 is max # cuberoots of k mod d for admissible k < 1000 and d < 2^63 coprime to k
+#define DEEPEN_DMIN         1000    // iterative deepening (option deepen=f) does not make passes with dmax below this
+#define EXIT_FOUND          3       // exit status of a deepening pass that found a solution
+#define FACTOR_TDMAX        1000    // factor64 trial divides by primes below this and uses Pollard rho for what is left
 
 // process d < 2^63 specified by (a,ki), where a is coprime to k and ki indexes an admissible factor of k (stored in kdtab)
 static inline void procd (unsigned ki, uint64_t a, uint64_t za[], uint32_t ca)
@@ -91,6 +135,7 @@ static inline void procd (unsigned ki, uint64_t a, uint64_t za[], uint32_t ca)
 
     d = a*kdtab[ki].d;
     if ( ! report_d (d, ca*kdtab[ki].n) ) return;
+    int sf = sampler_func (SF_PROCD);
 
     si = sgnz_index(d);
     mi = kdtab[ki].fi;  m = k27ftab[mi].m;
@@ -101,7 +146,9 @@ static inline void procd (unsigned ki, uint64_t a, uint64_t za[], uint32_t ca)
     // if we are reasonable close to zmax, just use z's mod a and b (no change in the number of arithmetic progressions but it may reduce their length)
     // the term 4-log2(ca) is meant to make us more willing to spend time lifting when we have more arithmetic progressions that can benefit
     n = fastceilboundl(zmaxld/((long double)a*b));
-    if ( n <= ZSHORT || (n*ca) <= ZFEW ) {
+    uint64_t t = adapt_start();
+    int direct = zdirect (n,ca);
+    if ( direct ) {
         uint32_t zb[K27MAXN];
         struct k27frec *x = k27ftab+mi;
         uint64_t minv = x->minv[0];  softassert(minv);
@@ -122,12 +169,16 @@ static inline void procd (unsigned ki, uint64_t a, uint64_t za[], uint32_t ca)
             ainvb = crt7 (ainvb, b2m, inv7(a));
             softassert (b32_red(ainvb*b32_red(a,b,binv),b,binv)==1);
         }
+        trace_call ((uint128_t)a*b > zmax128 ? TP_ONE : TP_AFEW, d, si, ki, a, za, ca, b, zb, cb, ainvb, binv, (uint128_t)a*b > zmax128 ? 1 : n);
         if ( (uint128_t)a*b > zmax128 ) zrcheckone (d, si, a, za, ca, b, zb, cb, ainvb, binv);
         else zrcheckafew (d, si, a, za, ca, b, zb, cb, ainvb, binv, n);
     } else {
         // Lift progressions using cubic reciprocity constraints and auxiliary primes, then check
+        trace_call (TP_LIFT, d, si, ki, a, za, ca, b, 0, 0, 0, 0, n);
         zrchecklift (d, si, ki, a, za, ca);
     }
+    adapt_end (n,ca,direct,t);
+    sampler_func_end (sf);
     profile_checkpoint ();  // if we are profiling and have collected enough information, this will end the run
 }
 
@@ -140,6 +191,7 @@ static inline void procdcoprime (uint64_t d, uint64_t z[], uint32_t c)
     softassert (verify_cuberoots_64(z,c,d));
 
     if ( ! report_d (d,c) ) return;
+    int sf = sampler_func (SF_PROCDCOPRIME);
 
     si = sgnz_index(d);
     mi = (km1&d&1) + 2*( onezmod7(d,si) ? 1 : 0 );
@@ -148,17 +200,23 @@ static inline void procdcoprime (uint64_t d, uint64_t z[], uint32_t c)
     // if we are reasonable close to zmax, just use z's mod a and b (no change in the number of arithmetic progressions but it may reduce their length)
     // the term 4-log2(ca) is meant to make us more willing to spend time lifting when we have more arithmetic progressions that can benefit
     uint64_t l = fastceilboundl(zmaxld/((long double)d*b));
-    if ( l <= ZSHORT || l*c <= ZFEW ) {
+    uint64_t t = adapt_start();
+    int direct = zdirect (l,c);
+    if ( direct ) {
         uint64_t binv = kminv[mi];
         uint32_t db = b32_red(d,b,binv);
         uint32_t *zb = kmztab[mi]+db;
         uint32_t dinvb = kmitab[mi][db];  softassert (b32_red(d*dinvb,b,binv)==1);
+        trace_call ((uint128_t)d*b > zmax128 ? TP_ONE : TP_AFEW, d, si, 0, d, z, c, b, zb, 1, dinvb, binv, (uint128_t)d*b > zmax128 ? 1 : l);
         if ( (uint128_t)d*b > zmax128 ) zrcheckone (d, si, d, z, c, b, zb, 1, dinvb, binv);
         else zrcheckafew (d, si, d, z, c, b, zb, 1, dinvb, binv, l);
     } else {
         // Lift progressions using cubic reciprocity constraints and auxiliary primes, then check
+        trace_call (TP_LIFT, d, si, 0, d, z, c, b, 0, 0, 0, 0, l);
         zrchecklift (d, si, 0, d, z, c);
     }
+    adapt_end (l,c,direct,t);
+    sampler_func_end (sf);
     profile_checkpoint ();  // if we are profiling and have collected enough information, this will end the run
 }
 
@@ -171,15 +229,26 @@ static inline void procdbigprime (uint64_t d, uint64_t z[], uint32_t c, uint32_t
     softassert (verify_cuberoots_64(z,c,d));
 
     if ( ! report_d (d, c) ) return;
+    int sf = sampler_func (SF_PROCDBIGPRIME);
 
     uint64_t binv = kminv[mi];
     uint32_t b = km[mi], db = b32_red(d,b,binv), dinvb = kmitab[mi][db], *zb = kmztab[mi]+db;
 
+    trace_call (l==1 ? TP_ONE : TP_AFEW, d, si, 0, d, z, c, b, zb, 1, dinvb, binv, l);
     if ( l==1 ) zrcheckone (d, si, d, z, c, b, zb, 1, dinvb, binv);
     else zrcheckafew (d, si, d, z, c, b, zb, 1, dinvb, binv, l);
+    sampler_func_end (sf);
     profile_checkpoint ();  // if we are profiling and have collected enough information, this will end the run
 }
 
+// prefetch the kmztab/kmitab entries and bitmap rows that procdcoprime/procdbigprime will access for prime d
+// this is done for a batch of primes before any of them are processed so that cache misses for one d overlap work on the others
+static inline void prefetchd (uint64_t d, unsigned si, unsigned mi)
+{
+    uint32_t db = b32_red(d,km[mi],kminv[mi]);
+    __builtin_prefetch (kmztab[mi]+db);  __builtin_prefetch (kmitab[mi]+db);
+    zsprefetch (d,si);
+}
 
 // process d and all multiples d*m with m an admissible divisor of k (which is automatically coprime to d)
 static inline void prockd (uint64_t d, uint64_t zd[], unsigned n)
@@ -188,6 +257,33 @@ static inline void prockd (uint64_t d, uint64_t zd[], unsigned n)
     for ( int i = 1 ; d <= kdmax[i] ; i++ ) procd (i,d,zd,n);
 }
 
+// true once some job has found a solution in first-solution mode (option first=1), at which point we stop processing d's
+static inline int first_found (void) { return zcheck_found && *zcheck_found; }
+
+// in export mode we write d and its cuberoots to the progression file, counting d and its multiples by admissible divisors of k as procd would
+static inline void exportkd (uint64_t d, uint64_t zd[], unsigned n, int big)
+{
+    progs_write (progs_out, d, zd, n, sgnz_index(d), big, report_current_phase());
+    report_d (d, n);
+    for ( int i = 1 ; d <= kdmax[i] ; i++ ) report_d (d*kdtab[i].d, n*kdtab[i].n);
+}
+
+// process d and its multiples by admissible divisors of k here, or hand them to a consumer if we are a producer in pipeline mode
+static inline void emitkd (uint64_t d, uint64_t zd[], unsigned n)
+{
+    if ( first_found() ) return;
+    if ( progs_out ) { exportkd (d, zd, n, 0);  return; }
+    if ( dpipe_job < 0 || ! dpipe_put (dpipe, dpipe_job, DPIPE_PROCKD, report_current_phase(), d, zd, n) ) prockd (d, zd, n);
+}
+
+// process large prime d here, or hand it to a consumer (which works out si, mi and l for itself) if we are a producer in pipeline mode
+static inline void emitdbigprime (uint64_t d, uint64_t z[], uint32_t c, uint32_t si, uint32_t mi, uint32_t l)
+{
+    if ( first_found() ) return;
+    if ( progs_out ) { exportkd (d, z, c, 1);  return; }
+    if ( dpipe_job < 0 || ! dpipe_put (dpipe, dpipe_job, DPIPE_BIGPRIME, report_current_phase(), d, z, c) ) procdbigprime (d, z, c, si, mi, l);
+}
+
 // processes admissible dmin > cdmin (so d*cdmax >= dmax) with smallest prime divisor p (which may be less than cdmax)
 // zd is a list of n cuberoots of k mod d, p is largest p|d, r is workspace for CRT-lifted cuberoots
 static void inline enumcd (uint64_t d, uint64_t p, uint64_t zd[], uint32_t n, uint64_t *r)
@@ -197,48 +293,57 @@ static void inline enumcd (uint64_t d, uint64_t p, uint64_t zd[], uint32_t n, ui
     uint64_t ai[IBATCH];
     uint64_t dinv, R, R2, R3;
     uint64_t *s;
-    uint32_t i,j,m;
+    uint32_t zr[CDMAXN];
+    uint32_t i,j,m,t,xj;
+    uint16_t *vs;
 
     softassert (d >= cdmin);
-    if ( ! (x = cdentry (p-1,d,dmax)) ) return;
+    if ( ! (xj = cdentry (&t,p-1,d,dmax)) ) return;
+    int sf = sampler_func (SF_ENUMCD);
+    x = cdrec_at(t,xj); vs = cdvs[t];
     softassert((uint128_t)d*x->d <= dmax);
     softassert(x->p < p);
 
     if ( d < sdmin ) { dinv = m64_pinv(d); R = m64_R(d); R2 = m64_R2(R,d); R3 = m64_R3 (R2,d,dinv); } else { dinv=R=R2=R3=0; }
 
     for ( m = 0 ;;) { // terminates below when x hits the bottom of the cache, with x->d = 0
-        if ( !x->d || m == IBATCH ) {
-            if ( !m ) return;
+        if ( !x->d || m == budget.ibatch ) {
+            if ( !m ) { sampler_func_end (sf); return; }
             softassert(dinv);
             m64_inv_array (ai,ai,m,R,R2,R3,d,dinv);
             for ( i = 0 ; i < m ; i++ ) {
-                uint64_t a = z[i]->d, u = a*m64_to_ui(ai[i],d,dinv) - 1, ab = a*d;
-                for ( s = r, j = 0 ; j < z[i]->n ; j++ ) {
-                    uint64_t nza = a-cdroots[z[i]->r+j];
-                    for ( int ii = 0 ; ii < n ; ii++ ) *s++ = fcrt64(u,nza,zd[ii],ab);
-                }
-                prockd (ab,r,s-r);
+                uint32_t a = z[i]->d, an = cdrec_roots (zr,z[i]);
+                uint64_t ainv = a > 2 ? b32_inv(a) : (uint64_t)1<<63;
+                uint32_t dinva = a - ((uint64_t)a*m64_to_ui(ai[i],d,dinv) - 1) / d;   // a*(1/a mod d) = 1+t*d with 0 < t < a, so 1/d mod a = a-t
+                b32_crt64_negs (wbuf, zd, n, dinva, a, ainv);
+                for ( s = r, j = 0 ; j < an ; j++, s += n ) b32_crt64_col (s, zd, d, wbuf, b32_mul(zr[j],dinva,a,ainv), n, a);
+                emitkd (a*d,r,s-r);
             }
-            if ( !x->d ) return;
+            if ( !x->d ) { sampler_func_end (sf); return; }
             m = 0;
         }
         softassert((uint128_t)d*x->d <= dmax);
         softassert(x->p < p);
         if ( x->d <= sdmax ) {
-            struct sdrec *y = sdtab+x->sdpi;
-            softassert (y->d == x->d);
-            uint64_t sdinv = y->dinv;
-            uint64_t dinvsd = sdinvs[y->i+b32_red(d,y->d,sdinv)];
-            for ( i = 0, s = r ; i < n ; i++ ) for ( j = 0 ; j < x->n ; j++ ) *s++ = b32_crt64 (zd[i],d,sdroots[y->r+j],y->d,dinvsd,sdinv);
-            prockd (d*y->d,r,s-r);
+            uint32_t y = x-cdtab, yd = sdtab.d[y], yn = sdtab.n[y];      // sdtab is indexed in parallel with the first sdcnt entries of cdtab
+            softassert (yd == x->d);
+            uint64_t sdinv = sdtab.dinv[y];
+            uint64_t dinvsd = sdinvs[sdtab.i[y]+b32_red(d,yd,sdinv)];
+            uint16_t *yroots = sdroots+sdtab.r[y];
+            uint32_t yz[SDMAXN];
+            for ( j = 0 ; j < yn ; j++ ) yz[j] = b32_mul(yroots[j],dinvsd,yd,sdinv);
+            b32_crt64_negs (wbuf, zd, n, dinvsd, yd, sdinv);
+            for ( i = 0, s = r ; i < n ; i++, s += yn ) b32_crt64_row (s, zd[i], d, wbuf[i], yz, yn, yd);
+            emitkd (d*yd,r,s-r);
         } else {
             ai[m] = m64_from_ui_R2 (x->d,R2,d,dinv); z[m] = x;
             m++;
         }
-        for ( x-- ; x->p >= p ; x-- );
+        for ( xj-- ; (x = cdrec_at(t,xj))->p >= p ; xj -= vs[xj] );    // follow skip pointers to the next entry with x->p < p
     }
 }
 
+#ifndef ZCUBES_NOMAIN
 // recursively enumerate admissible multiples of d by taking on prime powers; recursion ends with a call to enumcd
 // zd is a list of n cuberoots of k mod d, p is the smallest prime divisor of d, r is workspace for CRT-lifted cuberoots
 static void enumd (uint64_t d, uint64_t p, uint64_t zd[], uint32_t n, uint64_t *r)
@@ -252,23 +357,31 @@ static void enumd (uint64_t d, uint64_t p, uint64_t zd[], uint32_t n, uint64_t *
     if ( d >= cdmin ) { enumcd (d,p,zd,n,r); return; }
     softassert (p <= cpmax || (uint128_t)d*cpmax >= dmax );
     if ( ! (pi = pimaxp (p-1,d,dmax)) ) return;
+    int sf = sampler_func (SF_ENUMD);
     dinv = m64_pinv(d); R = m64_R(d); R2 = m64_R2(R,d); R3 = m64_R3 (R2,d,dinv);
     
     q = cptab[pi]; e = 1;
     for ( m = 0 ;; m++ ) {  // terminates below when pi hits 0
-        if ( ! pi || m == IBATCH ) {
-            if ( !m ) return;
+        if ( ! pi || m == budget.ibatch ) {
+            if ( !m ) { sampler_func_end (sf); return; }
             m64_inv_array (ai,ai,m,R,R2,R3,d,dinv);
             for ( i = 0 ; i < m ; i++ ) {
                 a = qq[i];  u = a*m64_to_ui(ai[i],d,dinv) - 1; ab = a*d;
                 qn = cached_cuberoots_modq (qz,qpi[i],qe[i]);
                 s = r;
-                for ( j = 0 ; j < qn ; j++ ) { nza = a-qz[j]; for ( int ii = 0 ; ii < n ; ii++ ) *s++ = fcrt64(u,nza,zd[ii],ab); }
-                prockd (ab,r,s-r);
+                if ( a >> 32 ) {
+                    for ( j = 0 ; j < qn ; j++ ) { nza = a-qz[j]; for ( int ii = 0 ; ii < n ; ii++ ) *s++ = fcrt64(u,nza,zd[ii],ab); }
+                } else {
+                    uint64_t ainv = a > 2 ? b32_inv(a) : (uint64_t)1<<63;
+                    uint32_t dinva = a - u/d;                           // a*(1/a mod d) = 1+t*d with 0 < t < a, so 1/d mod a = a-t
+                    b32_crt64_negs (wbuf, zd, n, dinva, a, ainv);
+                    for ( j = 0 ; j < qn ; j++, s += n ) b32_crt64_col (s, zd, d, wbuf, b32_mul(qz[j],dinva,a,ainv), n, a);
+                }
+                emitkd (ab,r,s-r);
                 if ( ab >= cdmin ) enumcd (ab,cptab[qpi[i]],r,s-r,s);
                 else enumd (ab,cptab[qpi[i]],r,s-r,s);
             }
-            if (!pi) return;
+            if (!pi) { sampler_func_end (sf); return; }
             m = 0;
         }
         softassert((uint128_t)d*q <= dmax);
@@ -279,6 +392,7 @@ static void enumd (uint64_t d, uint64_t p, uint64_t zd[], uint32_t n, uint64_t *
         if ( (uint128_t)d*q > dmax ) { q = cptab[--pi]; e = 1; }
     }
 }
+#endif
 
 
 static void precompute (uint32_t k, uint64_t pmin, uint64_t pmax)
@@ -292,37 +406,60 @@ static void precompute (uint32_t k, uint64_t pmin, uint64_t pmax)
     if ( pdmin <= k ) pdmin = k+1;
     bpmin = fastceilboundl(zmaxld/((km1&1?km2:km1)*ZSHORT));                        // for d >= bpmin we will never use zrcheckmany
     if ( bpmin <= 7 ) bpmin = 11;
-    report_printf ("LIMITS:pmin=%lu:pmax%lu:dmax=%lu:zmax=%s:cpmax=%u:cqmax=%lu:cdmax=%u:cdmin=%lu:sdmin=%lu:pdmin=%lu:bpmin=%lu\n", pmin, pmax, dmax, itoa128(zbuf,zmax128), cpmax, cqmax, cdmax, cdmin, sdmin, pdmin, bpmin);
+    report_printf ("LIMITS:pmin=%lu:pmax%lu:dmax=%lu:zmax=%s:cpmax=%u:cqmax=%lu:cdmax=%u:cdmin=%lu:sdmin=%lu:pdmin=%lu:bpmin=%lu:"
+                   "mem=%luMB:wmem=%luMB:l1=%uKB:l2=%uKB:cdcap=%u:sdmax=%u:smzmaskb=%u:zbufbits=%d:ibatch=%u:pipebuf=%u\n",
+                   pmin, pmax, dmax, itoa128(zbuf,zmax128), cpmax, cqmax, cdmax, cdmin, sdmin, pdmin, bpmin, budget.mem>>20, budget.wmem>>20,
+                   budget.l1>>10, budget.l2>>10, budget.cdmax, sdmax, smzmaskb, budget.zbufbits, budget.ibatch, budget.pipebuf);
 }
 
 void allocate_private_buffers (void)
 {
     rbuf = private_malloc (CUBEROOT_BUFSIZE*sizeof(*rbuf));
-    zabuf[0] = private_malloc((1<<ZBUFBITS)*sizeof(*zabuf[0]));
-    zabuf[1] = private_malloc((1<<ZBUFBITS)*sizeof(*zabuf[0]));
-    zbbuf[0] = private_malloc((1<<ZBUFBITS)*sizeof(*zbbuf[1]));
-    zbbuf[1] = private_malloc((1<<ZBUFBITS)*sizeof(*zbbuf[1]));
+    wbuf = private_malloc (CUBEROOT_BUFSIZE*sizeof(*wbuf));
+#if PBUCKETS
+    pwbuf = private_malloc (PBUCKETS*sizeof(*pwbuf));
+#endif
+    zabuf[0] = private_malloc(((size_t)1<<budget.zbufbits)*sizeof(*zabuf[0]));
+    zabuf[1] = private_malloc(((size_t)1<<budget.zbufbits)*sizeof(*zabuf[0]));
+    zbbuf[0] = private_malloc(((size_t)1<<budget.zbufbits)*sizeof(*zbbuf[1]));
+    zbbuf[1] = private_malloc(((size_t)1<<budget.zbufbits)*sizeof(*zbbuf[1]));
     bm0buf = private_malloc((1<<(BMBITS-3)));
     bm1buf = private_malloc((1<<(BMBITS-3)));
+    zbmcslots[0] = (budget.zbmcbytes/8) >> (ZBMC2BITS-3);       // pairs get 1/8 of the bitmap cache, triples the rest
+    zbmcslots[1] = (budget.zbmcbytes-(budget.zbmcbytes/8)) >> (BMBITS-3);
+    for ( int k = 0 ; k < 2 ; k++ ) if ( zbmcslots[k] ) {
+        zbmctags[k] = private_calloc (zbmcslots[k]*sizeof(*zbmctags[k]));
+        zbmcbuf[k] = private_malloc ((size_t)zbmcslots[k] << (k ? BMBITS-3 : ZBMC2BITS-3));
+    }
 }
 
 void free_private_buffers (void)
 {
     private_free (rbuf, CUBEROOT_BUFSIZE*sizeof(*rbuf));
-    private_free (zabuf[0], (1<<ZBUFBITS)*sizeof(*zabuf[0]));
-    private_free (zabuf[1], (1<<ZBUFBITS)*sizeof(*zabuf[0]));
-    private_free (zbbuf[0],(1<<ZBUFBITS)*sizeof(*zbbuf[1]));
-    private_free (zbbuf[1], (1<<ZBUFBITS)*sizeof(*zbbuf[1]));
+    private_free (wbuf, CUBEROOT_BUFSIZE*sizeof(*wbuf));
+#if PBUCKETS
+    private_free (pwbuf, PBUCKETS*sizeof(*pwbuf));
+#endif
+    private_free (zabuf[0], ((size_t)1<<budget.zbufbits)*sizeof(*zabuf[0]));
+    private_free (zabuf[1], ((size_t)1<<budget.zbufbits)*sizeof(*zabuf[0]));
+    private_free (zbbuf[0],((size_t)1<<budget.zbufbits)*sizeof(*zbbuf[1]));
+    private_free (zbbuf[1], ((size_t)1<<budget.zbufbits)*sizeof(*zbbuf[1]));
     private_free (bm0buf,(1<<(BMBITS-3)));
     private_free (bm1buf,(1<<(BMBITS-3)));
+    for ( int k = 0 ; k < 2 ; k++ ) if ( zbmcslots[k] ) {
+        private_free (zbmctags[k], zbmcslots[k]*sizeof(*zbmctags[k]));
+        private_free (zbmcbuf[k], (size_t)zbmcslots[k] << (k ? BMBITS-3 : ZBMC2BITS-3));
+    }
 }
 
+#ifndef ZCUBES_NOMAIN   // bench.c includes this file to get at the kernels and their precomputed tables, but not the main loops
+
 // Used when largest p|d is fixed to a single prime p0 and we are iterating over the second largest prime
 // In this scenario we assume all the primes involved are cached (and smaller than sqrt(dmax))
 static void process_subprimes (uint32_t p0, uint32_t *itabp0, primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
 {
     uint64_t p0inv, p, q, pmax, dmax0;
-    uint32_t z0[3];
+    uint32_t z0[3], y0[3], w0[3];
     uint64_t z[3], zz[3];
     uint32_t i,j,m,n,n0,pi,qinvp0;
 
@@ -354,11 +491,15 @@ static void process_subprimes (uint32_t p0, uint32_t *itabp0, primes_pipe_ctx_t
         for ( uint64_t pp=p ; pp < q ; pp*=p ) {
             for ( i = 0 ; i < n ; i++ ) zz[i] = z[i]%pp;        // each mod takes under 20 cycles, not worth trying to optimize
             qinvp0 = itabp0[b32_red(pp,p0,p0inv)];  softassert (b32_red((uint64_t)qinvp0*b32_red(pp,p0,p0inv),p0,p0inv)==1);
-            for ( i = 0 ; i < n ; i++ ) for ( j = 0 ; j < n0 ; j++ ) r[i*n0+j] = b32_crt64(zz[i],pp,z0[j],p0,qinvp0,p0inv);
+            for ( j = 0 ; j < n0 ; j++ ) y0[j] = b32_mul(z0[j],qinvp0,p0,p0inv);
+            b32_crt64_negs (w0, zz, n, qinvp0, p0, p0inv);
+            for ( i = 0 ; i < n ; i++ ) b32_crt64_row (r+i*n0, zz[i], pp, w0[i], y0, n0, p0);
             prockd (pp*p0,r,m); enumd(pp*p0,p,r,m,r+m);         // process all d divisible by pp*p0 (prockd handles cofactors dividing k, enumd the rest)
         }
         qinvp0 = itabp0[b32_red(q,p0,p0inv)];  softassert (b32_red((uint64_t)qinvp0*b32_red(q,p0,p0inv),p0,p0inv)==1);
-        for ( i = 0 ; i < n ; i++ ) for ( j = 0 ; j < n0 ; j++ ) r[i*n0+j] = b32_crt64(z[i],q,z0[j],p0,qinvp0,p0inv);
+        for ( j = 0 ; j < n0 ; j++ ) y0[j] = b32_mul(z0[j],qinvp0,p0,p0inv);
+        b32_crt64_negs (w0, z, n, qinvp0, p0, p0inv);
+        for ( i = 0 ; i < n ; i++ ) b32_crt64_row (r+i*n0, z[i], q, w0[i], y0, n0, p0);
         prockd (q*p0,r,m); enumd(q*p0,p,r,m,r+m);               // process all d divisible by q*p0 (prockd handles cofactors dividing k, enumd the rest)
     }
 
@@ -380,13 +521,62 @@ static void process_subprimes (uint32_t p0, uint32_t *itabp0, primes_pipe_ctx_t
     assert (p > pmax);
 }
 
+#if PBUCKETS
+// Reads up to PBUCKETS primes in [p,pend] from the pipe, computes their cuberoots, and then processes each d=p (using emitdbigprime if big is set,
+// emitkd otherwise) in order of (si, p mod sm0), so that primes sharing a zsmodm0 row (and a km row) are processed consecutively while it is hot.
+// We stop short of crossing a checkpoint boundary so that a checkpoint is never written before all the primes it covers have been processed.
+// Returns the next prime to be processed.
+static uint64_t process_prime_window (uint64_t p, uint64_t pend, primes_pipe_ctx_t *pipe, int jobid, int big)
+{
+    struct pwrec *x;
+    uint64_t q;
+    uint32_t i, n, si, mi;
+
+    for ( x = pwbuf ; x < pwbuf+PBUCKETS && p <= pend && (x == pwbuf || p <= report_chkpt_pmax()) ; p = primes_read_pipe (pipe,jobid) ) {
+        if ( ! report_p(p) ) continue;
+        n = cuberoots_modp (x->z,K,p);
+        if ( ! n || ! report_c(n) ) continue;
+        x->p = p; x->n = n; si = sgnz_index(p);
+        x->key = ((uint64_t)(si*sm0 + b32_red(p,sm0,sm0inv)) << 32) | (x-pwbuf);
+        x++;
+    }
+    qsort (pwbuf, x-pwbuf, sizeof(*pwbuf), pwrec_cmp);
+    for ( n = x-pwbuf, x = pwbuf, i = 0 ; i < n ; i++, x++ ) {
+        q = x->p;
+        if ( ! big ) { emitkd (q,x->z,x->n); continue; }     // as in the unbucketed loops, so export, pipeline and first-solution modes see these d's
+        si = sgnz_index(q);
+        mi = (km1&1) + ( mod7(K*K) == 4 && onezmod7(q,si) ? 2 : 0 );
+        emitdbigprime (q,x->z,x->n,si,mi,fastceilboundl(zmaxld/((long double)q*km[mi])));
+    }
+    return p;
+}
+#endif
+
+// Estimated work for the prime p, used by the prime pipe to balance load across jobs (in units of one progression): 1 for p itself plus the
+// number of cuberoots of k modulo the admissible cofactors c <= dmax/p in cdtab (the r offsets in cdtab are cumulative), scaled up by
+// (dmax/p)/cdmax when dmax/p > cdmax.  Each prime has one cuberoot of k on average (p=2 mod 3 has one, p=1 mod 3 has three or none), so we
+// don't try to tell which p have roots, that would put a cuberoot computation per prime on the feeder.  Only the feeder calls this, and it
+// does so for increasing p, so we walk a cursor down cdtab rather than bisecting it.
+static uint32_t prime_cost (uint64_t p)
+{
+    static uint32_t j;
+    uint64_t m = dmax/p, c;
+
+    if ( ! cdtab ) return 1;    // nothing cached (e.g. when we only enumerate primes)
+    if ( ! j ) j = cdcnt[0];
+    while ( j > 1 && cdtab[j].d > m ) j--;
+    c = cdtab[j+1].r - cdtab[1].r;
+    if ( m > cdmax ) c *= m/cdmax;
+    return 1 + (c < (1<<24) ? c : (1<<24));
+}
+
 // This the main loop for each child thread (or the single main thread for n=1)
 // For each p in the pipe (all p in [pmin,pmax] if we are the only core) processed all d with largest prime divisor p
 static void process_primes (primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
 {
     uint64_t p, q, pmax;
-    uint64_t z[3], zz[3];
-    uint32_t i,j,n;
+    uint64_t z[3], zz[3], pb[PBATCH];
+    uint32_t i,j,n,nb,ib,si;
 
     pmax = pipe->end;
     p = primes_read_pipe(pipe,jobid);
@@ -412,9 +602,9 @@ static void process_primes (primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
             if ( ! report_c (n) ) continue;
             for ( uint64_t pp=p ; pp < q ; pp*=p ) {
                 for ( i = 0 ; i < n ; i++ ) zz[i] = z[i]%pp;        // each mod takes under 20 cycles, not worth trying to optimize
-                prockd (pp,zz,n); enumd(pp,p,zz,n,r);               // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
+                emitkd (pp,zz,n); enumd(pp,p,zz,n,r);               // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
             }
-            prockd (q,z,n);  enumd(q,p,z,n,r);                      // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
+            emitkd (q,z,n);  enumd(q,p,z,n,r);                      // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
         }
     }
     if ( ! report_phase(PHASE_CACHED) ) goto done;
@@ -431,7 +621,7 @@ static void process_primes (primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
         if ( ! report_p(p) ) continue;
         n = cuberoots_modp (z,K,p);
         if ( ! n || ! report_c(n) ) continue;
-        prockd (p,z,n); enumd (p,p,z,n,r);                          // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
+        emitkd (p,z,n); enumd (p,p,z,n,r);                          // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
     }
     report_phase (PHASE_UNCACHED);
     if ( p > pmax ) goto done;
@@ -442,26 +632,41 @@ static void process_primes (primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
         if ( ! report_p (p) ) continue;
         n = cuberoots_modp (z,K,p);
         if ( ! n || ! report_c (n) ) continue;
-        prockd (p,z,n); enumcd (p,p,z,n,r);                         // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
+        emitkd (p,z,n); enumcd (p,p,z,n,r);                         // process all d divisible by pp  < q (prockd handles cofactors dividing k, enumd the rest)
     }
     report_phase (PHASE_COCACHED);
     if ( p > pmax ) goto done;
 
     // Phasse 4: primes in [sdmin,pdmin) -- for these p all possible cofactors have cached cuberoots and inverses
     // For these primes we compute cuberoots and process all admissible cofactors using cached cuberoots and inverses
-    struct sdrec *x;
+    // Primes are read in batches of up to PBATCH (never crossing a checkpoint boundary), we then loop over cofactors in the outer loop and over the batch
+    // in the inner loop so that the sdtab entries, sdinvs row, and sdroots for each cofactor are reused for every p in the batch while they are in L1
+    uint64_t zpb[PBATCH][3];
+    uint32_t npb[PBATCH], pinvb[PBATCH], mb, xz[SDMAXN], xw[3];
     int pimax = sdcnt;
-    for ( softassert (p>=sdmin) ; p < pdmin && p <= pmax ; p = primes_read_pipe (pipe,jobid) ) {
-        if ( ! report_p(p) ) continue;
-        n = cuberoots_modp (z,K,p);
-        if ( !n || !report_c(n) ) continue;
-        prockd (p,z,n);                                             // process all d that are p times a (possibly trivial) cofactor dividing k
-        while ( pimax && (uint128_t)p*sdtab[pimax].d > dmax ) pimax--;
-        for ( x = sdtab+pimax ; x > sdtab ; x-- ) {
-            uint64_t dinv = x->dinv;
-            uint64_t pinvb = sdinvs[x->i+b32_red(p,x->d,dinv)], *s = r;
-            for ( i = 0 ; i < n ; i++ ) for ( j = 0 ; j < x->n ; j++ ) *s++ = b32_crt64 (z[i],p,sdroots[x->r+j],x->d,pinvb,dinv);
-            prockd (p*x->d,r,s-r);                                  // process all d that are p*x->d times a (possibly trivial) cofactor dividing k
+    for ( softassert (p>=sdmin) ; p < pdmin && p <= pmax ; ) {
+        for ( nb = 0 ; nb < PBATCH && p < pdmin && p <= pmax && (!nb || p <= report_chkpt_pmax()) ; p = primes_read_pipe (pipe,jobid) ) {
+            if ( ! report_p(p) ) continue;
+            n = cuberoots_modp (zpb[nb],K,p);
+            if ( !n || !report_c(n) ) continue;
+            emitkd (p,zpb[nb],n);                                   // process all d that are p times a (possibly trivial) cofactor dividing k
+            pb[nb] = p; npb[nb++] = n;
+        }
+        if ( ! nb ) continue;
+        while ( pimax && (uint128_t)pb[0]*sdtab.d[pimax] > dmax ) pimax--;
+        for ( int xi = pimax ; xi > 0 ; xi-- ) {
+            uint32_t xd = sdtab.d[xi], xn = sdtab.n[xi];
+            uint64_t dinv = sdtab.dinv[xi];
+            uint16_t *xinvs = sdinvs+sdtab.i[xi], *xroots = sdroots+sdtab.r[xi];
+            for ( mb = nb ; (uint128_t)pb[mb-1]*xd > dmax ; mb-- );  // primes in the batch with p*xd <= dmax (always includes pb[0])
+            for ( ib = 0 ; ib < mb ; ib++ ) pinvb[ib] = xinvs[b32_red(pb[ib],xd,dinv)];   // independent lookups, kept out of the lifting loop below
+            for ( ib = 0 ; ib < mb ; ib++ ) {
+                uint64_t *s = r;
+                for ( j = 0 ; j < xn ; j++ ) xz[j] = b32_mul(xroots[j],pinvb[ib],xd,dinv);
+                b32_crt64_negs (xw, zpb[ib], npb[ib], pinvb[ib], xd, dinv);
+                for ( i = 0 ; i < npb[ib] ; i++, s += xn ) b32_crt64_row (s, zpb[ib][i], pb[ib], xw[i], xz, xn, xd);
+                emitkd (pb[ib]*xd,r,s-r);                           // process all d that are p*xd times a (possibly trivial) cofactor dividing k
+            }
         }
     }
     report_phase (PHASE_NEARPRIME);
@@ -469,50 +674,69 @@ static void process_primes (primes_pipe_ctx_t *pipe, int jobid, uint64_t *r)
 
     // Phasse 5: primes in [pdmin,bpmin) -- we must have d=p, no cofactors are possible
     // For these primes we just compute cuberoots and process d=p prime using procdcoprime
-    for ( softassert (p>=pdmin) ; p < bpmin && p <= pmax ; p = primes_read_pipe (pipe,jobid) ) {
-        if ( ! report_p(p) ) continue;
-        n = cuberoots_modp (z,K,p);
-        if (! n || ! report_c(n) ) continue;
-        procdcoprime (p,z,n);   // process d = p
+    // We read primes in batches of PBATCH and prefetch the table entries for each before computing cuberoots and processing them in order
+#if PBUCKETS
+    for ( softassert (p>=pdmin) ; p < bpmin && p <= pmax ; ) p = process_prime_window (p, _min(bpmin-1,pmax), pipe, jobid, 0);
+#endif
+    for ( softassert (p>=pdmin) ; p < bpmin && p <= pmax ; ) {
+        for ( nb = 0 ; nb < PBATCH && p < bpmin && p <= pmax ; p = primes_read_pipe (pipe,jobid) ) { si = sgnz_index(p); prefetchd (p,si,(km1&1)+2*(onezmod7(p,si)?1:0)); pb[nb++] = p; }
+        for ( ib = 0 ; ib < nb ; ib++ ) {
+            q = pb[ib];
+            if ( ! report_p(q) ) continue;
+            n = cuberoots_modp (z,K,q);
+            if (! n || ! report_c(n) ) continue;
+            emitkd (q,z,n);         // process d = q (prockd does the same thing as procdcoprime here because 2q > dmax)
+        }
     }
     report_phase (PHASE_PRIME);
     if ( p > pmax ) goto done;
 
     // Phasse 6: primes in (bpmin,pmax] -- we have d=p prime and close enough to zmax that we don't want to split arithmetic progressions in order to lift them
     // For these primes we just compute cuberoots and process d=p using procdprime (which will call zrcheckone or zrcheckafew but never zrcheckmany)
-    uint32_t si, mi = km1&1, m = km[mi];                                // by default we mod km[mi] = 18 or 162 (if k=3)
+    uint32_t mi = km1&1, m = km[mi];                                // by default we mod km[mi] = 18 or 162 (if k=3)
     softassert (m && !(m&1));
     uint32_t l = fastceilboundl(zmaxld/((long double)p*m));                 // l = length of arithmetic progressions for current p
     softassert ( l <= ZSHORT && (uint128_t)l*p*m > zmax128 );
     uint64_t lpmax = (uint128_t)(l-1)*m*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m*(l-1))) : pmax;
 
+#if PBUCKETS
+    for ( softassert (p >= bpmin) ; p <= pmax ; ) p = process_prime_window (p, pmax, pipe, jobid, 1);
+#endif
     if ( mod7(K*K) != 4 ) {
-        for ( softassert (p >= bpmin) ; p <= pmax ; p = primes_read_pipe (pipe,jobid) ) {
-            if ( ! report_p(p) ) continue;
-            n = cuberoots_modp (z,K,p);
-            if ( !n || ! report_c(n) ) continue;
-            si = sgnz_index(p);
-            if ( p > lpmax ) { l = fastceilboundl(zmaxld/((long double)p*m)); lpmax = (uint128_t)(l-1)*m*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m*(l-1))) : pmax; }          
-            procdbigprime (p,z,n,si,mi,l);
+        for ( softassert (p >= bpmin) ; p <= pmax ; ) {
+            for ( nb = 0 ; nb < PBATCH && p <= pmax ; p = primes_read_pipe (pipe,jobid) ) { prefetchd (p,sgnz_index(p),mi); pb[nb++] = p; }
+            for ( ib = 0 ; ib < nb ; ib++ ) {
+                q = pb[ib];
+                if ( ! report_p(q) ) continue;
+                n = cuberoots_modp (z,K,q);
+                if ( !n || ! report_c(n) ) continue;
+                si = sgnz_index(q);
+                if ( q > lpmax ) { l = fastceilboundl(zmaxld/((long double)q*m)); lpmax = (uint128_t)(l-1)*m*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m*(l-1))) : pmax; }
+                emitdbigprime (q,z,n,si,mi,l);
+            }
         }
     } else {
         uint32_t mi7 = mi+2, m7 = km[mi7];
         softassert (m7 && !(m7&1) && !mod7(m7));    // in fact m7=126
         uint32_t l7 = fastceilboundl(zmaxld/((long double)p*m7));                   // l = length of arithmetic progressions for current p
         uint64_t lpmax7 = (uint128_t)(l-1)*m7*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m7*(l-1))) : pmax;
-        for ( softassert (p >= bpmin) ; p <= pmax ; p = primes_read_pipe (pipe,jobid) ) {
-            if ( ! report_p(p) ) continue;
-            n = cuberoots_modp (z,K,p);
-            if ( !n || ! report_c(n) ) continue;
-            si = sgnz_index(p);
-            if ( (j=onezmod7(p,si)) ) {
-                if ( p > lpmax7 ) { l7 = fastceilboundl(zmaxld/((long double)p*m7)); lpmax7 = (uint128_t)(l-1)*m7*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m7*(l-1))) : pmax; }
-                i = mi7; j = l7;
-            } else {
-                if ( p > lpmax ) { l = fastceilboundl(zmaxld/((long double)p*m)); lpmax = (uint128_t)(l-1)*m*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m*(l-1))) : pmax; }
-                i = mi; j = l;
+        for ( softassert (p >= bpmin) ; p <= pmax ; ) {
+            for ( nb = 0 ; nb < PBATCH && p <= pmax ; p = primes_read_pipe (pipe,jobid) ) { si = sgnz_index(p); prefetchd (p,si,onezmod7(p,si)?mi7:mi); pb[nb++] = p; }
+            for ( ib = 0 ; ib < nb ; ib++ ) {
+                q = pb[ib];
+                if ( ! report_p(q) ) continue;
+                n = cuberoots_modp (z,K,q);
+                if ( !n || ! report_c(n) ) continue;
+                si = sgnz_index(q);
+                if ( (j=onezmod7(q,si)) ) {
+                    if ( q > lpmax7 ) { l7 = fastceilboundl(zmaxld/((long double)q*m7)); lpmax7 = (uint128_t)(l-1)*m7*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m7*(l-1))) : pmax; }
+                    i = mi7; j = l7;
+                } else {
+                    if ( q > lpmax ) { l = fastceilboundl(zmaxld/((long double)q*m)); lpmax = (uint128_t)(l-1)*m*pmax > zmax128 ? fastceilboundl (zmaxld/((long double)m*(l-1))) : pmax; }
+                    i = mi; j = l;
+                }
+                emitdbigprime (q,z,n,si,i,j);
             }
-            procdbigprime (p,z,n,si,i,j);
         }
     }
     report_phase (PHASE_BIGPRIME);
@@ -521,6 +745,137 @@ done:
     assert (p > pmax);
 }
 
+// Main loop for consumers in pipeline mode: processes the d's that producers hand us in the rings we drain until they are all done
+// z is workspace for cuberoots (it needs room for DPIPE_BUFSIZE-2 of them)
+static void consume_ds (uint32_t c, uint64_t *z)
+{
+    uint64_t d;
+    uint32_t kind, phase, si, mi;
+    int n;
+
+    while ( (n = dpipe_get (dpipe, c, &d, &kind, &phase, z)) >= 0 ) {
+        if ( (int)phase > report_current_phase() ) report_phase (phase-1);     // follow the producers from phase to phase (for per-phase stats)
+        if ( first_found() ) continue;                                      // drain our rings so producers can finish
+        if ( kind == DPIPE_PROCKD ) { prockd (d,z,n); continue; }
+        si = sgnz_index(d);
+        mi = (km1&1) + ( mod7(K*K) == 4 && onezmod7(d,si) ? 2 : 0 );
+        procdbigprime (d,z,n,si,mi,fastceilboundl(zmaxld/((long double)d*km[mi])));
+    }
+}
+
+// Main loop for jobs in import mode: checks the progressions in the files prefix_i, prefix_{i+n}, ... (of files in all)
+// z is workspace for cuberoots (it needs room for 2^16 of them)
+static void import_ds (char *prefix, uint32_t i, uint32_t n, uint32_t files, uint64_t *z)
+{
+    progs_file_t *f;
+    uint64_t d;
+    unsigned si;
+    int c, big, phase;
+
+    for ( ; i < files && ! first_found() ; i += n ) {
+        if ( ! (f = progs_open (prefix, i)) ) { fprintf (stderr, "ERROR: Unable to read progression file %s_%u\n", prefix, i); abort(); }
+        while ( (c = progs_read (f, &d, z, &si, &big, &phase)) >= 0 ) {
+            if ( phase > report_current_phase() ) report_phase (phase-1);     // follow the exporting job from phase to phase (for per-phase stats)
+            softassert (si == sgnz_index(d));
+            if ( first_found() ) break;
+            if ( ! big || d < bpmin ) { prockd (d,z,c); continue; }             // bpmin depends on zmax, which may have changed since the export
+            uint32_t mi = (km1&1) + ( mod7(K*K) == 4 && onezmod7(d,si) ? 2 : 0 );
+            procdbigprime (d,z,c,si,mi,fastceilboundl(zmaxld/((long double)d*km[mi])));
+        }
+        report_printf ("Imported %lu records with %lu progressions (%.1f MB) from %s_%u\n", f->recs, f->roots, (double)f->bytes/(1<<20), prefix, i);
+        progs_close (f);
+    }
+}
+
+// deep search mode (option ds=d1,d2,...): d = a*kdtab[ki].d with a coprime to k, and the n cuberoots z of k mod a
+struct dsrec { uint64_t d, a; uint32_t ki, n; uint64_t *z; };
+
+static inline int isprime64 (uint64_t n)
+    { mpz_t N;  mpz_init_set_ui (N, n);  int r = mpz_probab_prime_p (N, 25);  mpz_clear (N);  return r; }
+
+// returns a nontrivial factor of the composite n, which has no prime factors below FACTOR_TDMAX (Pollard rho with Brent's cycle detection)
+static uint64_t rho64 (uint64_t n)
+{
+    for ( uint64_t c = 1 ;; c++ ) {
+        uint64_t x, y = 2, ys = 2, q = 1, g = 1, r, i, j;
+        for ( r = 1 ; g == 1 ; r *= 2 ) {
+            for ( x = y, i = 0 ; i < r ; i++ ) y = ((uint128_t)y*y+c) % n;
+            for ( i = 0 ; i < r && g == 1 ; i += 128 ) {        // take the gcd once per 128 steps, backtracking from ys below if we overshoot
+                for ( ys = y, j = 0 ; j < 128 && i+j < r ; j++ ) { y = ((uint128_t)y*y+c) % n;  q = ((uint128_t)q*(x>y?x-y:y-x)) % n; }
+                g = ui64_gcd (q, n);
+            }
+        }
+        if ( g == n ) do { ys = ((uint128_t)ys*ys+c) % n;  g = ui64_gcd (x>ys?x-ys:ys-x, n); } while ( g == 1 );
+        if ( g != n ) return g;                                 // otherwise try again with a different c
+    }
+}
+
+// factors n (we only do this for the few d in a deep search), returns the number of distinct primes p[i] with exponents e[i]
+static int factor64 (uint64_t n, uint64_t p[], uint32_t e[])
+{
+    primes_ctx_t *ctx = primes_enum_start (2, FACTOR_TDMAX);
+    uint64_t x;
+    int m = 0;
+
+    for ( x = primes_enum_next (ctx) ; x < FACTOR_TDMAX && x*x <= n ; x = primes_enum_next (ctx) )
+        if ( !(n%x) ) { p[m] = x;  for ( e[m] = 0 ; !(n%x) ; n /= x ) e[m]++;  m++; }
+    primes_enum_end (ctx);
+    while ( n > 1 ) {
+        if ( (uint64_t)FACTOR_TDMAX*FACTOR_TDMAX > n ) x = n; else for ( x = n ; ! isprime64 (x) ; x = rho64 (x) );   // x is a prime dividing n
+        p[m] = x;  for ( e[m] = 0 ; !(n%x) ; n /= x ) e[m]++;  m++;
+    }
+    return m;
+}
+
+// parses the list s of d's to search in deep search mode and computes the cuberoots of k mod their parts coprime to k, returns the number of d's
+// that can have solutions (stored in ds, which must have room for one entry per comma in s plus one), or -1 if s is not a list of d <= dmax
+static int deep_setup (uint32_t k, char *s, struct dsrec *ds)
+{
+    uint64_t p[16], r[3], *z, *w;
+    uint32_t e[16], n, ki;
+    char buf[64], *t;
+    int i, j, m, nds = 0;
+
+    z = malloc (2*CUBEROOT_BUFSIZE*sizeof(*z));  assert (z);  w = z+CUBEROOT_BUFSIZE;
+    for ( ; *s ; s += (*s == ',') ) {
+        for ( t = buf ; *s && *s != ',' && t < buf+sizeof(buf)-1 ; ) *t++ = *s++;
+        *t = '\0';
+        uint64_t d = strto64(buf), a = 1, kd = 1;
+        if ( ! d || d > dmax ) { fprintf (stderr, "ERROR: ds= must be a list of d's in [1,dmax=%lu], %s is not\n", dmax, buf); free (z);  return -1; }
+        // split d into a coprime to k and kd | k, and combine the cuberoots of k mod the prime powers dividing a
+        z[0] = 0;  n = 1;
+        m = factor64 (d, p, e);
+        for ( i = 0 ; i < m && n ; i++ ) {
+            uint64_t q = power (p[i], e[i]);
+            if ( !(k%p[i]) ) { kd *= q;  continue; }          // kd must be one of the admissible divisors of k listed in kdtab
+            uint32_t c = cuberoots_modq (r, k, p[i], e[i]);
+            uint64_t ainv = ui64_inverse (a, q);
+            for ( j = 0 ; j < n*c ; j++ ) w[j] = crt64 (z[j/c], a, r[j%c], q, ainv, a*q);
+            memcpy (z, w, n*c*sizeof(*z));  n *= c;  a *= q;
+        }
+        for ( ki = 0 ; ki < kdcnt && kdtab[ki].d != kd ; ki++ );
+        if ( ! n || ki == kdcnt ) { report_printf ("Skipping d=%lu, which is not admissible for k=%u or has no cuberoots of k mod d\n", d, k);  continue; }
+        softassert (verify_cuberoots_64 (z, n, a));
+        ds[nds].d = d;  ds[nds].a = a;  ds[nds].ki = ki;  ds[nds].n = n;
+        ds[nds].z = malloc (n*sizeof(*z));  assert (ds[nds].z);
+        memcpy (ds[nds++].z, z, n*sizeof(*z));
+    }
+    free (z);
+    return nds;
+}
+
+// Main loop for jobs in deep search mode: job i of n checks the ith of n slices of the lifted progressions of each d (see zrcheckslice in zcheck.h)
+static void deep_ds (struct dsrec *ds, int nds, uint32_t i, uint32_t n)
+{
+    zslice = i;  zslices = n;
+    for ( int j = 0 ; j < nds && ! first_found() ; j++ ) {
+        struct dsrec *x = ds+j;
+        if ( ! i ) report_d (x->d, x->n*kdtab[x->ki].n);                   // only job 0 counts d's and residue classes
+        int sf = sampler_func (SF_PROCD);
+        zrchecklift (x->d, sgnz_index(x->d), x->ki, x->a, x->z, x->n);
+        sampler_func_end (sf);
+    }
+}
 
 int main (int argc, char *argv[])
 {
@@ -529,7 +884,7 @@ int main (int argc, char *argv[])
     char *s;
     int k, n, opts, cores, status;
 
-    if ( argc < 7 ) { fprintf (stderr,"    zcubes n k pmin pmax dmax zmax [options]\n    (version %s)\n", VERSION_STRING); return 0; }
+    if ( argc < 7 ) { fprintf (stderr,"    zcubes n k pmin pmax dmax zmax [options] [mem=MB] [wmem=MB] [consumers=M] [export=prefix] [import=prefix] [primes=lo..hi,...] [ledger=file] [first=1] [deepen=F] [ds=d1,d2,...] [pcnt=N] [ccnt=N] [dcnt=N] [rcnt=N] [scnt=N] [cyc/r=N]\n    (version %s)\n", VERSION_STRING); return 0; }
 
     cores = atoi(argv[1]);
     assert (cores >= 0);
@@ -540,12 +895,39 @@ int main (int argc, char *argv[])
     if ( ! cores ) { cores = n; report_printf ("Using %d threads.\n", cores); }
     else { if ( cores > n ) fprintf (stderr, "WARNING: specified number of cores %d exceeds number of cores %d available\n", cores, n); }
 
+    uint64_t mem = 0, wmem = 0;     // memory budget (total and per worker), zero means use defaults (see budget.h)
+    int consumers = 0;              // number of consumers in pipeline mode, zero means every worker does everything for its primes
+    char *export = 0, *import = 0;  // file name prefixes for export and import mode
+    char *primes = 0, *ledger = 0;  // list of prime intervals to search within [pmin,pmax] and name of the coverage ledger
+    int first = 0, deepen = 0;      // stop after the first solution, factor by which zmax grows from one iterative deepening pass to the next
+    char *dlist = 0;                // list of d's to search in deep search mode
+    for ( int i = 7 ; i < argc ; i++ ) {
+        if ( memcmp(argv[i],"first=",6) == 0 ) first = atoi(argv[i]+6);
+        if ( memcmp(argv[i],"deepen=",7) == 0 ) deepen = atoi(argv[i]+7);
+        if ( memcmp(argv[i],"ds=",3) == 0 ) dlist = argv[i]+3;
+        if ( memcmp(argv[i],"primes=",7) == 0 ) primes = argv[i]+7;
+        if ( memcmp(argv[i],"ledger=",7) == 0 ) ledger = argv[i]+7;
+        if ( memcmp(argv[i],"export=",7) == 0 ) export = argv[i]+7;
+        if ( memcmp(argv[i],"import=",7) == 0 ) import = argv[i]+7;
+        if ( memcmp(argv[i],"mem=",4) == 0 ) mem = budget_parse(argv[i]+4);
+        if ( memcmp(argv[i],"wmem=",5) == 0 ) wmem = budget_parse(argv[i]+5);
+        if ( memcmp(argv[i],"consumers=",10) == 0 ) consumers = atoi(argv[i]+10);
+    }
+    if ( consumers < 0 || 2*consumers > cores ) { fprintf (stderr, "ERROR: consumers=%d must be between 0 and n/2=%d\n", consumers, cores/2); return -1; }
+    if ( (export || import) && (consumers || (export && import) || profiling()) ) { fprintf (stderr, "ERROR: export and import cannot be combined with each other, with consumers, or with profiling\n"); return -1; }
+    if ( deepen ) first = 1;
+    if ( deepen == 1 || deepen < 0 ) { fprintf (stderr, "ERROR: deepen=%d must be at least 2\n", deepen); return -1; }
+    if ( (first && export) || (deepen && import) ) { fprintf (stderr, "ERROR: first= cannot be combined with export and deepen= cannot be combined with import\n"); return -1; }
+    if ( dlist && (consumers || export || import || primes || ledger || deepen || profiling()) ) { fprintf (stderr, "ERROR: ds= cannot be combined with consumers, export, import, primes, ledger, deepen, or profiling\n"); return -1; }
+    budget_init (cores, mem, wmem, CDMAX, SDMAX, ZBUFBITS, IBATCH, PRIMES_PIPE_MAX_BUFSIZE);
+
     k = atoi(argv[2]);  if ( k < 0 || ! goodk(k) ) { fprintf (stderr, "ERROR: k=%d must be a postive integer <= 1000 congruent to 3 or 6 mod 9.\n",k); return -1; }
 
     dmax = strto64(argv[5]);
     if ( dmax > DMAX ) { fprintf (stderr, "ERROR: dmax = %lu cannot exceed DMAX = %lu\n", dmax, DMAX); return -1; }
 
     if ( (s=strchr(argv[3],'x')) ) {
+        if ( dlist ) { fprintf (stderr, "ERROR: ds= is not supported for pmin=%s\n", argv[3]); return -1; }
         if ( memcmp(argv[3],argv[4],s+1-argv[3]) != 0 ) { fprintf (stderr, "ERROR: pmax=%s not valid for pmin=%s (if pmin=p0xq we require pmax=p0xr with r>=q)\n", argv[4], argv[3]); return -1; }
         *s = '\0'; p0 = atoi(argv[3]);
         if ( p0 < 2 ) { fprintf (stderr, "ERROR: p0=%u must be at least 2\n", p0); return -1; }
@@ -556,13 +938,28 @@ int main (int argc, char *argv[])
     } else {
         pmin = strto64(argv[3]);
         pmax = strto64(argv[4]);
-        if ( cores > 1 && pmin == pmax && pmax <= sqrt(dmax) ) { p0 = pmin; pmin = 2; } else p0 = 1;
+        if ( dlist ) pmin = pmax = 2;   // in deep search mode we only precompute cuberoots for small primes
+        if ( cores > 1 && ! dlist && pmin == pmax && pmax <= sqrt(dmax) ) { p0 = pmin; pmin = 2; } else p0 = 1;
     }
     if ( p0 > 1 && primes_next_prime(p0-1) != p0 ) { fprintf (stderr, "WARNING: p0=%u is not prime\n", p0); }
     if ( p0 > 1 && mod3(p0) == 1 && ! has_cuberoots_modp(k,p0) ) { fprintf (stderr, "WARNING: There are no cuberoots of k=%u mod p0=%u\n", k, p0); }
     if ( p0 > 1 && !(k%p0) ) { fprintf (stderr, "ERROR: p0=%u divides k=%u, this case is not currently supported\n", p0, k); return -1; }
+    if ( p0 > 1 && consumers ) { fprintf (stderr, "ERROR: Pipeline mode (consumers=%d) is not supported for pmin=%ux%lu\n", consumers, p0, pmin); return -1; }
+    if ( p0 > 1 && (export || import) ) { fprintf (stderr, "ERROR: export and import are not supported for pmin=%ux%lu\n", p0, pmin); return -1; }
     if ( pmin < 2 ) pmin = 2;
     if ( pmax < pmin ) { fprintf (stderr, "ERROR: We must have pmin=%lu <= pmax=%lu and pmax > 1\n", pmin, pmax); return -1; }
+    uint32_t files = 0;             // number of progression files to import
+    if ( import ) {
+        progs_file_t *f = progs_open (import, 0);
+        if ( ! f ) { fprintf (stderr, "ERROR: Unable to read progression file %s_0\n", import); return -1; }
+        if ( f->hdr.k != k || f->hdr.dmax != dmax || f->hdr.pmin != pmin || f->hdr.pmax != pmax ) {
+            fprintf (stderr, "ERROR: progression files %s_* are for k=%u pmin=%lu pmax=%lu dmax=%lu\n", import, f->hdr.k, f->hdr.pmin, f->hdr.pmax, f->hdr.dmax);
+            return -1;
+        }
+        if ( strcmp (f->hdr.ver, VERSION_STRING) ) fprintf (stderr, "WARNING: progression file %s_0 was written by version %s, this is version %s\n", import, f->hdr.ver, VERSION_STRING);
+        files = f->hdr.jobs;
+        progs_close (f);
+    }
 
     zmax128 = strto128(argv[6]);
     zmaxbits = ui128_len(zmax128);
@@ -571,15 +968,76 @@ int main (int argc, char *argv[])
     zmaxld = (long double) (zmax128 + (zmax128>>62) + 1);   // add a fudge factor to account for the loss of precision
     assert (zmaxld > zmax128);
 
-    if ( reporting() ) opts = argc > 7 ? atoi(argv[7]) : 0; else { opts = 0; if ( argc > 7 ) fprintf (stderr, "WARNING: Ignoring option %d with reporting off.\n", opts); }
+    // the prime intervals we search are [pmin,pmax] (or [p0,p0]) restricted to the primes= list, less whatever the ledger says is covered
+    uint64_t *ivs = 0;
+    int nivs = 1;
+    if ( primes || ledger ) {
+        if ( strchr(argv[4],'x') || (primes && p0 > 1) || export || import ) { fprintf (stderr, "ERROR: primes= and ledger= are not supported for pmin=p0xq or with export or import\n"); return -1; }
+        ivs = malloc ((2*LEDGER_MAX_INTERVALS+2)*sizeof(*ivs));  assert (ivs);
+        uint64_t lo = p0 > 1 ? p0 : pmin, hi = p0 > 1 ? p0 : pmax;
+        if ( primes ) {
+            if ( (nivs = ledger_parse_intervals (primes, ivs, LEDGER_MAX_INTERVALS)) <= 0 ) { fprintf (stderr, "ERROR: primes=%s is not a list of disjoint increasing intervals lo..hi,lo..hi,...\n", primes); return -1; }
+            nivs = ledger_subtract (ivs, nivs, 0, lo-1);
+            nivs = ledger_subtract (ivs, nivs, hi+1, ~(uint64_t)0);
+        } else {
+            ivs[0] = lo;  ivs[1] = hi;
+        }
+        if ( ledger && (nivs = ledger_reduce (ledger, k, dmax, zmax128, ivs, nivs)) < 0 ) { fprintf (stderr, "ERROR: Unable to read ledger %s\n", ledger); return -1; }
+        if ( ! nivs ) { report_printf ("Nothing to do, every prime in [%lu,%lu] has already been covered\n", lo, hi); return 0; }
+        if ( p0 == 1 ) { pmin = ivs[0];  pmax = ivs[2*nivs-1]; }
+        char *buf = malloc (42*nivs+1);  assert (buf);
+        report_printf ("Searching primes in %s\n", ledger_format_intervals (buf, ivs, nivs));
+        free (buf);
+    }
+
+    if ( reporting() ) opts = argc > 7 ? atoi(argv[7]) : 0; else { opts = 0; if ( argc > 7 && atoi(argv[7]) ) fprintf (stderr, "WARNING: Ignoring option %d with reporting off.\n", atoi(argv[7])); }
+    if ( dlist && opts ) { fprintf (stderr, "ERROR: Options are not supported with ds=\n"); return -1; }
 
     if ( sqrt(dmax) < p0 ) { fprintf (stderr, "ERROR: We must have p0=%u <= sqrt(dmax)=%.1f\n", p0, sqrt(dmax)); return -1; }
     if ( pmax < pmin || dmax < p0*pmax || zmax128 < dmax ) { char buf[64]; fprintf (stderr, "ERROR: We must have pmin=%lu <= pmax=%lu <= dmax=%lu <= zmax=%s\n", pmin, pmax, dmax, itoa128(buf,zmax128)); return -1; }
     long double zminld = 3.847322101863072639L*dmax;
     if ( zminld > zmaxld ) { fprintf (stderr, "WARNING: for dmax=%lud we have zminld=%Lf > zmaxld=%.0Lf, you should increase zmax or decrease dmax\n", dmax, zminld, zmaxld); if ( ! opts ) return -1; }
 
+    // iterative deepening (option deepen=f): before the full run we search |z| <= zmax/f^j for j = m, ..., j0, each pass in a child process,
+    // stopping after the first pass that finds a solution (a solution with d = |x+y| has |z| > 3.8473*d, so pass j only needs d <= zmax/(3.8473*f^j)),
+    // where j0 is the first j for which this is below dmax (a pass that enumerates every d <= dmax costs about as much as the full run)
+    int pass = 0;                   // the pass we are running in a child process, 0 for the full run (and if we are not deepening)
+    if ( deepen ) {
+        if ( p0 > 1 ) { fprintf (stderr, "ERROR: deepen= is not supported for pmin=%ux%lu\n", p0, pmin); return -1; }
+        uint128_t z = zmax128/deepen;
+        int m, j0;
+        for ( j0 = 1 ; (long double)z/3.847322101863072639L >= dmax ; j0++ ) z /= deepen;
+        for ( z = zmax128/deepen, m = 0 ; (long double)z/3.847322101863072639L >= _max(pmin,DEEPEN_DMIN) ; m++ ) z /= deepen;
+        if ( m < j0 ) report_printf ("No deepening passes, every pass with dmax below %lu would have dmax below %lu\n", dmax, _max(pmin,DEEPEN_DMIN));
+        for ( pass = m ; pass >= j0 ; pass-- ) {
+            pid_t pid = fork();
+            if ( pid < 0 ) { fprintf (stderr, "ERROR: Unable to fork deepening pass %d\n", pass); return -1; }
+            if ( ! pid ) break;
+            if ( waitpid (pid, &status, 0) != pid || ! WIFEXITED(status) || (WEXITSTATUS(status) && WEXITSTATUS(status) != 2 && WEXITSTATUS(status) != EXIT_FOUND) )
+                { fprintf (stderr, "ERROR: Deepening pass %d failed\n", pass); return -1; }
+            if ( WEXITSTATUS(status) == EXIT_FOUND ) return 0;
+        }
+        if ( pass < j0 ) pass = 0;
+        if ( pass ) {
+            for ( int j = 0 ; j < pass ; j++ ) zmax128 /= deepen;
+            zmaxbits = ui128_len(zmax128);
+            zmaxld = (long double) (zmax128 + (zmax128>>62) + 1);
+            dmax = _min (dmax, (uint64_t)((long double)zmax128/3.847322101863072639L));
+            pmax = _min (pmax, dmax);
+            if ( ivs ) nivs = ledger_subtract (ivs, nivs, pmax+1, ~(uint64_t)0);
+            report_checkpoint_pass (pass);         // keep the checkpoints of the full run and of the other passes out of our report_start
+            char zbuf[64];
+            report_printf ("Deepening pass %d of %d with zmax=%s and dmax=%lu\n", m-pass+1, m-j0+2, itoa128(zbuf,zmax128), dmax);
+        }
+    }
+
+    // in these modes a job's counts do not cover every d of the primes it has read (producers do not count the d's they hand to consumers),
+    // so we neither write checkpoints nor resume from them (an export or import that resumed would silently skip the primes below start_pmin)
+    if ( consumers || export || import || dlist ) report_no_checkpoints ();
     output_start (cores, k, p0, pmin, pmax, dmax, zmax128, opts);
     start_pmin = report_start (cores, k, p0, pmin, pmax, dmax, zmax128, opts);
+    zfilter_stats_start (cores);
+    sampler_stats_start (cores);
     precompute (k, p0>1?p0:pmin, p0>1?p0:pmax);
     if ( p0 > 1 ) {
         itabp0 = shared_malloc (p0*sizeof(*itabp0));
@@ -590,52 +1048,113 @@ int main (int argc, char *argv[])
     report_printf("Shared memory usage is %.3f MB\n", (double)shared_bytes()/(1<<20));
     assert (!private_bytes());
  
+    // in deep search mode every job works on every d in the list, so we set them up (and factor them) before forking
+    struct dsrec *dtab = 0;
+    int nds = 0;
+    if ( dlist ) {
+        for ( s = dlist, nds = 1 ; (s = strchr (s, ',')) ; s++ ) nds++;
+        dtab = malloc (nds*sizeof(*dtab));  assert (dtab);
+        if ( (nds = deep_setup (k, dlist, dtab)) < 0 ) return -1;
+    }
+
     if ( ! report_phase (PHASE_PRECOMPUTE) ) { report_end(); exit (0); }
 
     if ( profiling() ) {
-        allocate_private_buffers (); profile_start (); process_primes (primes_create_pipe(start_pmin,pmax,0,0,0),0,rbuf); profile_end (); free_private_buffers();
+        allocate_private_buffers (); profile_start (); process_primes (primes_create_pipe(start_pmin,pmax,0,budget.pipebuf,0),0,rbuf); profile_end (); free_private_buffers();
         assert(0);  // we should never get here, we should terminate in the call to profile_end above
     }
 
+    // in pipeline mode jobs 0..m-1 are consumers and the rest are producers (the last job, which prints progress, is always a pipe reader)
     pid_t pids[cores+1];
-    primes_pipe_ctx_t *pipe = primes_create_pipe (start_pmin, pmax, cores, 0, 0);
+    primes_pipe_ctx_t *pipe = primes_create_pipe (start_pmin, pmax, cores-consumers, budget.pipebuf, 0);
+    if ( p0 == 1 ) primes_pipe_cost (pipe, prime_cost);
+    if ( nivs > 1 ) primes_pipe_intervals (pipe, ivs, nivs);
+    if ( first ) zcheck_found = &pipe->stop;
+    report_pipe (pipe);
+    if ( consumers ) {
+        assert (DPIPE_BUFSIZE <= CUBEROOT_BUFSIZE);     // consumers read cuberoots into rbuf
+        dpipe = dpipe_create (cores-consumers, consumers, DPIPE_BUFSIZE);
+        report_printf ("Pipeline mode with %d producers and %d consumers\n", cores-consumers, consumers);
+    }
+    if ( export ) report_printf ("Exporting progressions to %s_0 ... %s_%d\n", export, export, cores-1);
+    if ( import ) report_printf ("Importing progressions from %s_0 ... %s_%u\n", import, import, files-1);
+    if ( dlist ) report_printf ("Deep search of %d d's with the progressions of each d split across %d jobs\n", nds, cores);
     for ( int i = 0 ; i < cores ; i++ ) {
         if ( !(pids[i]=fork()) ) {
+            int j = i-consumers;                        // our prime pipe reader (and d pipe ring in pipeline mode), negative for consumers
             allocate_private_buffers();
             if ( !i ) report_printf("Private memory usage is %d * %.3f MB = %.3f MB\n", cores, (double)private_bytes()/(1<<20), (double)(cores*private_bytes())/(1<<20));
+            if ( j < 0 ) report_waits (&dpipe->cons[i].wait_cycles, &dpipe->cons[i].waits);
+            else report_waits (&pipe->readers[j].wait_cycles, &pipe->readers[j].waits);
+            if ( consumers && j >= 0 ) dpipe_job = j;
             report_job_start (i);
-            if ( p0 > 1 ) process_subprimes (p0, itabp0, pipe, i, rbuf); else process_primes (pipe, i, rbuf);
+            sampler_start ();
+            trace_start (i, k, dmax, zmax128, smzmaskb);
+            if ( export && ! (progs_out = progs_create (export, i, cores, k, dmax, pmin, pmax, zmax128)) )
+                { fprintf (stderr, "ERROR: Unable to create progression file %s_%d\n", export, i); abort(); }
+            if ( dlist ) deep_ds (dtab, nds, i, cores); else if ( import ) import_ds (import, i, cores, files, rbuf); else if ( j < 0 ) consume_ds (i, rbuf); else if ( p0 > 1 ) process_subprimes (p0, itabp0, pipe, j, rbuf); else process_primes (pipe, j, rbuf);
+            if ( dpipe_job >= 0 ) dpipe_close (dpipe, dpipe_job);
+            if ( progs_out ) {
+                report_printf ("Exported %lu records with %lu progressions (%.1f MB, %.2f bytes/progression) to %s_%d\n", progs_out->recs, progs_out->roots,
+                               (double)(progs_out->bytes+progs_out->pos)/(1<<20), progs_out->roots ? (double)(progs_out->bytes+progs_out->pos)/progs_out->roots : 0.0, export, i);
+                progs_close (progs_out);
+            }
+            trace_end ();
+            sampler_end (i);
             report_job_end (i);
+            adapt_report (i);
+            zfilter_report (i);
+            zfilter_stats_end (i);
             free_private_buffers();
-            primes_close_pipe (pipe, i);
+            if ( j >= 0 && ! import && ! dlist ) primes_close_pipe (pipe, j);
             _exit (0);
         }
         if ( pids[i] < 0 ) { for ( int j = 0 ; j < i ; j++ ) { kill (pids[j],SIGTERM); } exit (-1); }
     }
-    // create a separate child to feed the rest (this is the only one that will call primesieve)
-    if ( !(pids[cores]=fork()) ) {
+    // create a separate child to feed the rest (this is the only one that will call primesieve), unless we are importing or in deep search mode
+    pids[cores] = 0;
+    if ( ! import && ! dlist && !(pids[cores]=fork()) ) {
         while (primes_feed_pipe(pipe)); // if a job aborts we may wait forever here, but parent will kill everyone if this happens
         primes_destroy_pipe (pipe);     // this will wait for our siblings to call primes_close_pipe
         _exit (0);
     }
     // if any child exits abnormally (e.g. due to an assert failure) kill them all and output an error
     while ( wait(&status) > 0 ) if ( !WIFEXITED(status) || WEXITSTATUS(status) ) {
-        for ( int i = 0 ; i <= cores ; i++ ) { kill (pids[i],SIGTERM); }
+        for ( int i = 0 ; i <= cores ; i++ ) if ( pids[i] > 0 ) { kill (pids[i],SIGTERM); }
         output_end (cores, k, p0, pmin, pmax, dmax, zmax128, opts, 1);
         exit (-1);
     }
 
+    if ( consumers ) {
+        uint64_t puts = 0, overflows = 0;
+        for ( int i = 0 ; i < cores-consumers ; i++ ) { puts += dpipe->rings[i].puts;  overflows += dpipe->rings[i].overflows; }
+        report_printf ("Producers handed %lu d's to consumers and processed %lu themselves (%.2f%%, ring full)\n", puts, overflows,
+                       puts+overflows ? 100.0*overflows/(puts+overflows) : 0.0);
+    }
+    int stopped = first && pipe->stop;
+    if ( stopped ) { report_keep_checkpoints ();  report_printf ("Stopped after the first solution\n"); }
+    if ( ledger && ! opts && ! stopped ) {
+        if ( ledger_record (ledger, k, dmax, zmax128, ivs, nivs) < 0 ) fprintf (stderr, "ERROR: Unable to append to ledger %s\n", ledger);
+        else report_printf ("Recorded coverage in ledger %s\n", ledger);
+    }
     report_end ();
-    if ( reporting() && argc > 7 ) {   // check for predictions specified on the command line that we want to compare against
-        uint64_t pcnt=0, ccnt=0, dcnt=0, rcnt=0;
+    zfilter_stats_output (k);
+    sampler_stats_output (k);
+    int failed = 0;
+    if ( reporting() && argc > 7 && ! pass ) {   // check for predictions specified on the command line that we want to compare against
+        int64_t pcnt=-1, ccnt=-1, dcnt=-1, rcnt=-1, scnt=-1;    // negative means no expectation (so that expected zeros are checked)
+        double cycr=0.0;
         for ( int i = 7 ; i < argc ; i++ ) {
-            if ( memcmp(argv[i],"pcnt=",5) == 0 ) pcnt = strto64(argv[i]+5);
-            if ( memcmp(argv[i],"ccnt=",5) == 0 ) ccnt = strto64(argv[i]+5);
-            if ( memcmp(argv[i],"dcnt=",5) == 0 ) dcnt = strto64(argv[i]+5);
-            if ( memcmp(argv[i],"rcnt=",5) == 0 ) rcnt = strto64(argv[i]+5);
+            if ( memcmp(argv[i],"pcnt=",5) == 0 ) pcnt = (int64_t)strto64(argv[i]+5);
+            if ( memcmp(argv[i],"ccnt=",5) == 0 ) ccnt = (int64_t)strto64(argv[i]+5);
+            if ( memcmp(argv[i],"dcnt=",5) == 0 ) dcnt = (int64_t)strto64(argv[i]+5);
+            if ( memcmp(argv[i],"rcnt=",5) == 0 ) rcnt = (int64_t)strto64(argv[i]+5);
+            if ( memcmp(argv[i],"scnt=",5) == 0 ) scnt = atoi(argv[i]+5);
+            if ( memcmp(argv[i],"cyc/r=",6) == 0 ) cycr = atof(argv[i]+6);
         }
-        report_comparisons (pcnt,ccnt,dcnt,rcnt);
+        failed = report_comparisons (pcnt,ccnt,dcnt,rcnt,scnt,cycr);
     }
     output_end (cores, k, p0, pmin, pmax, dmax, zmax128, opts, 0);
-    exit (0);
+    exit (pass && stopped ? EXIT_FOUND : failed ? 2 : 0);
 }
+#endif
@@ -0,0 +1,236 @@
+#ifndef _ZFILTER_INCLUDE_
+#define _ZFILTER_INCLUDE_
+
+#include <assert.h>
+#include <stdint.h>
+#include "cstd.h"
+#include "report.h"
+
+/*
+    Copyright (c) 2019-2020 Andrew R. Booker and Andrew V. Sutherland
+    See LICENSE file for license details.
+*/
+
+/*
+    Ordering of the filter stages applied to candidate z's in the z-check kernels zrcheckmany, zrcheckone, zrcheckafew (see zcheck.h).
+
+    Each kernel tests a candidate z against a chain of stages (zmin <= z <= zmax, z mod 64, z mod sm0..sm3 or mod the custom moduli m0,m1,q0..q3),
+    and those that pass all of them are checked with GMP.  The chain is split into two groups, the stages in the first group determine which z's
+    are counted by report_zpass (zmcnt), so we only ever reorder stages within a group.  The first stage of each chain is fixed (it is the test
+    the kernel is built around, e.g. the incrementally updated residue mod m0 in zrcheckmany) and is coded inline ahead of the chain.
+
+    By default the order is fixed (the one given in zfdefault below, which the compiler folds into straight-line code).  If ADAPTIVE is defined at
+    compile time, each worker keeps an order for each (kernel,si).  The remaining stages of the first group are hot, so rather than dispatching
+    on a runtime order for every z, each kernel is compiled once for each of the ZFPERMS orders of these stages (selected by v) and we pick one per
+    call; stages in the second group are only reached by a small fraction of z's and are applied in their runtime order.  One call in
+    ZFILTER_SAMPLE (v = -1) uses the runtime order throughout and counts how many z's each stage tests and passes.  Every ZFILTER_PERIOD
+    counted z's we sort the stages in each group by cost/(rejection rate), moving a stage ahead of another only if this improves the ratio by
+    more than 1/ZFILTER_SLACK.  The costs are fixed estimates in cycles (individual stages take just a few cycles, too few to time with rdtsc
+    without distorting them).  The counts decay by half at each reordering, so the order tracks the phase of the computation.
+
+    If FILTERSTATS is defined at compile time (this requires REPORT), each worker counts the z's tested and passed by every stage (including the
+    first) of every kernel in every phase, along with the number checked with GMP, and these are summed over workers and written to a FILTERS
+    line in the output file right after the STATS line.  For each phase and kernel that saw any z's this has an entry of the form
+
+        :<phase>.<kernel>=<z's tested>,<stage>:<passed>/<tested>,...,mpz:<z's checked with GMP>
+
+    with the stages listed in their default order (with the default order the z's tested by a stage are those passed by the one before it).
+    This is not meant for production runs, it adds a couple of increments per z.
+*/
+
+#if defined(FILTERSTATS) && ! defined(REPORT)
+#error FILTERSTATS requires REPORT
+#endif
+
+#define ZK_MANY         0       // kernel indexes (these match the location argument to report_z)
+#define ZK_ONE          1
+#define ZK_AFEW         2
+#define ZKERNELS        3
+
+#define ZF_RANGE        0       // zmin <= |z| <= zmax
+#define ZF_MOD64        1       // |z| mod 64
+#define ZF_SM0          2       // |z| mod sm0 (m0 = sm0 in zrcheckafew)
+#define ZF_SM1          3       // |z| mod sm1 (m1 = sm1 in zrcheckafew)
+#define ZF_SM2          4       // |z| mod sm2
+#define ZF_SM3          5       // |z| mod sm3
+#define ZF_BM0          6       // |z| mod m0 (custom bitmap in zrcheckmany)
+#define ZF_BM1          7       // |z| mod m1 (custom bitmap in zrcheckmany)
+#define ZF_Q0           8       // |z| mod q0 (in zrcheckmany)
+#define ZF_Q1           9
+#define ZF_Q2           10
+#define ZF_Q3           11
+#define ZFSTAGES        12
+#define ZF_MPZ          ZFSTAGES    // used to count the z's that pass every stage and are checked with GMP (FILTERSTATS only)
+#define ZFCHAIN         8       // maximum length of a chain
+#define ZFPERMS         6       // number of orders of stages 1,2,3 (the first group always has 4 stages)
+
+#define ZFILTER_SAMPLE  16      // one call in ZFILTER_SAMPLE counts passes (per kernel and si)
+#define ZFILTER_PERIOD  (1<<16) // number of counted z's between reorderings
+#define ZFILTER_SLACK   8       // hysteresis for reordering, stages with nearly the same rank don't keep trading places
+
+static const struct zfchain {
+    uint8_t n1, n;              // the first n1 stages form the first group, n is the total number of stages
+    uint8_t ord[ZFCHAIN];       // stages in the order they are applied (ord[0] is fixed and applied by the kernel before entering the chain)
+} zfdefault[ZKERNELS] = {
+    { 4, 8, { ZF_BM0, ZF_BM1, ZF_MOD64, ZF_RANGE, ZF_Q0, ZF_Q1, ZF_Q2, ZF_Q3 } },    // zrcheckmany
+    { 4, 6, { ZF_RANGE, ZF_MOD64, ZF_SM0, ZF_SM1, ZF_SM2, ZF_SM3 } },               // zrcheckone
+    { 4, 6, { ZF_SM0, ZF_SM1, ZF_MOD64, ZF_RANGE, ZF_SM2, ZF_SM3 } },               // zrcheckafew
+};
+
+// zfperm[v][s-1] is the position in zfdefault of the stage applied at position s in [1,3] by a kernel compiled for order v
+static const uint8_t zfperm[ZFPERMS][3] = { {1,2,3}, {1,3,2}, {2,1,3}, {2,3,1}, {3,1,2}, {3,2,1} };
+
+// estimated cost of each stage in cycles (these depend on the kernel, which may have the residue needed by a stage at hand or need to compute it,
+// e.g. zrcheckone has z in hand but zrcheckmany and zrcheckafew need to compute it before checking its range or its residue mod 64)
+static const uint8_t zfcost[ZKERNELS][ZFSTAGES] = {
+    { 4, 3, 0, 0, 0, 0, 2, 5, 4, 4, 4, 4 },
+    { 2, 1, 6, 9, 12, 12, 0, 0, 0, 0, 0, 0 },
+    { 4, 3, 2, 5, 12, 12, 0, 0, 0, 0, 0, 0 },
+};
+
+#if defined(FILTERSTATS) || defined(ADAPTIVE)
+static char *zfnames[ZFSTAGES+1] = { "range", "mod64", "sm0", "sm1", "sm2", "sm3", "bm0", "bm1", "q0", "q1", "q2", "q3", "mpz" };
+#endif
+
+#ifndef FILTERSTATS
+// records the result x of applying stage s to a z in kernel k and returns x
+static inline int zfilter_count (int k, unsigned s, int x) { return x; }
+static inline void zfilter_stats_start (int jobs) {}
+static inline void zfilter_stats_end (unsigned job) {}
+static inline void zfilter_stats_output (int k) {}
+#else
+static char *zfknames[ZKERNELS] = { "many", "one", "afew" };
+
+typedef uint64_t zfstats_t[PHASE_MAX+1][ZKERNELS][ZFSTAGES+1][2];
+static zfstats_t zfcnt;         // per-worker counts of z's tested and passed by each stage, indexed by phase and kernel
+static zfstats_t *zfstats;      // shared array with a copy of zfcnt for each job
+static int zfjobs;
+
+static inline int zfilter_count (int k, unsigned s, int x)
+    { uint64_t *c = zfcnt[current_phase][k][s]; c[0]++; c[1] += x; return x; }
+
+// called before we fork off jobs
+static void zfilter_stats_start (int jobs)
+    { zfjobs = jobs; zfstats = shared_calloc (jobs*sizeof(*zfstats)); }
+
+// called by each job when it is done
+static void zfilter_stats_end (unsigned job)
+    { assert (job < zfjobs); memcpy (zfstats[job], zfcnt, sizeof(zfcnt)); }
+
+// called after all jobs are done (and report_end has written the STATS line)
+static void zfilter_stats_output (int k)
+{
+    char buf[8192], tbuf[256], *s;
+    int i, j, n, p, x;
+
+    memset (zfcnt, 0, sizeof(zfcnt));
+    for ( i = 0 ; i < zfjobs ; i++ ) for ( p = 0 ; p <= PHASE_MAX ; p++ ) for ( x = 0 ; x < ZKERNELS ; x++ )
+        for ( j = 0 ; j <= ZFSTAGES ; j++ ) { zfcnt[p][x][j][0] += zfstats[i][p][x][j][0];  zfcnt[p][x][j][1] += zfstats[i][p][x][j][1]; }
+    s = buf + sprintf (buf, "FILTERS:%s:n=%d:k=%d", string_time(tbuf), zfjobs, k);
+    for ( p = 0 ; p <= PHASE_MAX ; p++ ) for ( x = 0 ; x < ZKERNELS ; x++ ) {
+        const struct zfchain *c = &zfdefault[x];
+        uint64_t *t = zfcnt[p][x][c->ord[0]];
+        if ( ! t[0] ) continue;
+        s += sprintf (s, ":%s.%s=%lu", phases[p], zfknames[x], t[0]);
+        for ( n = 0 ; n < c->n ; n++ ) { t = zfcnt[p][x][c->ord[n]]; s += sprintf (s, ",%s:%lu/%lu", zfnames[c->ord[n]], t[1], t[0]); }
+        s += sprintf (s, ",%s:%lu", zfnames[ZF_MPZ], zfcnt[p][x][ZF_MPZ][1]);
+    }
+    output (buf);
+}
+#endif
+
+#ifndef ADAPTIVE
+// returns the chain to use for kernel k and sign index si
+static inline const struct zfchain *zfilter_chain (int k, unsigned si) { return &zfdefault[k]; }
+// called when a z that passed stage 0 enters the chain in a kernel compiled for order v
+static inline void zfilter_start (int k, unsigned si, int v) {}
+// records the result x of applying stage s > 0 to a z in kernel k compiled for order v and returns x
+static inline int zfilter_pass (int k, unsigned si, int v, unsigned s, int x) { return zfilter_count (k,s,x); }
+static inline void zfilter_report (unsigned job) {}
+// makes the kernel call (which should pass zfv as its order) compiled for the order to use for (k,si)
+#define ZFILTER_DISPATCH(k,si,call)     { const int zfv = 0; call; }
+#define ZFILTER_INLINE                  static inline
+#else
+static struct zforder {
+    struct zfchain c;           // current chain
+    int v;                      // index of the order of stages 1,2,3 of c in zfperm
+    uint32_t calls;             // number of calls
+    uint32_t cnt;               // counted z's since the last reordering
+    uint64_t tested[ZFSTAGES];  // decayed counts of z's tested and passed by each stage
+    uint64_t passed[ZFSTAGES];
+    uint64_t reorders;          // number of times the order changed
+} zforders[ZKERNELS][2];
+static int zfinit;
+
+static inline const struct zfchain *zfilter_chain (int k, unsigned si) { return &zforders[k][si].c; }
+
+static inline void zfilter_start (int k, unsigned si, int v)
+    { if ( v < 0 ) zforders[k][si].cnt++; }
+
+static inline int zfilter_pass (int k, unsigned si, int v, unsigned s, int x)
+    { if ( v < 0 ) { struct zforder *o = &zforders[k][si]; o->tested[s]++; o->passed[s] += x; } return zfilter_count (k,s,x); }
+
+// rank of stage s in kernel k, scaled cost divided by (smoothed) rejection rate, lower is better
+static inline double zfilter_rank (int k, struct zforder *o, unsigned s)
+    { return (double)zfcost[k][s] * (o->tested[s]+2) / (o->tested[s]-o->passed[s]+1); }
+
+static void zfilter_reorder (int k, struct zforder *o)
+{
+    uint8_t *ord = o->c.ord, x;
+    int i, j, changed = 0;
+
+    // insertion sort each group by rank, leaving ord[0] in place (the groups have at most 4 stages)
+    for ( i = 2 ; i < o->c.n ; i++ ) {
+        if ( i == o->c.n1 ) continue;
+        x = ord[i];  double r = zfilter_rank(k,o,x) * (ZFILTER_SLACK+1) / ZFILTER_SLACK;
+        for ( j = i ; j > (i < o->c.n1 ? 1 : o->c.n1) && zfilter_rank(k,o,ord[j-1]) > r ; j-- ) { ord[j] = ord[j-1]; changed = 1; }
+        ord[j] = x;
+    }
+    o->reorders += changed;
+    for ( o->v = 0 ; o->v < ZFPERMS ; o->v++ ) {
+        for ( i = 1 ; i < 4 && ord[i] == zfdefault[k].ord[zfperm[o->v][i-1]] ; i++ );
+        if ( i == 4 ) break;
+    }
+    assert (o->v < ZFPERMS);
+    for ( i = 0 ; i < ZFSTAGES ; i++ ) { o->tested[i] >>= 1; o->passed[i] >>= 1; }
+    o->cnt = 0;
+}
+
+// returns the order v for which the kernel should be compiled for this call, or -1 to use the runtime order and count passes
+static inline int zfilter_variant (int k, unsigned si)
+{
+    if ( ! zfinit ) { for ( int i = 0 ; i < ZKERNELS ; i++ ) zforders[i][0].c = zforders[i][1].c = zfdefault[i]; zfinit = 1; }
+    struct zforder *o = &zforders[k][si];
+    if ( o->cnt >= ZFILTER_PERIOD ) zfilter_reorder (k,o);
+    return ++o->calls % ZFILTER_SAMPLE ? o->v : -1;
+}
+
+// kernels must be inlined into ZFILTER_DISPATCH for each order to be compiled separately
+#define ZFILTER_INLINE                  static inline __attribute__((always_inline))
+#define ZFILTER_DISPATCH(k,si,call)     switch ( zfilter_variant(k,si) ) {                                  \
+    case 0: { const int zfv = 0; call; } break;     case 1: { const int zfv = 1; call; } break;             \
+    case 2: { const int zfv = 2; call; } break;     case 3: { const int zfv = 3; call; } break;             \
+    case 4: { const int zfv = 4; call; } break;     case 5: { const int zfv = 5; call; } break;             \
+    default: { const int zfv = -1; call; } }
+
+// reports the current order of each chain (groups separated by |) and the number of times it changed
+static void zfilter_report (unsigned job)
+{
+    char buf[1024], *s = buf;
+    int k, si, i;
+
+    for ( k = 0 ; k < ZKERNELS ; k++ ) for ( si = 0 ; si < 2 ; si++ ) {
+        const struct zfchain *c = zfinit ? &zforders[k][si].c : &zfdefault[k];
+        s += sprintf (s, ":k%ds%d=", k, si);
+        for ( i = 0 ; i < c->n ; i++ ) s += sprintf (s, "%s%s", i ? (i == c->n1 ? "|" : ",") : "", zfnames[c->ord[i]]);
+        s += sprintf (s, "(%lu)", zforders[k][si].reorders);
+    }
+    report_printf ("ZORDER:job=%u%s\n", job, buf);
+}
+#endif
+
+// returns the stage applied at position s > 0 by kernel k compiled for order v (when v >= 0 and s is in the first group this is a constant)
+static inline unsigned zfilter_stage (int k, unsigned si, int v, unsigned s)
+    { return v >= 0 && s < zfdefault[k].n1 ? zfdefault[k].ord[zfperm[v][s-1]] : zfilter_chain(k,si)->ord[s]; }
+
+#endif